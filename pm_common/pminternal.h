@@ -67,6 +67,14 @@ typedef PmError (*pm_abort_fn)(struct pm_internal_struct *midi);
 typedef PmError (*pm_close_fn)(struct pm_internal_struct *midi);
 typedef PmError (*pm_poll_fn)(struct pm_internal_struct *midi);
 typedef unsigned int (*pm_check_host_error_fn)(struct pm_internal_struct *midi);
+/* pm_poll_descriptors_fn stores up to max file descriptors that become
+   readable when the device has input for the poll function to read, and
+   returns how many there are (0 if input arrives some other way) */
+typedef int (*pm_poll_descriptors_fn)(struct pm_internal_struct *midi,
+                                      int *fds, int max);
+/* pm_update_filters_fn is called after the accept table changes, so the
+   device can stop input that no stream accepts before it is read */
+typedef PmError (*pm_update_filters_fn)(struct pm_internal_struct *midi);
 
 typedef struct {
     pm_write_short_fn write_short; /* output short MIDI msg */
@@ -82,6 +90,8 @@ typedef struct {
     pm_poll_fn poll;   /* read pending midi events into portmidi buffer */
     pm_check_host_error_fn check_host_error; /* true when device has had host */
           /* error; sets pm_hosterror and writes message to pm_hosterror_text */
+    pm_poll_descriptors_fn poll_descriptors; /* see Pm_GetPollDescriptors */
+    pm_update_filters_fn update_filters; /* filters or channel mask changed */
 } pm_fns_node, *pm_fns_type;
 
 
@@ -105,14 +115,34 @@ extern int pm_descriptor_len;
 
 typedef uint32_t (*time_get_proc_type)(void *time_info);
 
+/* an entry in the input queue of a stream opened with Pm_OpenInput64():
+ * the PmEvent that Pm_Read() returns and the time in ns */
+typedef struct {
+    PmEvent event;
+    PmTimestamp64 time_ns;
+} pm_event64_slot;
+
+/* how many events an input callback may hold before delivering them */
+#define PM_CALLBACK_BATCH 64
+
 typedef struct pm_internal_struct {
     int device_id; /* which device is open (index to pm_descriptors) */
     short is_input; /* MIDI IN (true) or MIDI OUT (false) */
     short is_removed;  /* MIDI device was removed */
     PmTimeProcPtr time_proc; /* where to get the time */
     void *time_info; /* pass this to get_time() */
+    /* with Pm_OpenInput64(), the nanosecond clock, which time_proc reads
+     * in ms (with time_info pointing to this), otherwise NULL */
+    PmTimeProc64Ptr time_proc64;
+    void *time_info64;
+    /* when the input being passed to pm_read_short or pm_read_bytes
+     * arrived, in ns, if the device implementation knows, otherwise 0 */
+    PmTimestamp64 input_ns;
     int32_t buffer_len; /* how big is the buffer or queue? */
     PmQueue *queue;
+    /* PM_QUEUE_LOCKED if opened with pmKeyLockedInput, otherwise 0, for
+     * the queues made for input */
+    int32_t queue_flags;
 
     int32_t latency; /* time delay in ms between timestamps and actual output */
                   /* set to zero to get immediate, simple blocking output */
@@ -133,6 +163,37 @@ typedef struct pm_internal_struct {
     unsigned char running_status; /* running status byte or zero if none */
     int32_t filters; /* flags that filter incoming message classes */
     int32_t channel_mask; /* filter incoming messages based on channel */
+    /* non-zero for each status byte that filters and channel_mask let
+     * through, see pm_update_filters() */
+    unsigned char accept[256];
+    /* input callback, or NULL to enqueue input, see Pm_SetInputCallback()
+     * and pm_input_done(). This and the settings below it are only
+     * changed by the thread that reads input (see settings). */
+    PmInputCallback callback;
+    void *callback_user;
+    PmTimestamp callback_window; /* coalescing window in ms */
+    PmTimestamp callback_start; /* when the first held event arrived */
+    int32_t callback_len; /* how many events are held */
+    PmEvent callback_events[PM_CALLBACK_BATCH];
+    /* held controller values, see Pm_SetCoalescing(), or NULL */
+    struct pm_coalesce_struct *coalesce;
+    /* whole sysex messages, see Pm_SetSysExBuffer(), or NULL to pass
+     * sysex in PmEvents. While a message is received, sysex_in_progress
+     * is true and sysex_record points to it in the queue. */
+    PmQueue *sysex_queue;
+    unsigned char *sysex_record;
+    int32_t sysex_record_len; /* bytes received */
+    int32_t sysex_record_max; /* size of sysex_record */
+    PmTimestamp sysex_record_time; /* when the F0 arrived */
+    /* settings made by the application for the thread that reads input
+     * to apply, see pm_apply_settings() in portmidi.c, or NULL for
+     * output */
+    struct pm_input_settings_struct *settings;
+    /* read and write ends of a descriptor that pm_input_done() makes
+     * readable while the queue has input, or -1 until
+     * Pm_GetPollDescriptors() creates it (an eventfd has one fd, so
+     * both ends are the same) */
+    int wake_fd[2];
     PmTimestamp last_msg_time; /* timestamp of last message */
     PmTimestamp sync_time; /* time of last synchronization */
     PmTimestamp now; /* set by PmWrite to current time */
@@ -166,6 +227,7 @@ PmTimestamp none_synchronize(PmInternal *midi);
 PmError pm_fail_fn(PmInternal *midi);
 PmError pm_fail_timestamp_fn(PmInternal *midi, PmTimestamp timestamp);
 PmError pm_success_fn(PmInternal *midi);
+int pm_no_descriptors(PmInternal *midi, int *fds, int max);
 PmError pm_add_interf(const char *interf, pm_create_fn create_fn,
                       pm_delete_fn delete_fn);
 PmError pm_add_device(const char *interf, const char *name, int is_input,
@@ -174,16 +236,58 @@ void pm_undo_add_device(int id);
 uint32_t pm_read_bytes(PmInternal *midi, const unsigned char *data, int len,
                            PmTimestamp timestamp);
 void pm_read_short(PmInternal *midi, PmEvent *event);
+void pm_update_filters(PmInternal *midi);
+int pm_input_done(PmInternal *midi);
 
 #define none_write_flush pm_fail_timestamp_fn
 #define none_sysex pm_fail_timestamp_fn
 #define none_poll pm_fail_fn
 #define success_poll pm_success_fn
+#define none_poll_descriptors pm_no_descriptors
+#define none_update_filters pm_success_fn
 
 #define MIDI_REALTIME_MASK 0xf8
 #define is_real_time(msg) \
     ((Pm_MessageStatus(msg) & MIDI_REALTIME_MASK) == MIDI_REALTIME_MASK)
 
+/* Atomic operations for the index-based (PM_QUEUE_SPSC, etc.) queues
+ * in pmutil.c and for settings handed to the input thread in
+ * portmidi.c. C11 atomics are used where available. MSVC has no
+ * <stdatomic.h> in C mode, so Interlocked intrinsics (full barriers,
+ * which are at least as strong as acquire/release) are used there
+ * instead. pm_cas() is a compare-and-swap that returns non-zero if *p
+ * was expected and has been replaced by desired. pm_exchange() returns
+ * the old value, and pm_fence() is a full (sequentially consistent)
+ * memory barrier. They are not available to C++ implementations.
+ */
+#ifndef __cplusplus
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+typedef volatile long pm_atomic_long;
+#define pm_load_relaxed(p) (*(p))
+#define pm_load_acquire(p) _InterlockedOr((p), 0)
+#define pm_store_release(p, v) _InterlockedExchange((p), (v))
+#define pm_cas(p, expected, desired) \
+        (_InterlockedCompareExchange((p), (desired), (expected)) == (expected))
+#define pm_exchange(p, v) _InterlockedExchange((p), (v))
+#define pm_fence() MemoryBarrier()
+#else
+#include <stdatomic.h>
+typedef atomic_long pm_atomic_long;
+#define pm_load_relaxed(p) atomic_load_explicit((p), memory_order_relaxed)
+#define pm_load_acquire(p) atomic_load_explicit((p), memory_order_acquire)
+#define pm_store_release(p, v) \
+        atomic_store_explicit((p), (v), memory_order_release)
+#define pm_exchange(p, v) atomic_exchange((p), (v))
+#define pm_fence() atomic_thread_fence(memory_order_seq_cst)
+static inline int pm_cas(pm_atomic_long *p, long expected, long desired)
+{
+    return atomic_compare_exchange_strong_explicit(p, &expected, desired,
+            memory_order_acq_rel, memory_order_relaxed);
+}
+#endif
+#endif
+
 #ifdef __cplusplus
 }
 #endif
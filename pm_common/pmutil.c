@@ -7,61 +7,2176 @@
 #include "portmidi.h"
 #include "pmutil.h"
 #include "pminternal.h"
+#include "porttime.h"
 
 #ifdef WIN32
+#include <windows.h>
 #define bzero(addr, siz) memset(addr, 0, siz)
+#else
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
 #endif
 
 /* #define QUEUE_DEBUG 1 */
+/* #define QUEUE_EAGER_CLEAR 1 -- zero each light pipe message as soon as
+ * it is read rather than lagging behind the reader, to compare the two
+ * with "qtest -b" */
 #ifdef QUEUE_DEBUG
 #include "stdio.h"
 #endif
 
+struct pm_queue_wait_struct; /* see Pm_QueueWait() */
+struct pm_queue_stats_struct; /* see Pm_QueueGetStats() */
+
 typedef struct {
+    int32_t flags; /* PM_QUEUE_LIGHT_PIPE (must be first, see PmRingRep) */
+    /* wakeup state if created with PM_QUEUE_WAITABLE, otherwise NULL,
+     * and statistics (wait and stats must follow flags in every kind
+     * of queue) */
+    struct pm_queue_wait_struct *wait;
+    struct pm_queue_stats_struct *stats;
     long head;
     long tail;
     long len;
     long overflow;
+    long clear; /* next message to be zeroed by the reader, see Pm_Dequeue */
+    long cached_head; /* writer's copy of head, see queue_refresh */
     int32_t msg_size; /* number of int32_t in a message including extra word */
     int32_t peek_overflow;
     int32_t *buffer;
-    int32_t *peek;
+    int32_t *peek; /* peek buffer followed by the Pm_QueueReserve() buffer */
     int32_t peek_flag;
+    int32_t reserved; /* Pm_QueueReserve() buffer is in use */
 } PmQueueRep;
 
+/* the queues that keep their data in one allocation, with no pointers
+ * other than wait and stats */
+#define is_indexed(q) (((PmQueueRep *) (q))->flags & \
+        (PM_QUEUE_SPSC | PM_QUEUE_EVENT | PM_QUEUE_MPSC | PM_QUEUE_RECORD))
+/* internal flag for a queue in a shared memory mapping, see
+ * Pm_QueueCreateShared() */
+#define QUEUE_SHARED 0x10000
+#define is_shared(q) (((PmQueueRep *) (q))->flags & QUEUE_SHARED)
+/* internal flags for a queue placed in memory not from pm_alloc(), see
+ * queue_place(): QUEUE_MAPPED if the memory was mapped by storage_map()
+ * rather than passed to Pm_QueueCreateInPlace() */
+#define QUEUE_PLACED 0x20000
+#define QUEUE_MAPPED 0x40000
+#define is_placed(q) (((PmQueueRep *) (q))->flags & QUEUE_PLACED)
+
+
+/* fields written by different threads are separated by at least this
+ * many bytes so they never share a cache line */
+#define PM_CACHE_LINE 64
+
+/* PmRingRep is the PM_QUEUE_SPSC queue: a ring of msg_size-byte slots
+ * (one slot is always left empty to distinguish full from empty) with
+ * explicit head and tail indices. The consumer owns head and the
+ * producer owns tail; each keeps a cached copy of the other's index
+ * so that the other's cache line is only read when the cached value
+ * says the queue is empty (consumer) or full (producer). Messages are
+ * stored unencoded, so Pm_QueuePeek() returns a pointer into the ring.
+ * The slots follow the PmRingRep in the same allocation, so the queue
+ * holds no pointers and can be copied to shared memory (see
+ * Pm_QueueCreateShared()).
+ */
+typedef struct {
+    int32_t flags; /* PM_QUEUE_SPSC (must be first, see PmQueueRep) */
+    struct pm_queue_wait_struct *wait; /* see PmQueueRep */
+    struct pm_queue_stats_struct *stats; /* see PmQueueRep */
+    int32_t msg_size; /* bytes per slot */
+    long len; /* number of slots, i.e. num_msgs + 1 */
+    char pad0[PM_CACHE_LINE];
+    /* consumer (reader) data: */
+    pm_atomic_long head; /* next slot to read */
+    long cached_tail; /* consumer's copy of tail */
+    int32_t peek_flag; /* the slot at head has been returned by peek */
+    int32_t peek_overflow; /* peek cleared overflow, not yet reported */
+    char pad1[PM_CACHE_LINE];
+    /* producer (writer) data: */
+    pm_atomic_long tail; /* next slot to write */
+    long cached_head; /* producer's copy of head */
+    int32_t reserved; /* the slot at tail has been returned by reserve */
+    /* overflow is set to tail + 1 by the producer and reset to zero by
+     * the consumer when it reaches that position; see Pm_Dequeue() */
+    pm_atomic_long overflow;
+    char pad2[PM_CACHE_LINE];
+} PmRingRep;
+
+#define is_ring(q) (((PmQueueRep *) (q))->flags & PM_QUEUE_SPSC)
+/* ring_buffer -- address of the first slot */
+#define ring_buffer(ring) ((char *) ((ring) + 1))
+
+
+static PmQueue *ring_create(long num_msgs, int32_t int32s_per_msg)
+{
+    int32_t msg_size = int32s_per_msg * sizeof(int32_t);
+    PmRingRep *ring = (PmRingRep *) pm_alloc(sizeof(PmRingRep) +
+                                             (num_msgs + 1) * msg_size);
+    if (!ring) /* memory allocation failed */
+        return NULL;
+    ring->flags = PM_QUEUE_SPSC;
+    ring->wait = NULL;
+    ring->stats = NULL;
+    ring->msg_size = msg_size;
+    ring->len = num_msgs + 1;
+    ring->head = 0;
+    ring->cached_tail = 0;
+    ring->peek_flag = FALSE;
+    ring->peek_overflow = FALSE;
+    ring->tail = 0;
+    ring->cached_head = 0;
+    ring->reserved = FALSE;
+    ring->overflow = 0;
+    return ring;
+}
+
+
+/* ring_next -- advance a slot index with wrap-around */
+#define ring_next(ring, i) ((i) + 1 == (ring)->len ? 0 : (i) + 1)
+
+
+/* ring_head_ready -- consumer test for data at head. If the queue is
+ * empty and the producer has flagged an overflow at this position,
+ * the overflow is cleared and pmBufferOverflow is returned.
+ */
+static PmError ring_head_ready(PmRingRep *ring, long head)
+{
+    if (head == ring->cached_tail) {
+        ring->cached_tail = pm_load_acquire(&ring->tail);
+        if (head == ring->cached_tail) {
+            /* same protocol as the light pipe: the producer stops at
+             * the overflow position, so when the consumer has read
+             * everything up to that point, report the overflow */
+            if (pm_load_acquire(&ring->overflow) == head + 1) {
+                pm_store_release(&ring->overflow, 0);
+                return pmBufferOverflow;
+            }
+            return pmNoData;
+        }
+    }
+    return pmGotData;
+}
+
+
+static PmError ring_dequeue(PmRingRep *ring, void *msg)
+{
+    long head;
+    PmError rslt;
+    if (ring->peek_overflow) {
+        ring->peek_overflow = FALSE;
+        return pmBufferOverflow;
+    }
+    head = pm_load_relaxed(&ring->head);
+    if (ring->peek_flag) {
+        ring->peek_flag = FALSE; /* peeked data is still in the ring */
+    } else if ((rslt = ring_head_ready(ring, head)) != pmGotData) {
+        return rslt;
+    }
+    memcpy(msg, ring_buffer(ring) + head * ring->msg_size, ring->msg_size);
+    pm_store_release(&ring->head, ring_next(ring, head));
+    return pmGotData;
+}
+
+
+static PmError ring_enqueue(PmRingRep *ring, void *msg)
+{
+    long tail;
+    long next;
+    /* no more enqueue until receiver acknowledges overflow */
+    if (pm_load_acquire(&ring->overflow)) return pmBufferOverflow;
+    tail = pm_load_relaxed(&ring->tail);
+    next = ring_next(ring, tail);
+    if (next == ring->cached_head) {
+        ring->cached_head = pm_load_acquire(&ring->head);
+        if (next == ring->cached_head) {
+            pm_store_release(&ring->overflow, tail + 1);
+            return pmBufferOverflow;
+        }
+    }
+    memcpy(ring_buffer(ring) + tail * ring->msg_size, msg, ring->msg_size);
+    pm_store_release(&ring->tail, next);
+    return pmNoError;
+}
+
+
+static void *ring_peek(PmRingRep *ring)
+{
+    long head = pm_load_relaxed(&ring->head);
+    if (!ring->peek_flag) {
+        /* if peek_overflow is set, an overflow has been cleared but not
+         * yet reported by Pm_Dequeue(); we can still look for data */
+        PmError rslt = ring_head_ready(ring, head);
+        if (rslt == pmBufferOverflow) {
+            ring->peek_overflow = TRUE;
+            return NULL;
+        } else if (rslt != pmGotData) {
+            return NULL;
+        }
+        ring->peek_flag = TRUE;
+    }
+    return ring_buffer(ring) + head * ring->msg_size;
+}
+
+
+/* ring_reserve -- return the slot at tail for the producer to fill in
+ * place, or NULL if the queue is full (flagging the overflow, since
+ * the message will be dropped) or already in overflow.
+ */
+static void *ring_reserve(PmRingRep *ring)
+{
+    long tail;
+    long next;
+    if (pm_load_acquire(&ring->overflow)) return NULL;
+    tail = pm_load_relaxed(&ring->tail);
+    if (!ring->reserved) {
+        next = ring_next(ring, tail);
+        if (next == ring->cached_head) {
+            ring->cached_head = pm_load_acquire(&ring->head);
+            if (next == ring->cached_head) {
+                pm_store_release(&ring->overflow, tail + 1);
+                return NULL;
+            }
+        }
+        ring->reserved = TRUE;
+    }
+    return ring_buffer(ring) + tail * ring->msg_size;
+}
+
+
+static PmError ring_commit(PmRingRep *ring)
+{
+    if (!ring->reserved) return pmBadPtr;
+    ring->reserved = FALSE;
+    pm_store_release(&ring->tail,
+                     ring_next(ring, pm_load_relaxed(&ring->tail)));
+    return pmNoError;
+}
+
+
+/* ring_release -- remove the message returned by ring_peek() without
+ * copying it
+ */
+static PmError ring_release(PmRingRep *ring)
+{
+    PmError rslt = pmGotData;
+    if (ring->peek_overflow) {
+        ring->peek_overflow = FALSE;
+        rslt = pmBufferOverflow;
+    }
+    if (ring->peek_flag) {
+        ring->peek_flag = FALSE;
+        pm_store_release(&ring->head,
+                         ring_next(ring, pm_load_relaxed(&ring->head)));
+    } else if (rslt == pmGotData) {
+        rslt = pmNoData; /* nothing to release */
+    }
+    return rslt;
+}
+
+
+/* ring_enqueue_batch -- copy up to n messages into the ring, publishing
+ * tail once. If not all n messages fit, the overflow is flagged at the
+ * position of the first dropped message.
+ */
+static int ring_enqueue_batch(PmRingRep *ring, const char *msgs, int n)
+{
+    long tail;
+    long room; /* free slots */
+    long first; /* slots from tail to the end of the buffer */
+    int count;
+    if (pm_load_acquire(&ring->overflow)) return 0;
+    tail = pm_load_relaxed(&ring->tail);
+    room = ring->cached_head - tail - 1;
+    if (room < 0) room += ring->len;
+    if (room < n) {
+        ring->cached_head = pm_load_acquire(&ring->head);
+        room = ring->cached_head - tail - 1;
+        if (room < 0) room += ring->len;
+    }
+    count = (room < n ? (int) room : n);
+    first = ring->len - tail;
+    if (first > count) first = count;
+    memcpy(ring_buffer(ring) + tail * ring->msg_size, msgs, first * ring->msg_size);
+    memcpy(ring_buffer(ring), msgs + first * ring->msg_size,
+           (count - first) * ring->msg_size);
+    tail += count;
+    if (tail >= ring->len) tail -= ring->len;
+    pm_store_release(&ring->tail, tail);
+    if (count < n) { /* msgs[count] is dropped */
+        pm_store_release(&ring->overflow, tail + 1);
+    }
+    return count;
+}
+
+
+/* ring_dequeue_batch -- copy up to max messages out of the ring,
+ * publishing head once. Stops just before an overflow so that the
+ * overflow is reported, as pmBufferOverflow, by the next call.
+ */
+static int ring_dequeue_batch(PmRingRep *ring, char *msgs, int max)
+{
+    long head;
+    long avail; /* readable slots */
+    long first; /* slots from head to the end of the buffer */
+    int count;
+    if (ring->peek_overflow) {
+        ring->peek_overflow = FALSE;
+        return pmBufferOverflow;
+    }
+    ring->peek_flag = FALSE; /* peeked data is still in the ring */
+    head = pm_load_relaxed(&ring->head);
+    avail = ring->cached_tail - head;
+    if (avail < 0) avail += ring->len;
+    if (avail < max) {
+        if (avail == 0) {
+            PmError rslt = ring_head_ready(ring, head);
+            if (rslt != pmGotData) return rslt; /* no data or overflow */
+        } else {
+            ring->cached_tail = pm_load_acquire(&ring->tail);
+        }
+        avail = ring->cached_tail - head;
+        if (avail < 0) avail += ring->len;
+    }
+    count = (avail < max ? (int) avail : max);
+    first = ring->len - head;
+    if (first > count) first = count;
+    memcpy(msgs, ring_buffer(ring) + head * ring->msg_size, first * ring->msg_size);
+    memcpy(msgs + first * ring->msg_size, ring_buffer(ring),
+           (count - first) * ring->msg_size);
+    head += count;
+    if (head >= ring->len) head -= ring->len;
+    pm_store_release(&ring->head, head);
+    return count;
+}
+
+
+/* PmEventQueueRep is the PM_QUEUE_EVENT queue. It is organized like
+ * PmRingRep, but each slot holds exactly one 8-byte PmEvent, so it is
+ * copied with a single 64-bit load and store, and no slot is wasted:
+ * the number of slots (cap) is a power of two, and head and tail count
+ * modulo 2 * cap, so that full (tail - head == cap) and empty
+ * (tail == head) are distinct. The slot for an index is found with
+ * (index & (cap - 1)), and indices advance with (index + 1) & mask.
+ * Like the ring, a message is published by the release store of tail:
+ * a PmEvent may legitimately be all zeros, so slots cannot carry their
+ * own "data valid" tag as they do in the light pipe.
+ */
+typedef struct {
+    int32_t flags; /* PM_QUEUE_EVENT (must be first, see PmQueueRep) */
+    struct pm_queue_wait_struct *wait; /* see PmQueueRep */
+    struct pm_queue_stats_struct *stats; /* see PmQueueRep */
+    long cap; /* number of slots, a power of two */
+    long mask; /* 2 * cap - 1 */
+    /* sequence numbers for PM_OVERFLOW_DROP_OLDEST (see evq_seq): cap
+     * of them follow the slots if seq_inline, otherwise they are
+     * allocated by Pm_QueueSetOverflowPolicy(), or NULL */
+    pm_atomic_long *seqs;
+    int32_t seq_inline;
+    char pad0[PM_CACHE_LINE];
+    /* consumer (reader) data: */
+    pm_atomic_long head; /* next index to read */
+    long cached_tail; /* consumer's copy of tail */
+    int32_t peek_flag; /* the slot at head has been returned by peek */
+    int32_t peek_overflow; /* peek cleared overflow, not yet reported */
+    /* messages are claimed with compare-and-swap (see evq_take), set
+     * by the consumer and never cleared, and the consumer has reached
+     * seq_start, after which the producer may evict */
+    int32_t shared_head;
+    pm_atomic_long seq_mode;
+    char pad1[PM_CACHE_LINE];
+    /* producer (writer) data: */
+    pm_atomic_long tail; /* next index to write */
+    long cached_head; /* producer's copy of head */
+    int32_t reserved; /* the slot at tail has been returned by reserve */
+    /* overflow is set to tail + 1 (never 0, since tail <= mask) by the
+     * producer and reset to zero by the consumer, as in PmRingRep */
+    pm_atomic_long overflow;
+    /* 1 + the index of the first message with a sequence number, or 0
+     * until the producer first evicts, and every slot has one */
+    pm_atomic_long seq_start;
+    int32_t seq_full;
+    char pad2[PM_CACHE_LINE];
+} PmEventQueueRep;
+
+#define is_event_queue(q) (((PmQueueRep *) (q))->flags & PM_QUEUE_EVENT)
+
+/* evq_buffer -- address of the first slot, which follows the
+ * PmEventQueueRep as in PmRingRep */
+#define evq_buffer(evq) ((uint64_t *) ((evq) + 1))
+/* evq_slot -- address of the slot for index i */
+#define evq_slot(evq, i) (evq_buffer(evq) + ((i) & ((evq)->cap - 1)))
+/* evq_count -- number of messages from index h to index t */
+#define evq_count(evq, h, t) (((t) - (h)) & (evq)->mask)
+/* evq_seq -- address of the sequence number of the slot for index i */
+#define evq_seq(evq, i) (((evq)->seq_inline ? \
+        (pm_atomic_long *) (evq_buffer(evq) + (evq)->cap) : (evq)->seqs) + \
+        ((i) & ((evq)->cap - 1)))
+
+
+/* evq_create -- with_seqs reserves the sequence numbers needed by
+ * PM_OVERFLOW_DROP_OLDEST in the same allocation */
+static PmQueue *evq_create(long num_msgs, int with_seqs)
+{
+    PmEventQueueRep *evq;
+    long cap = 2; /* evq_take needs two slots, see below */
+    long i;
+    while (cap < num_msgs) cap <<= 1;
+    evq = (PmEventQueueRep *) pm_alloc(sizeof(PmEventQueueRep) +
+            cap * (sizeof(uint64_t) +
+                   (with_seqs ? sizeof(pm_atomic_long) : 0)));
+    if (!evq) /* memory allocation failed */
+        return NULL;
+    evq->flags = PM_QUEUE_EVENT;
+    evq->wait = NULL;
+    evq->stats = NULL;
+    evq->cap = cap;
+    evq->mask = 2 * cap - 1;
+    evq->seqs = NULL;
+    evq->seq_inline = with_seqs;
+    for (i = 0; with_seqs && i < cap; i++) /* matches no index + 1 */
+        *evq_seq(evq, i) = -1;
+    evq->head = 0;
+    evq->cached_tail = 0;
+    evq->peek_flag = FALSE;
+    evq->peek_overflow = FALSE;
+    evq->shared_head = FALSE;
+    evq->tail = 0;
+    evq->cached_head = 0;
+    evq->reserved = FALSE;
+    evq->overflow = 0;
+    /* with_seqs is for PM_OVERFLOW_DROP_OLDEST from the start, so every
+     * message can have a sequence number */
+    evq->seq_mode = with_seqs;
+    evq->seq_start = (with_seqs ? 1 : 0);
+    evq->seq_full = FALSE;
+    return evq;
+}
+
+
+/* evq_head_ready -- consumer test for data at head, see ring_head_ready */
+static PmError evq_head_ready(PmEventQueueRep *evq, long head)
+{
+    if (head == evq->cached_tail) {
+        evq->cached_tail = pm_load_acquire(&evq->tail);
+        if (head == evq->cached_tail) {
+            if (pm_load_acquire(&evq->overflow) == head + 1) {
+                pm_store_release(&evq->overflow, 0);
+                return pmBufferOverflow;
+            }
+            return pmNoData;
+        }
+    }
+    return pmGotData;
+}
+
+
+/* With PM_OVERFLOW_DROP_OLDEST, a producer that finds the queue full
+ * evicts the oldest message and writes the new one in its slot, so
+ * the slots need an owner, as in PmMpscRep: each has a sequence number
+ * that is index + 1 (modulo 2 * cap) once the message at index is
+ * published, and index + cap once the slot may be written again. The
+ * consumer (evq_take) claims the message at head by advancing head
+ * with a compare-and-swap, copies it, and then frees the slot; the
+ * producer (evq_evict) claims the oldest message with the same
+ * compare-and-swap and frees its slot at once. Whichever loses the
+ * race leaves the message to the other, so no slot is ever read while
+ * it is written. (Since the producer's own claim can move head on
+ * while a consumer waits to claim, head may come back to the same
+ * index; with at least two slots the message there is then a
+ * published one that the consumer may take.)
+ *
+ * If the policy is set on a queue that is in use, the sequence numbers
+ * are only kept from the producer's first attempt to evict on
+ * (seq_start). Messages written before that are read without claiming
+ * them, as in the other modes, and the consumer switches to claiming
+ * (seq_mode) when it reaches seq_start. Until then, head is only
+ * advanced by the consumer, and a producer that would have to evict
+ * drops the new message instead.
+ */
+
+/* evq_slot_free -- producer: test whether the slot for index i (at or
+ * after tail) may be written */
+static int evq_slot_free(PmEventQueueRep *evq, long i)
+{
+    long start = pm_load_relaxed(&evq->seq_start);
+    if (start && (evq->seq_full ||
+                  evq_count(evq, start - 1, i) >= evq->cap)) {
+        /* the last message in the slot had a sequence number */
+        return pm_load_acquire(evq_seq(evq, i)) == i;
+    }
+    if (evq_count(evq, evq->cached_head, i) >= evq->cap) {
+        evq->cached_head = pm_load_acquire(&evq->head);
+        return evq_count(evq, evq->cached_head, i) < evq->cap;
+    }
+    return TRUE;
+}
+
+
+/* evq_tail_ready -- producer test for room at tail. If the queue is
+ * full, the overflow is flagged at tail and pmBufferOverflow returned.
+ */
+static PmError evq_tail_ready(PmEventQueueRep *evq, long tail)
+{
+    if (!evq_slot_free(evq, tail)) {
+        pm_store_release(&evq->overflow, tail + 1);
+        return pmBufferOverflow;
+    }
+    return pmNoError;
+}
+
+
+/* evq_publish -- producer: make count messages at tail readable */
+static void evq_publish(PmEventQueueRep *evq, long tail, int count)
+{
+    long start = pm_load_relaxed(&evq->seq_start);
+    int i;
+    for (i = 0; start && i < count; i++) {
+        long index = (tail + i) & evq->mask;
+        pm_store_release(evq_seq(evq, index), (index + 1) & evq->mask);
+    }
+    tail = (tail + count) & evq->mask;
+    pm_store_release(&evq->tail, tail);
+    if (start && !evq->seq_full &&
+        evq_count(evq, start - 1, tail) >= evq->cap)
+        evq->seq_full = TRUE;
+}
+
+
+/* evq_evict -- producer (PM_OVERFLOW_DROP_OLDEST): make room for n
+ * (<= cap) messages at tail by evicting the oldest, adding the number
+ * evicted to *evicted. Returns how many of the n can be written.
+ */
+static int evq_evict(PmEventQueueRep *evq, int n, uint64_t *evicted)
+{
+    long tail = pm_load_relaxed(&evq->tail);
+    int i;
+    if (!pm_load_relaxed(&evq->seq_start))
+        pm_store_release(&evq->seq_start, tail + 1);
+    for (i = 0; i < n; i++) {
+        long index = (tail + i) & evq->mask;
+        long oldest = (index + evq->cap) & evq->mask; /* index - cap */
+        if (evq_slot_free(evq, index))
+            continue;
+        if (!pm_load_acquire(&evq->seq_mode))
+            break; /* the oldest message cannot be evicted yet */
+        if (!pm_cas(&evq->head, oldest, (oldest + 1) & evq->mask)) {
+            /* the consumer claimed it, and may still be copying it */
+            if (evq_slot_free(evq, index))
+                continue;
+            break;
+        }
+        (*evicted)++;
+        pm_store_release(evq_seq(evq, index), index); /* free */
+    }
+    return i;
+}
+
+
+/* evq_copy -- consumer: copy count messages starting at index head to
+ * msgs, or, if timestamps is not NULL, split them into message words
+ * at msgs and timestamps at timestamps (see Pm_DequeueBatchSoA)
+ */
+static void evq_copy(PmEventQueueRep *evq, long head, int count, char *msgs,
+                     PmTimestamp *timestamps)
+{
+    long first = evq->cap - (head & (evq->cap - 1)); /* slots before wrap */
+    const PmEvent *src = (const PmEvent *) evq_slot(evq, head);
+    const PmEvent *wrapped = (const PmEvent *) evq_buffer(evq);
+    PmMessage *messages = (PmMessage *) msgs;
+    int i;
+    if (first > count) first = count;
+    if (!timestamps) {
+        memcpy(msgs, src, first * sizeof(uint64_t));
+        memcpy(msgs + first * sizeof(uint64_t), wrapped,
+               (count - first) * sizeof(uint64_t));
+        return;
+    }
+    /* simple loops that compilers vectorize */
+    for (i = 0; i < first; i++) {
+        messages[i] = src[i].message;
+        timestamps[i] = src[i].timestamp;
+    }
+    for (; i < count; i++) {
+        messages[i] = wrapped[i - first].message;
+        timestamps[i] = wrapped[i - first].timestamp;
+    }
+}
+
+
+/* evq_take -- consumer: remove up to max messages when shared_head is
+ * set. Returns the number removed, or pmBufferOverflow.
+ */
+static int evq_take(PmEventQueueRep *evq, char *msgs,
+                    PmTimestamp *timestamps, int max)
+{
+    long head = pm_load_acquire(&evq->head);
+    int count = 0;
+    evq->peek_flag = FALSE;
+    while (count < max && !pm_load_relaxed(&evq->seq_mode)) {
+        /* unclaimed messages, up to seq_start, which is read after
+         * tail so that it is set if tail is past it */
+        long avail = evq_count(evq, head, pm_load_acquire(&evq->tail));
+        long start = pm_load_acquire(&evq->seq_start);
+        if (start && head == start - 1) {
+            pm_store_release(&evq->seq_mode, TRUE);
+            break;
+        }
+        if (start && avail > evq_count(evq, head, start - 1))
+            avail = evq_count(evq, head, start - 1);
+        if (avail == 0)
+            break;
+        if (avail > max - count)
+            avail = max - count;
+        evq_copy(evq, head, (int) avail, msgs + count * sizeof(uint64_t),
+                 timestamps ? timestamps + count : NULL);
+        head = (head + avail) & evq->mask;
+        pm_store_release(&evq->head, head);
+        count += (int) avail;
+    }
+    while (count < max && pm_load_relaxed(&evq->seq_mode)) {
+        pm_atomic_long *seq = evq_seq(evq, head);
+        if (pm_load_acquire(seq) != ((head + 1) & evq->mask)) {
+            long now = pm_load_acquire(&evq->head);
+            if (now == head)
+                break; /* no data */
+            head = now; /* the producer evicted it */
+        } else if (pm_cas(&evq->head, head, (head + 1) & evq->mask)) {
+            evq_copy(evq, head, 1, msgs + count * sizeof(uint64_t),
+                     timestamps ? timestamps + count : NULL);
+            pm_store_release(seq, (head + evq->cap) & evq->mask);
+            head = (head + 1) & evq->mask;
+            count++;
+        } else {
+            head = pm_load_acquire(&evq->head);
+        }
+    }
+    if (count == 0 && pm_load_acquire(&evq->overflow) == head + 1 &&
+        head == pm_load_acquire(&evq->tail)) {
+        pm_store_release(&evq->overflow, 0);
+        return pmBufferOverflow;
+    }
+    return count;
+}
+
+
+static PmError evq_dequeue(PmEventQueueRep *evq, void *msg)
+{
+    long head;
+    PmError rslt;
+    if (evq->peek_overflow) {
+        evq->peek_overflow = FALSE;
+        return pmBufferOverflow;
+    }
+    if (evq->shared_head) {
+        int count = evq_take(evq, (char *) msg, NULL, 1);
+        return (count == 1 ? pmGotData : count);
+    }
+    head = pm_load_relaxed(&evq->head);
+    if (evq->peek_flag) {
+        evq->peek_flag = FALSE; /* peeked data is still in the queue */
+    } else if ((rslt = evq_head_ready(evq, head)) != pmGotData) {
+        return rslt;
+    }
+    memcpy(msg, evq_slot(evq, head), sizeof(uint64_t));
+    pm_store_release(&evq->head, (head + 1) & evq->mask);
+    return pmGotData;
+}
+
+
+static PmError evq_enqueue(PmEventQueueRep *evq, void *msg)
+{
+    long tail;
+    /* no more enqueue until receiver acknowledges overflow */
+    if (pm_load_acquire(&evq->overflow)) return pmBufferOverflow;
+    tail = pm_load_relaxed(&evq->tail);
+    if (evq_tail_ready(evq, tail) != pmNoError) return pmBufferOverflow;
+    memcpy(evq_slot(evq, tail), msg, sizeof(uint64_t));
+    evq_publish(evq, tail, 1);
+    return pmNoError;
+}
+
+
+/* evq_peek -- returns NULL once messages are claimed (shared_head),
+ * since a message that is not claimed may be evicted and overwritten
+ * while the caller reads it */
+static void *evq_peek(PmEventQueueRep *evq)
+{
+    long head = pm_load_relaxed(&evq->head);
+    if (evq->shared_head)
+        return NULL;
+    if (!evq->peek_flag) {
+        PmError rslt = evq_head_ready(evq, head);
+        if (rslt == pmBufferOverflow) {
+            evq->peek_overflow = TRUE;
+            return NULL;
+        } else if (rslt != pmGotData) {
+            return NULL;
+        }
+        evq->peek_flag = TRUE;
+    }
+    return evq_slot(evq, head);
+}
+
+
+static void *evq_reserve(PmEventQueueRep *evq)
+{
+    long tail;
+    if (pm_load_acquire(&evq->overflow)) return NULL;
+    tail = pm_load_relaxed(&evq->tail);
+    if (!evq->reserved) {
+        if (evq_tail_ready(evq, tail) != pmNoError) return NULL;
+        evq->reserved = TRUE;
+    }
+    return evq_slot(evq, tail);
+}
+
+
+static PmError evq_commit(PmEventQueueRep *evq)
+{
+    if (!evq->reserved) return pmBadPtr;
+    evq->reserved = FALSE;
+    evq_publish(evq, pm_load_relaxed(&evq->tail), 1);
+    return pmNoError;
+}
+
+
+static PmError evq_release(PmEventQueueRep *evq)
+{
+    PmError rslt = pmGotData;
+    if (evq->peek_overflow) {
+        evq->peek_overflow = FALSE;
+        rslt = pmBufferOverflow;
+    }
+    if (evq->peek_flag) {
+        evq->peek_flag = FALSE;
+        pm_store_release(&evq->head,
+                         (pm_load_relaxed(&evq->head) + 1) & evq->mask);
+    } else if (rslt == pmGotData) {
+        rslt = pmNoData; /* nothing to release */
+    }
+    return rslt;
+}
+
+
+/* evq_enqueue_batch -- see ring_enqueue_batch */
+static int evq_enqueue_batch(PmEventQueueRep *evq, const char *msgs, int n)
+{
+    long tail;
+    long room; /* free slots */
+    long first; /* slots from tail to the end of the buffer */
+    int count;
+    if (pm_load_acquire(&evq->overflow)) return 0;
+    tail = pm_load_relaxed(&evq->tail);
+    if (pm_load_relaxed(&evq->seq_start)) {
+        /* slots are freed one at a time, see evq_take */
+        for (room = 0; room < n; room++) {
+            if (!evq_slot_free(evq, (tail + room) & evq->mask)) break;
+        }
+    } else {
+        room = evq->cap - evq_count(evq, evq->cached_head, tail);
+        if (room < n) {
+            evq->cached_head = pm_load_acquire(&evq->head);
+            room = evq->cap - evq_count(evq, evq->cached_head, tail);
+        }
+    }
+    count = (room < n ? (int) room : n);
+    first = evq->cap - (tail & (evq->cap - 1));
+    if (first > count) first = count;
+    memcpy(evq_slot(evq, tail), msgs, first * sizeof(uint64_t));
+    memcpy(evq_buffer(evq), msgs + first * sizeof(uint64_t),
+           (count - first) * sizeof(uint64_t));
+    evq_publish(evq, tail, count);
+    if (count < n) { /* msgs[count] is dropped */
+        pm_store_release(&evq->overflow, ((tail + count) & evq->mask) + 1);
+    }
+    return count;
+}
+
+
+/* evq_dequeue_batch -- see ring_dequeue_batch; timestamps is as in
+ * evq_copy */
+static int evq_dequeue_batch(PmEventQueueRep *evq, char *msgs,
+                             PmTimestamp *timestamps, int max)
+{
+    long head;
+    long avail; /* readable slots */
+    int count;
+    if (evq->peek_overflow) {
+        evq->peek_overflow = FALSE;
+        return pmBufferOverflow;
+    }
+    if (evq->shared_head)
+        return evq_take(evq, msgs, timestamps, max);
+    evq->peek_flag = FALSE; /* peeked data is still in the queue */
+    head = pm_load_relaxed(&evq->head);
+    avail = evq_count(evq, head, evq->cached_tail);
+    if (avail < max) {
+        if (avail == 0) {
+            PmError rslt = evq_head_ready(evq, head);
+            if (rslt != pmGotData) return rslt; /* no data or overflow */
+        } else {
+            evq->cached_tail = pm_load_acquire(&evq->tail);
+        }
+        avail = evq_count(evq, head, evq->cached_tail);
+    }
+    count = (avail < max ? (int) avail : max);
+    evq_copy(evq, head, count, msgs, timestamps);
+    pm_store_release(&evq->head, (head + count) & evq->mask);
+    return count;
+}
+
+
+/* PmMpscRep is the PM_QUEUE_MPSC queue, a bounded queue that any
+ * number of producers may write, after Dmitry Vyukov's bounded MPMC
+ * queue. Positions count up without wrapping back to zero; the slot
+ * for a position is found by masking with cap - 1 (cap is a power of
+ * two). Each slot begins with a sequence number: a producer may claim
+ * the slot for position pos when its sequence number is pos, which it
+ * does by advancing tail from pos to pos + 1 with a compare-and-swap,
+ * then copies the message and publishes it by storing pos + 1 in the
+ * sequence number. After reading it, the consumer stores pos + cap,
+ * making the slot available for the next trip around the ring.
+ *
+ * Producers also keep at most num_msgs messages in the queue (checked
+ * against head, which they cache), so the capacity is exactly num_msgs.
+ *
+ * The overflow protocol is the same as in the other queues, except that
+ * several producers can be between checking overflow and claiming a
+ * slot when it is set, so the consumer reports the overflow when it
+ * finds no data at or after the overflow position, not only at it.
+ */
+typedef struct {
+    int32_t flags; /* PM_QUEUE_MPSC (must be first, see PmQueueRep) */
+    struct pm_queue_wait_struct *wait; /* see PmQueueRep */
+    struct pm_queue_stats_struct *stats; /* see PmQueueRep */
+    int32_t msg_size; /* bytes per message */
+    long slot_size; /* bytes per slot: MPSC_DATA + message, rounded up */
+    long cap; /* number of slots, a power of two */
+    long num_msgs; /* capacity */
+    char pad0[PM_CACHE_LINE];
+    /* consumer (reader) data: */
+    pm_atomic_long head; /* next position to read */
+    int32_t peek_flag; /* the slot at head has been returned by peek */
+    int32_t peek_overflow; /* peek cleared overflow, not yet reported */
+    char pad1[PM_CACHE_LINE];
+    /* producer (writer) data, shared by all producers: */
+    pm_atomic_long tail; /* next position to claim */
+    pm_atomic_long cached_head; /* producers' (possibly old) copy of head */
+    /* overflow is set to the position of a dropped message + 1 by a
+     * producer and reset to zero by the consumer */
+    pm_atomic_long overflow;
+    char pad2[PM_CACHE_LINE];
+} PmMpscRep;
+
+#define is_mpsc(q) (((PmQueueRep *) (q))->flags & PM_QUEUE_MPSC)
+
+/* offset of the message in a slot, after the sequence number */
+#define MPSC_DATA 8
+/* mpsc_buffer -- address of the first slot, which follows the
+ * PmMpscRep as in PmRingRep */
+#define mpsc_buffer(mq) ((char *) ((mq) + 1))
+/* mpsc_seq -- address of the sequence number for position pos */
+#define mpsc_seq(mq, pos) ((pm_atomic_long *) \
+        (mpsc_buffer(mq) + ((pos) & ((mq)->cap - 1)) * (mq)->slot_size))
+/* mpsc_data -- address of the message for position pos */
+#define mpsc_data(mq, pos) ((char *) mpsc_seq(mq, pos) + MPSC_DATA)
+/* mpsc_diff -- the signed distance from position b to position a */
+#define mpsc_diff(a, b) ((long) ((unsigned long) (a) - (unsigned long) (b)))
+
+
+static PmQueue *mpsc_create(long num_msgs, int32_t int32s_per_msg)
+{
+    PmMpscRep *mq;
+    long cap = 1;
+    long pos;
+    int32_t msg_size = int32s_per_msg * sizeof(int32_t);
+    long slot_size = MPSC_DATA + ((msg_size + 7) & ~7);
+    while (cap < num_msgs) cap <<= 1;
+    mq = (PmMpscRep *) pm_alloc(sizeof(PmMpscRep) + cap * slot_size);
+    if (!mq) /* memory allocation failed */
+        return NULL;
+    mq->flags = PM_QUEUE_MPSC;
+    mq->wait = NULL;
+    mq->stats = NULL;
+    mq->msg_size = msg_size;
+    mq->slot_size = slot_size;
+    mq->cap = cap;
+    mq->num_msgs = num_msgs;
+    for (pos = 0; pos < cap; pos++) {
+        pm_store_release(mpsc_seq(mq, pos), pos);
+    }
+    mq->head = 0;
+    mq->peek_flag = FALSE;
+    mq->peek_overflow = FALSE;
+    mq->tail = 0;
+    mq->cached_head = 0;
+    mq->overflow = 0;
+    return mq;
+}
+
+
+/* mpsc_set_overflow -- flag an overflow at position pos unless one is
+ * already flagged. (pos + 1 is never 0 for overflow's sake.)
+ */
+static void mpsc_set_overflow(PmMpscRep *mq, long pos)
+{
+    long ovf = (long) ((unsigned long) pos + 1);
+    pm_cas(&mq->overflow, 0, ovf ? ovf : 1);
+}
+
+
+/* mpsc_head_ready -- consumer test for data at head. If there is none
+ * and the producers have flagged an overflow at or before head, the
+ * overflow is cleared and pmBufferOverflow is returned.
+ */
+static PmError mpsc_head_ready(PmMpscRep *mq, long head)
+{
+    long ovf;
+    if (pm_load_acquire(mpsc_seq(mq, head)) ==
+        (long) ((unsigned long) head + 1)) {
+        return pmGotData;
+    }
+    ovf = pm_load_acquire(&mq->overflow);
+    if (ovf && mpsc_diff(head, (unsigned long) ovf - 1) >= 0) {
+        pm_store_release(&mq->overflow, 0);
+        return pmBufferOverflow;
+    }
+    return pmNoData;
+}
+
+
+/* mpsc_advance -- free the slot at head and advance head */
+static void mpsc_advance(PmMpscRep *mq, long head)
+{
+    pm_store_release(mpsc_seq(mq, head),
+                     (long) ((unsigned long) head + mq->cap));
+    pm_store_release(&mq->head, (long) ((unsigned long) head + 1));
+}
+
+
+static PmError mpsc_dequeue(PmMpscRep *mq, void *msg)
+{
+    long head;
+    PmError rslt;
+    if (mq->peek_overflow) {
+        mq->peek_overflow = FALSE;
+        return pmBufferOverflow;
+    }
+    head = pm_load_relaxed(&mq->head);
+    if (mq->peek_flag) {
+        mq->peek_flag = FALSE; /* peeked data is still in the queue */
+    } else if ((rslt = mpsc_head_ready(mq, head)) != pmGotData) {
+        return rslt;
+    }
+    memcpy(msg, mpsc_data(mq, head), mq->msg_size);
+    mpsc_advance(mq, head);
+    return pmGotData;
+}
+
+
+static PmError mpsc_enqueue(PmMpscRep *mq, void *msg)
+{
+    long pos;
+    long dif;
+    /* no more enqueue until receiver acknowledges overflow */
+    if (pm_load_acquire(&mq->overflow)) return pmBufferOverflow;
+    pos = pm_load_relaxed(&mq->tail);
+    for (;;) {
+        if (mpsc_diff(pos, pm_load_relaxed(&mq->cached_head)) >=
+            mq->num_msgs) {
+            long head = pm_load_acquire(&mq->head);
+            /* another producer may store an older head here, but that
+             * only makes the queue look more full than it is */
+            pm_store_release(&mq->cached_head, head);
+            if (mpsc_diff(pos, head) >= mq->num_msgs) {
+                mpsc_set_overflow(mq, pos);
+                return pmBufferOverflow;
+            }
+        }
+        dif = mpsc_diff(pm_load_acquire(mpsc_seq(mq, pos)), pos);
+        if (dif == 0) { /* the slot is free: try to claim it */
+            if (pm_cas(&mq->tail, pos, (long) ((unsigned long) pos + 1)))
+                break;
+        } else if (dif < 0) { /* the consumer has not freed the slot */
+            mpsc_set_overflow(mq, pos);
+            return pmBufferOverflow;
+        }
+        /* another producer claimed pos first */
+        pos = pm_load_relaxed(&mq->tail);
+    }
+    memcpy(mpsc_data(mq, pos), msg, mq->msg_size);
+    pm_store_release(mpsc_seq(mq, pos), (long) ((unsigned long) pos + 1));
+    return pmNoError;
+}
+
+
+static void *mpsc_peek(PmMpscRep *mq)
+{
+    long head = pm_load_relaxed(&mq->head);
+    if (!mq->peek_flag) {
+        PmError rslt = mpsc_head_ready(mq, head);
+        if (rslt == pmBufferOverflow) {
+            mq->peek_overflow = TRUE;
+            return NULL;
+        } else if (rslt != pmGotData) {
+            return NULL;
+        }
+        mq->peek_flag = TRUE;
+    }
+    return mpsc_data(mq, head);
+}
+
+
+static PmError mpsc_release(PmMpscRep *mq)
+{
+    PmError rslt = pmGotData;
+    if (mq->peek_overflow) {
+        mq->peek_overflow = FALSE;
+        rslt = pmBufferOverflow;
+    }
+    if (mq->peek_flag) {
+        mq->peek_flag = FALSE;
+        mpsc_advance(mq, pm_load_relaxed(&mq->head));
+    } else if (rslt == pmGotData) {
+        rslt = pmNoData; /* nothing to release */
+    }
+    return rslt;
+}
+
+
+/* mpsc_enqueue_batch -- messages are claimed one at a time, so those of
+ * other producers may be interleaved with the batch
+ */
+static int mpsc_enqueue_batch(PmMpscRep *mq, const char *msgs, int n)
+{
+    int count;
+    for (count = 0; count < n; count++) {
+        if (mpsc_enqueue(mq, (void *) msgs) != pmNoError) break;
+        msgs += mq->msg_size;
+    }
+    return count;
+}
+
+
+/* mpsc_dequeue_batch -- see ring_dequeue_batch */
+static int mpsc_dequeue_batch(PmMpscRep *mq, char *msgs, int max)
+{
+    int count;
+    for (count = 0; count < max; count++) {
+        PmError rslt = mpsc_dequeue(mq, msgs);
+        if (rslt == pmBufferOverflow) {
+            if (count > 0) { /* report it on the next call */
+                mq->peek_overflow = TRUE;
+                break;
+            }
+            return pmBufferOverflow;
+        } else if (rslt != pmGotData) {
+            break;
+        }
+        msgs += mq->msg_size;
+    }
+    return count;
+}
+
+
+/* PmRecordQueueRep is the PM_QUEUE_RECORD queue, a ring of bytes
+ * holding variable-length records, each a PmRecordHeader followed by
+ * the payload, padded to a multiple of 8 bytes. A record is always
+ * contiguous: if it would run past the end of the buffer, the writer
+ * puts a padding header (len == RECQ_PAD) in the rest of the buffer
+ * and writes the record at the start, publishing both with one store
+ * of tail. Positions are byte offsets that wrap at twice the buffer
+ * size (a power of two), as in PmEventQueueRep, and the buffer (which
+ * follows the PmRecordQueueRep, as in PmRingRep) is big enough for
+ * num_msgs records of the largest size plus the padding.
+ */
+typedef struct {
+    int32_t len; /* payload bytes, or RECQ_PAD */
+    PmTimestamp timestamp;
+} PmRecordHeader;
+
+#define RECQ_PAD (-1)
+
+typedef struct {
+    int32_t flags; /* PM_QUEUE_RECORD (must be first, see PmQueueRep) */
+    struct pm_queue_wait_struct *wait; /* see PmQueueRep */
+    struct pm_queue_stats_struct *stats; /* see PmQueueRep */
+    int32_t max_len; /* largest payload, bytes_per_msg */
+    long size; /* bytes in buffer, a power of two */
+    long mask; /* 2 * size - 1 */
+    char pad0[PM_CACHE_LINE];
+    /* consumer (reader) data: */
+    pm_atomic_long head; /* position of the next record */
+    pm_atomic_long head_recs; /* number of records removed */
+    long cached_tail; /* consumer's copy of tail */
+    int32_t peek_flag; /* the record at head has been returned by peek */
+    int32_t peek_overflow; /* peek cleared overflow, not yet reported */
+    char pad1[PM_CACHE_LINE];
+    /* producer (writer) data: */
+    pm_atomic_long tail; /* position after the last record */
+    pm_atomic_long tail_recs; /* number of records inserted */
+    long cached_head; /* producer's copy of head */
+    long cached_head_recs; /* producer's copy of head_recs */
+    long reserved_pos; /* position of the reserved record, or -1 */
+    int32_t reserved_len; /* payload bytes reserved */
+    /* overflow is set to tail + 1 by the producer and reset to zero by
+     * the consumer, as in PmRingRep */
+    pm_atomic_long overflow;
+    char pad2[PM_CACHE_LINE];
+} PmRecordQueueRep;
+
+#define is_record_queue(q) (((PmQueueRep *) (q))->flags & PM_QUEUE_RECORD)
+
+/* recq_size -- bytes taken by a record with len bytes of payload */
+#define recq_size(len) ((long) sizeof(PmRecordHeader) + (((len) + 7) & ~7))
+/* recq_buffer -- address of the ring of bytes */
+#define recq_buffer(rq) ((char *) ((rq) + 1))
+/* recq_at -- address of the header at position pos */
+#define recq_at(rq, pos) \
+        ((PmRecordHeader *) (recq_buffer(rq) + ((pos) & ((rq)->size - 1))))
+/* recq_count -- number of bytes from position h to position t */
+#define recq_count(rq, h, t) (((t) - (h)) & (rq)->mask)
+
+
+static PmQueue *recq_create(long num_msgs, int32_t bytes_per_msg)
+{
+    PmRecordQueueRep *rq;
+    long size = 8;
+    /* one extra record's worth of space absorbs the padding */
+    while (size < (num_msgs + 1) * recq_size(bytes_per_msg)) size <<= 1;
+    rq = (PmRecordQueueRep *) pm_alloc(sizeof(PmRecordQueueRep) + size);
+    if (!rq) /* memory allocation failed */
+        return NULL;
+    rq->flags = PM_QUEUE_RECORD;
+    rq->wait = NULL;
+    rq->stats = NULL;
+    rq->max_len = bytes_per_msg;
+    rq->size = size;
+    rq->mask = 2 * size - 1;
+    rq->head = 0;
+    rq->head_recs = 0;
+    rq->cached_tail = 0;
+    rq->peek_flag = FALSE;
+    rq->peek_overflow = FALSE;
+    rq->tail = 0;
+    rq->tail_recs = 0;
+    rq->cached_head = 0;
+    rq->cached_head_recs = 0;
+    rq->reserved_pos = -1;
+    rq->reserved_len = 0;
+    rq->overflow = 0;
+    return rq;
+}
+
+
+/* recq_head_ready -- consumer test for data at head, see
+ * ring_head_ready */
+static PmError recq_head_ready(PmRecordQueueRep *rq, long head)
+{
+    if (head == rq->cached_tail) {
+        rq->cached_tail = pm_load_acquire(&rq->tail);
+        if (head == rq->cached_tail) {
+            if (pm_load_acquire(&rq->overflow) == head + 1) {
+                pm_store_release(&rq->overflow, 0);
+                return pmBufferOverflow;
+            }
+            return pmNoData;
+        }
+    }
+    return pmGotData;
+}
+
+
+/* recq_skip -- the position of the record at head, which follows the
+ * padding, if any, at head
+ */
+static long recq_skip(PmRecordQueueRep *rq, long head)
+{
+    if (recq_at(rq, head)->len == RECQ_PAD) {
+        head = (head + rq->size - (head & (rq->size - 1))) & rq->mask;
+    }
+    return head;
+}
+
+
+/* recq_place -- producer: find room for a record of n bytes at tail.
+ * Returns its position, which is the start of the buffer if the
+ * record would not be contiguous at tail, or -1 if there is no room.
+ */
+static long recq_place(PmRecordQueueRep *rq, long tail, long n)
+{
+    long off = tail & (rq->size - 1);
+    long pos = (off + n > rq->size ? (tail + rq->size - off) & rq->mask :
+                                     tail);
+    long need = recq_count(rq, tail, pos) + n;
+    if (rq->size - recq_count(rq, rq->cached_head, tail) < need) {
+        rq->cached_head = pm_load_acquire(&rq->head);
+        rq->cached_head_recs = pm_load_relaxed(&rq->head_recs);
+        if (rq->size - recq_count(rq, rq->cached_head, tail) < need) {
+            return -1;
+        }
+    }
+    return pos;
+}
+
+
+/* recq_publish -- producer: make the record at pos (whose payload has
+ * been written) and the padding before it visible to the reader
+ */
+static void recq_publish(PmRecordQueueRep *rq, long tail, long pos,
+                         int32_t len, PmTimestamp timestamp)
+{
+    PmRecordHeader *hdr = recq_at(rq, pos);
+    if (pos != tail) recq_at(rq, tail)->len = RECQ_PAD;
+    hdr->len = len;
+    hdr->timestamp = timestamp;
+    pm_store_release(&rq->tail, (pos + recq_size(len)) & rq->mask);
+    pm_store_release(&rq->tail_recs, pm_load_relaxed(&rq->tail_recs) + 1);
+}
+
+
+static PmError recq_enqueue(PmRecordQueueRep *rq, const void *data,
+                            int32_t len, PmTimestamp timestamp)
+{
+    long tail;
+    long pos;
+    /* no more enqueue until receiver acknowledges overflow */
+    if (pm_load_acquire(&rq->overflow)) return pmBufferOverflow;
+    tail = pm_load_relaxed(&rq->tail);
+    pos = recq_place(rq, tail, recq_size(len));
+    if (pos < 0) {
+        pm_store_release(&rq->overflow, tail + 1);
+        return pmBufferOverflow;
+    }
+    memcpy(recq_at(rq, pos) + 1, data, len);
+    recq_publish(rq, tail, pos, len, timestamp);
+    return pmNoError;
+}
+
+
+static PmRecordHeader *recq_peek(PmRecordQueueRep *rq)
+{
+    long head = pm_load_relaxed(&rq->head);
+    if (!rq->peek_flag) {
+        PmError rslt = recq_head_ready(rq, head);
+        if (rslt == pmBufferOverflow) {
+            rq->peek_overflow = TRUE;
+            return NULL;
+        } else if (rslt != pmGotData) {
+            return NULL;
+        }
+        rq->peek_flag = TRUE;
+    }
+    return recq_at(rq, recq_skip(rq, head));
+}
+
+
+/* recq_advance -- consumer: remove the record at head */
+static void recq_advance(PmRecordQueueRep *rq)
+{
+    long pos = recq_skip(rq, pm_load_relaxed(&rq->head));
+    rq->peek_flag = FALSE;
+    pm_store_release(&rq->head,
+                     (pos + recq_size(recq_at(rq, pos)->len)) & rq->mask);
+    pm_store_release(&rq->head_recs, pm_load_relaxed(&rq->head_recs) + 1);
+}
+
+
+static PmError recq_dequeue(PmRecordQueueRep *rq, void *data, int32_t *len,
+                            PmTimestamp *timestamp)
+{
+    PmRecordHeader *hdr;
+    if (rq->peek_overflow) {
+        rq->peek_overflow = FALSE;
+        return pmBufferOverflow;
+    }
+    hdr = recq_peek(rq);
+    if (!hdr) {
+        if (rq->peek_overflow) {
+            rq->peek_overflow = FALSE;
+            return pmBufferOverflow;
+        }
+        return pmNoData;
+    }
+    if (hdr->len > *len) { /* leave the record for a bigger buffer */
+        *len = hdr->len;
+        return pmBufferTooSmall;
+    }
+    memcpy(data, hdr + 1, hdr->len);
+    *len = hdr->len;
+    if (timestamp) *timestamp = hdr->timestamp;
+    recq_advance(rq);
+    return pmGotData;
+}
+
+
+static void *recq_reserve(PmRecordQueueRep *rq, int32_t len)
+{
+    long tail;
+    long pos;
+    if (pm_load_acquire(&rq->overflow)) return NULL;
+    tail = pm_load_relaxed(&rq->tail);
+    pos = recq_place(rq, tail, recq_size(len));
+    if (pos < 0) {
+        rq->reserved_pos = -1;
+        pm_store_release(&rq->overflow, tail + 1);
+        return NULL;
+    }
+    rq->reserved_pos = pos;
+    rq->reserved_len = len;
+    return recq_at(rq, pos) + 1;
+}
+
+
+static PmError recq_commit(PmRecordQueueRep *rq, int32_t len,
+                           PmTimestamp timestamp)
+{
+    if (rq->reserved_pos < 0 || len < 0 || len > rq->reserved_len)
+        return pmBadPtr;
+    recq_publish(rq, pm_load_relaxed(&rq->tail), rq->reserved_pos, len,
+                 timestamp);
+    rq->reserved_pos = -1;
+    return pmNoError;
+}
+
+
+static PmError recq_release(PmRecordQueueRep *rq)
+{
+    PmError rslt = pmGotData;
+    if (rq->peek_overflow) {
+        rq->peek_overflow = FALSE;
+        rslt = pmBufferOverflow;
+    }
+    if (rq->peek_flag) {
+        recq_advance(rq);
+    } else if (rslt == pmGotData) {
+        rslt = pmNoData; /* nothing to release */
+    }
+    return rslt;
+}
+
+
+/* pipe_create -- create the PM_QUEUE_LIGHT_PIPE queue */
+static PmQueue *pipe_create(long num_msgs, int32_t int32s_per_msg)
+{
+    int32_t msg_size;
+    long slack;
+    PmQueueRep *queue;
+    queue = (PmQueueRep *) pm_alloc(sizeof(PmQueueRep));
+    if (!queue) /* memory allocation failed */
+        return NULL;
+
+    /* need extra word per message for non-zero encoding */
+    msg_size = int32s_per_msg + 1;
+#ifdef QUEUE_EAGER_CLEAR
+    slack = 0;
+#else
+    /* messages are zeroed (freed) by the reader slack messages behind
+     * head, so that the zeroing never touches the cache line holding
+     * head, where the writer may be writing. The slack messages are
+     * extra space so that the capacity is still num_msgs. */
+    slack = (PM_CACHE_LINE + msg_size * sizeof(int32_t) - 1) /
+            (msg_size * sizeof(int32_t)) + 1;
+#endif
+    queue->len = (num_msgs + slack) * msg_size;
+    queue->buffer = (int32_t *) pm_alloc(queue->len * sizeof(int32_t));
+    if (!queue->buffer) {
+        pm_free(queue);
+        return NULL;
+    } else { /* allocate the "peek" and "reserve" buffers together */
+        queue->peek = (int32_t *) pm_alloc(2 * int32s_per_msg *
+                                           sizeof(int32_t));
+        if (!queue->peek) {
+            /* free everything allocated so far and return */
+            pm_free(queue->buffer);
+            pm_free(queue);
+            return NULL;
+        }
+    }
+    bzero(queue->buffer, queue->len * sizeof(int32_t));
+    /* to the writer, the slack messages look as if they have been read
+     * but not yet zeroed, which is their state from now on */
+    queue->clear = num_msgs * msg_size;
+    memset(queue->buffer + queue->clear, 1,
+           slack * msg_size * sizeof(int32_t));
+    if (queue->clear == queue->len) queue->clear = 0;
+    queue->flags = PM_QUEUE_LIGHT_PIPE;
+    queue->wait = NULL;
+    queue->stats = NULL;
+    queue->head = 0;
+    queue->tail = 0;
+    queue->cached_head = 0;
+    /* msg_size is in words */
+    queue->msg_size = msg_size; /* note extra word is counted */
+    queue->overflow = FALSE;
+    queue->peek_overflow = FALSE;
+    queue->peek_flag = FALSE;
+    queue->reserved = FALSE;
+    return queue;
+}
+
+
+/* PmQueueWaitRep holds what a reader needs to sleep until a writer
+ * adds data to a PM_QUEUE_WAITABLE queue. The reader announces that it
+ * is about to sleep by setting waiting, then checks the queue once
+ * more before sleeping. A writer checks waiting after each enqueue and
+ * only makes a system call to wake the reader if waiting was set.
+ * Both sides put a full memory barrier between their store and their
+ * load, so either the reader sees the new data or the writer sees
+ * waiting (or both, which causes a harmless extra wakeup). The
+ * wakeup uses an eventfd on Linux, a pipe on other POSIX systems and
+ * an auto-reset event on Windows.
+ */
+typedef struct pm_queue_wait_struct {
+    pm_atomic_long waiting; /* read by the writer after every enqueue */
+    char pad[PM_CACHE_LINE];
+#ifdef WIN32
+    HANDLE event;
+#else
+    int fd[2]; /* read and write ends (the same eventfd on Linux) */
+#endif
+} PmQueueWaitRep;
+
+
+static int wait_create(PmQueueRep *queue)
+{
+    PmQueueWaitRep *w = (PmQueueWaitRep *) pm_alloc(sizeof(PmQueueWaitRep));
+    if (!w) return FALSE;
+    w->waiting = 0;
+#ifdef WIN32
+    w->event = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if (!w->event) {
+        pm_free(w);
+        return FALSE;
+    }
+#elif defined(__linux__)
+    w->fd[0] = w->fd[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (w->fd[0] < 0) {
+        pm_free(w);
+        return FALSE;
+    }
+#else
+    if (pipe(w->fd) < 0) {
+        pm_free(w);
+        return FALSE;
+    }
+    fcntl(w->fd[0], F_SETFL, O_NONBLOCK);
+    fcntl(w->fd[1], F_SETFL, O_NONBLOCK);
+    fcntl(w->fd[0], F_SETFD, FD_CLOEXEC);
+    fcntl(w->fd[1], F_SETFD, FD_CLOEXEC);
+#endif
+    queue->wait = w;
+    return TRUE;
+}
+
+
+static void wait_destroy(PmQueueWaitRep *w)
+{
+#ifdef WIN32
+    CloseHandle(w->event);
+#else
+    close(w->fd[0]);
+    if (w->fd[1] != w->fd[0]) close(w->fd[1]);
+#endif
+    pm_free(w);
+}
+
+
+/* wait_wake -- make the reader's wait handle ready */
+static void wait_wake(PmQueueWaitRep *w)
+{
+#ifdef WIN32
+    SetEvent(w->event);
+#elif defined(__linux__)
+    uint64_t one = 1;
+    if (write(w->fd[1], &one, sizeof(one)) < 0) {
+        ; /* the counter is already non-zero, so the reader will wake */
+    }
+#else
+    char one = 1;
+    if (write(w->fd[1], &one, 1) < 0) {
+        ; /* the pipe is full, so the reader will wake */
+    }
+#endif
+}
+
+
+/* wait_drain -- discard a wakeup the reader did not need */
+static void wait_drain(PmQueueWaitRep *w)
+{
+#ifdef WIN32
+    WaitForSingleObject(w->event, 0);
+#elif defined(__linux__)
+    uint64_t count;
+    if (read(w->fd[0], &count, sizeof(count)) < 0) {
+        ; /* nothing to discard */
+    }
+#else
+    char buf[64];
+    while (read(w->fd[0], buf, sizeof(buf)) > 0) ;
+#endif
+}
+
+
+/* wait_block -- sleep until woken or timeout_us microseconds pass
+ * (forever if timeout_us is negative)
+ */
+static void wait_block(PmQueueWaitRep *w, long timeout_us)
+{
+    /* round up to milliseconds so that we never return early */
+    long ms = (timeout_us < 0 ? -1 : (timeout_us + 999) / 1000);
+#ifdef WIN32
+    WaitForSingleObject(w->event, ms < 0 ? INFINITE : (DWORD) ms);
+#else
+    struct pollfd pfd;
+    pfd.fd = w->fd[0];
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    poll(&pfd, 1, (int) ms); /* an interrupted poll is a spurious wakeup */
+#endif
+}
+
+
+/* queue_ready -- reader test for something to receive: a message or a
+ * pending overflow report
+ */
+static int queue_ready(PmQueue *q)
+{
+    PmQueueRep *queue = (PmQueueRep *) q;
+    if (!Pm_QueueEmpty(q)) return TRUE;
+    if (is_record_queue(queue)) {
+        PmRecordQueueRep *rq = (PmRecordQueueRep *) q;
+        return rq->peek_overflow || pm_load_acquire(&rq->overflow);
+    } else if (is_event_queue(queue)) {
+        PmEventQueueRep *evq = (PmEventQueueRep *) q;
+        return evq->peek_overflow || pm_load_acquire(&evq->overflow);
+    } else if (is_mpsc(queue)) {
+        PmMpscRep *mq = (PmMpscRep *) q;
+        return mq->peek_overflow || pm_load_acquire(&mq->overflow);
+    } else if (is_ring(queue)) {
+        PmRingRep *ring = (PmRingRep *) q;
+        return ring->peek_overflow || pm_load_acquire(&ring->overflow);
+    }
+    return queue->peek_overflow || queue->overflow;
+}
+
+
+/* queue_signal -- called by the writer after changing the queue to
+ * wake the reader if it has announced that it is waiting
+ */
+static void queue_signal(PmQueueRep *queue)
+{
+    PmQueueWaitRep *w = queue->wait;
+    pm_fence(); /* make the change visible before reading waiting */
+    if (pm_load_relaxed(&w->waiting) && pm_exchange(&w->waiting, 0)) {
+        wait_wake(w);
+    }
+}
+
+
+/* queue_wake -- queue_signal() if the queue is waitable, then return
+ * rslt, the result of the writer's operation
+ */
+static int queue_wake(PmQueueRep *queue, int rslt)
+{
+    if (queue->wait) queue_signal(queue);
+    return rslt;
+}
+
+
+/* queue_arm -- reader: announce that we are about to wait. Returns
+ * pmGotData if there is already something to receive, in which case
+ * the reader should not wait, and otherwise pmNoData.
+ */
+static PmError queue_arm(PmQueueRep *queue)
+{
+    PmQueueWaitRep *w = queue->wait;
+    wait_drain(w); /* discard a wakeup left over from an earlier wait */
+    pm_store_release(&w->waiting, 1);
+    pm_fence(); /* make waiting visible before looking at the queue */
+    if (queue_ready(queue)) {
+        pm_store_release(&w->waiting, 0);
+        return pmGotData;
+    }
+    return pmNoData;
+}
+
+
+/* PmQueueStatsRep holds the counters reported by Pm_QueueGetStats().
+ * They are only written by the writer, right after it has written the
+ * queue, so they cost the reader nothing. The number of messages
+ * dequeued is not counted: it is computed from the number enqueued,
+ * the number evicted (by PM_OVERFLOW_DROP_OLDEST) and the current
+ * depth. A PM_QUEUE_MPSC queue has several writers, so its counts are
+ * kept with atomic operations instead, and its total enqueued is its
+ * tail position. The writer's overflow policy is kept here too, since
+ * the writer reads it on every enqueue; it is set by the reader.
+ */
+typedef struct pm_queue_stats_struct {
+    long capacity;
+    uint64_t enqueued;
+    uint64_t dropped;
+    uint64_t evicted;
+    long high_water;
+    pm_atomic_long shared_dropped; /* PM_QUEUE_MPSC only */
+    pm_atomic_long shared_high_water; /* PM_QUEUE_MPSC only */
+    pm_atomic_long policy; /* see Pm_QueueSetOverflowPolicy() */
+    pm_atomic_long block_ms;
+    long mapped; /* bytes mapped by storage_map(), if QUEUE_MAPPED */
+    int32_t locked; /* storage_lock() succeeded */
+} PmQueueStatsRep;
+
+/* how long PM_OVERFLOW_BLOCK waits unless set otherwise */
+#define OVERFLOW_BLOCK_MS 10
+
+/* queue_stats -- the statistics of a queue, which a shared or placed
+ * queue keeps just before the rep (see queue_place()) */
+#define queue_stats(q) \
+        (((q)->flags & (QUEUE_SHARED | QUEUE_PLACED)) ? \
+         ((PmQueueStatsRep *) (q)) - 1 : (q)->stats)
+
+
+/* queue_depth -- number of messages in the queue. If fresh is FALSE,
+ * the writer's cached copy of head is used, which can only make the
+ * result too large, and the reader's data is not touched.
+ */
+static long queue_depth(PmQueueRep *queue, int fresh)
+{
+    long depth;
+    if (is_record_queue(queue)) {
+        PmRecordQueueRep *rq = (PmRecordQueueRep *) queue;
+        return mpsc_diff(pm_load_acquire(&rq->tail_recs),
+                         fresh ? pm_load_acquire(&rq->head_recs) :
+                                 rq->cached_head_recs);
+    } else if (is_event_queue(queue)) {
+        PmEventQueueRep *evq = (PmEventQueueRep *) queue;
+        return evq_count(evq, fresh ? pm_load_acquire(&evq->head) :
+                                      evq->cached_head,
+                         pm_load_acquire(&evq->tail));
+    } else if (is_mpsc(queue)) {
+        PmMpscRep *mq = (PmMpscRep *) queue;
+        return mpsc_diff(pm_load_acquire(&mq->tail),
+                         fresh ? pm_load_acquire(&mq->head) :
+                                 pm_load_relaxed(&mq->cached_head));
+    } else if (is_ring(queue)) {
+        PmRingRep *ring = (PmRingRep *) queue;
+        depth = pm_load_acquire(&ring->tail) -
+                (fresh ? pm_load_acquire(&ring->head) : ring->cached_head);
+        return (depth < 0 ? depth + ring->len : depth);
+    }
+    depth = queue->tail - (fresh ? queue->head : queue->cached_head);
+    if (depth < 0) depth += queue->len;
+    return depth / queue->msg_size;
+}
+
+
+/* queue_refresh -- writer: update the writer's cached copy of head
+ * from the reader's and return the depth. The cached copy is what the
+ * writer compares against, so refreshing it here also saves the next
+ * enqueue from reading head.
+ */
+static long queue_refresh(PmQueueRep *queue)
+{
+    if (is_record_queue(queue)) {
+        PmRecordQueueRep *rq = (PmRecordQueueRep *) queue;
+        rq->cached_head = pm_load_acquire(&rq->head);
+        rq->cached_head_recs = pm_load_relaxed(&rq->head_recs);
+    } else if (is_event_queue(queue)) {
+        PmEventQueueRep *evq = (PmEventQueueRep *) queue;
+        evq->cached_head = pm_load_acquire(&evq->head);
+    } else if (is_mpsc(queue)) {
+        PmMpscRep *mq = (PmMpscRep *) queue;
+        /* as in mpsc_enqueue, an older head stored by another producer
+         * only makes the queue look more full than it is */
+        pm_store_release(&mq->cached_head, pm_load_acquire(&mq->head));
+    } else if (is_ring(queue)) {
+        PmRingRep *ring = (PmRingRep *) queue;
+        ring->cached_head = pm_load_acquire(&ring->head);
+    } else {
+        queue->cached_head = queue->head;
+    }
+    return queue_depth(queue, FALSE);
+}
+
+
+/* queue_count -- writer: count sent messages out of attempted ones.
+ * The depth is computed from the writer's cached head, and head is
+ * only read when that depth passes the high-water mark, so keeping the
+ * statistics does not add traffic on the reader's cache line.
+ */
+static void queue_count(PmQueueRep *queue, int sent, int attempted)
+{
+    PmQueueStatsRep *stats = queue_stats(queue);
+    long depth;
+    if (is_mpsc(queue)) {
+        long old;
+        if (sent < attempted) {
+            do {
+                old = pm_load_relaxed(&stats->shared_dropped);
+            } while (!pm_cas(&stats->shared_dropped, old,
+                             old + attempted - sent));
+        }
+        if (sent > 0) {
+            old = pm_load_relaxed(&stats->shared_high_water);
+            if (queue_depth(queue, FALSE) <= old) return;
+            depth = queue_refresh(queue);
+            while (depth > old &&
+                   !pm_cas(&stats->shared_high_water, old, depth)) {
+                old = pm_load_relaxed(&stats->shared_high_water);
+            }
+        }
+        return;
+    }
+    stats->enqueued += sent;
+    stats->dropped += attempted - sent;
+    if (sent > 0 && queue_depth(queue, FALSE) > stats->high_water) {
+        depth = queue_refresh(queue);
+        if (depth > stats->high_water) stats->high_water = depth;
+    }
+}
+
+
+/* A shared queue (see Pm_QueueCreateShared()) is a named shared memory
+ * mapping holding a PmSharedHeader, the queue's PmQueueStatsRep, and an
+ * index-based queue, whose slots follow its rep and which holds no
+ * pointers, so every process can map it at a different address. The
+ * rep's wait and stats pointers are NULL, and QUEUE_SHARED tells
+ * queue_stats() to look just before the rep. The creator writes magic
+ * last, so a process that attaches too early gets NULL rather than a
+ * partly built queue.
+ */
+#define SHARED_MAGIC 0x506d5131 /* "PmQ1" */
+#define SHARED_NAME_MAX 64
+
+typedef struct {
+    int32_t magic;
+    int32_t unused;
+    long size; /* bytes in the mapping */
+    long creator; /* id of the process that removes the name */
+    char name[SHARED_NAME_MAX];
+} PmSharedHeader;
+
+/* offset of the rep from the start of the mapping */
+#define SHARED_REP_OFFSET \
+        ((sizeof(PmSharedHeader) + sizeof(PmQueueStatsRep) + \
+          PM_CACHE_LINE - 1) & ~(PM_CACHE_LINE - 1))
+
+#define shared_header(q) \
+        ((PmSharedHeader *) ((char *) (q) - SHARED_REP_OFFSET))
+
+
+/* queue_bytes -- size of the single allocation of an indexed queue */
+static long queue_bytes(PmQueueRep *queue)
+{
+    if (is_record_queue(queue)) {
+        return sizeof(PmRecordQueueRep) + ((PmRecordQueueRep *) queue)->size;
+    } else if (is_event_queue(queue)) {
+        PmEventQueueRep *evq = (PmEventQueueRep *) queue;
+        return sizeof(PmEventQueueRep) + evq->cap * (sizeof(uint64_t) +
+                (evq->seq_inline ? sizeof(pm_atomic_long) : 0));
+    } else if (is_mpsc(queue)) {
+        PmMpscRep *mq = (PmMpscRep *) queue;
+        return sizeof(PmMpscRep) + mq->cap * mq->slot_size;
+    } else {
+        PmRingRep *ring = (PmRingRep *) queue;
+        return sizeof(PmRingRep) + ring->len * ring->msg_size;
+    }
+}
+
+
+/* shared_name -- make the system name for a shared queue: name with a
+ * leading '/', as shm_open() requires. Returns FALSE if name is empty
+ * or too long.
+ */
+static int shared_name(char *path, const char *name)
+{
+    if (!name || !*name || strlen(name) + 2 > SHARED_NAME_MAX)
+        return FALSE;
+    path[0] = '/';
+    strcpy(path + (name[0] == '/' ? 0 : 1), name);
+    return TRUE;
+}
+
+
+/* shared_map -- create the mapping named path with *size bytes if
+ * *size > 0, otherwise open it and set *size (except on Windows, where
+ * it is not needed). Returns its address, or NULL.
+ */
+static PmSharedHeader *shared_map(const char *path, long *size)
+{
+    void *mem;
+#ifdef WIN32
+    HANDLE h;
+    if (*size > 0) {
+        h = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+                               0, (DWORD) *size, path);
+        if (h && GetLastError() == ERROR_ALREADY_EXISTS) {
+            CloseHandle(h);
+            return NULL;
+        }
+    } else {
+        h = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, path);
+    }
+    if (!h)
+        return NULL;
+    mem = MapViewOfFile(h, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+    CloseHandle(h); /* the view keeps the mapping */
+    return (PmSharedHeader *) mem;
+#else
+    struct stat st;
+    int create = (*size > 0);
+    int fd = shm_open(path, (create ? O_RDWR | O_CREAT | O_EXCL : O_RDWR),
+                      0600);
+    if (fd < 0)
+        return NULL;
+    if (create) {
+        if (ftruncate(fd, *size) < 0) {
+            close(fd);
+            shm_unlink(path);
+            return NULL;
+        }
+    } else if (fstat(fd, &st) < 0 ||
+               st.st_size < (off_t) SHARED_REP_OFFSET) {
+        close(fd);
+        return NULL;
+    } else {
+        *size = (long) st.st_size;
+    }
+    mem = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd); /* the mapping keeps the memory */
+    if (mem == MAP_FAILED) {
+        if (create) shm_unlink(path);
+        return NULL;
+    }
+    return (PmSharedHeader *) mem;
+#endif
+}
+
+
+/* shared_unmap -- unmap a shared queue. The creator also removes the
+ * name, so the memory is freed when the last process unmaps it.
+ */
+static PmError shared_unmap(PmQueueRep *queue)
+{
+    PmSharedHeader *hdr = shared_header(queue);
+#ifdef WIN32
+    UnmapViewOfFile(hdr);
+#else
+    if (hdr->creator == (long) getpid())
+        shm_unlink(hdr->name);
+    munmap(hdr, hdr->size);
+#endif
+    return pmNoError;
+}
+
+
+/* A placed queue is an index-based queue built with pm_alloc() and then
+ * copied, by queue_place(), to memory passed to Pm_QueueCreateInPlace()
+ * or mapped by storage_map() for PM_QUEUE_LOCKED and
+ * PM_QUEUE_HUGE_PAGES. As in a shared queue, its PmQueueStatsRep is
+ * just before the rep, which starts PLACED_REP_OFFSET bytes into the
+ * cache-line-aligned storage. The copy writes every byte of the
+ * storage, so all its pages are faulted in before the queue is used.
+ */
+#define PLACED_REP_OFFSET \
+        ((sizeof(PmQueueStatsRep) + PM_CACHE_LINE - 1) & ~(PM_CACHE_LINE - 1))
+/* size of huge pages requested by storage_map() */
+#define HUGE_PAGE_BYTES (2 * 1024 * 1024)
+
+#define placed_storage(q) ((char *) (q) - PLACED_REP_OFFSET)
+
+
+/* queue_place -- copy the index-based queue local and its statistics
+ * so that the copy's rep is at rep, add flags to the copy's flags and
+ * return the copy. The copy takes over local's wakeup state.
+ */
+static PmQueueRep *queue_place(PmQueueRep *local, char *rep, int32_t flags)
+{
+    PmQueueRep *queue = (PmQueueRep *) rep;
+    memcpy(queue, local, queue_bytes(local));
+    queue->flags |= flags;
+    queue->stats = NULL;
+    memcpy(queue_stats(queue), local->stats, sizeof(PmQueueStatsRep));
+    local->wait = NULL;
+    return queue;
+}
+
+
+/* storage_map -- map *size bytes of private memory for a placed queue,
+ * using huge pages if flags has PM_QUEUE_HUGE_PAGES and the system
+ * has them available, otherwise normal pages. Sets *size to the
+ * length of the mapping. Returns its address, or NULL.
+ */
+static char *storage_map(long *size, int32_t flags)
+{
+#ifdef WIN32
+    SIZE_T large = GetLargePageMinimum();
+    void *mem;
+    if ((flags & PM_QUEUE_HUGE_PAGES) && large) {
+        /* only works with the "Lock pages in memory" privilege */
+        long len = (long) ((*size + large - 1) & ~(large - 1));
+        mem = VirtualAlloc(NULL, len, MEM_RESERVE | MEM_COMMIT |
+                           MEM_LARGE_PAGES, PAGE_READWRITE);
+        if (mem) {
+            *size = len;
+            return (char *) mem;
+        }
+    }
+    return (char *) VirtualAlloc(NULL, *size, MEM_RESERVE | MEM_COMMIT,
+                                 PAGE_READWRITE);
+#else
+    void *mem;
+    int map = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_POPULATE
+    map |= MAP_POPULATE;
+#endif
+#ifdef MAP_HUGETLB
+    if (flags & PM_QUEUE_HUGE_PAGES) {
+        long len = (*size + HUGE_PAGE_BYTES - 1) & ~(HUGE_PAGE_BYTES - 1);
+        int huge = map | MAP_HUGETLB;
+#ifdef MAP_HUGE_SHIFT
+        huge |= 21 << MAP_HUGE_SHIFT; /* 2 MB pages, matching len */
+#endif
+        /* fails unless huge pages have been reserved by the system */
+        mem = mmap(NULL, len, PROT_READ | PROT_WRITE, huge, -1, 0);
+        if (mem != MAP_FAILED) {
+            *size = len;
+            return (char *) mem;
+        }
+    }
+#endif
+    mem = mmap(NULL, *size, PROT_READ | PROT_WRITE, map, -1, 0);
+    return (mem == MAP_FAILED ? NULL : (char *) mem);
+#endif
+}
+
+
+/* storage_lock -- try to lock len bytes at mem, the storage of queue,
+ * in memory. This fails if it would exceed the process's limit on
+ * locked memory, which leaves the queue working, just not locked.
+ */
+static void storage_lock(PmQueueRep *queue, void *mem, long len)
+{
+#ifdef WIN32
+    queue_stats(queue)->locked = (VirtualLock(mem, len) != 0);
+#else
+    queue_stats(queue)->locked = (mlock(mem, len) == 0);
+#endif
+}
+
+
+/* storage_release -- unlock a placed queue's storage, and unmap it if
+ * storage_map() mapped it */
+static PmError storage_release(PmQueueRep *queue)
+{
+    PmQueueStatsRep *stats = queue_stats(queue);
+    long len = (long) PLACED_REP_OFFSET + queue_bytes(queue);
+    char *mem = placed_storage(queue);
+#ifdef WIN32
+    if (stats->locked)
+        VirtualUnlock(mem, len);
+    if (queue->flags & QUEUE_MAPPED)
+        VirtualFree(mem, 0, MEM_RELEASE);
+#else
+    if (queue->flags & QUEUE_MAPPED) /* unmapping also unlocks */
+        munmap(mem, stats->mapped);
+    else if (stats->locked)
+        munlock(mem, len);
+#endif
+    return pmNoError;
+}
+
+
+/* queue_msg_bytes -- the size of a message (not of a record) */
+static long queue_msg_bytes(PmQueueRep *queue)
+{
+    if (is_event_queue(queue)) return sizeof(uint64_t);
+    if (is_mpsc(queue)) return ((PmMpscRep *) queue)->msg_size;
+    if (is_ring(queue)) return ((PmRingRep *) queue)->msg_size;
+    return (queue->msg_size - 1) * sizeof(int32_t);
+}
+
+
+/* queue_overflowed -- writer: test for an overflow that the reader
+ * has not received yet, which makes the writer drop what it writes
+ */
+static int queue_overflowed(PmQueueRep *queue)
+{
+    if (is_record_queue(queue))
+        return pm_load_acquire(&((PmRecordQueueRep *) queue)->overflow) != 0;
+    if (is_event_queue(queue))
+        return pm_load_acquire(&((PmEventQueueRep *) queue)->overflow) != 0;
+    if (is_mpsc(queue))
+        return pm_load_acquire(&((PmMpscRep *) queue)->overflow) != 0;
+    if (is_ring(queue))
+        return pm_load_acquire(&((PmRingRep *) queue)->overflow) != 0;
+    return queue->overflow != 0;
+}
+
+
+/* queue_make_room -- writer: apply the overflow policy before writing
+ * n messages, and return how many of them to write. The rest are
+ * dropped without flagging an overflow (PM_OVERFLOW_DROP_NEWEST). With
+ * PM_OVERFLOW_REPORT, or when PM_OVERFLOW_BLOCK times out, n is
+ * returned and the write flags the overflow as usual. PM_OVERFLOW_BLOCK
+ * does not wait while an overflow is flagged: the write is dropped
+ * anyway until the reader has received the overflow.
+ */
+static int queue_make_room(PmQueueRep *queue, int n)
+{
+    PmQueueStatsRep *stats = queue_stats(queue);
+    /* acquire, so that PM_OVERFLOW_DROP_OLDEST is seen with the
+     * sequence numbers it needs (see Pm_QueueSetOverflowPolicy) */
+    long policy = pm_load_acquire(&stats->policy);
+    long room;
+    long waited;
+    if (policy == PM_OVERFLOW_DROP_OLDEST) /* n <= capacity */
+        return evq_evict((PmEventQueueRep *) queue, n, &stats->evicted);
+    if (policy == PM_OVERFLOW_REPORT ||
+        stats->capacity - queue_depth(queue, FALSE) >= n)
+        return n;
+    room = stats->capacity - queue_refresh(queue);
+    if (room >= n) {
+        return n;
+    } else if (policy == PM_OVERFLOW_BLOCK) {
+        long limit = pm_load_relaxed(&stats->block_ms);
+        if (queue_overflowed(queue)) return n;
+        for (waited = 0; waited < limit && room < n; waited++) {
+            Pt_Sleep(1);
+            room = stats->capacity - queue_refresh(queue);
+        }
+        return n;
+    }
+    return (room > 0 ? (int) room : 0);
+}
+
 
 PMEXPORT PmQueue *Pm_QueueCreate(long num_msgs, int32_t bytes_per_msg)
+{
+    return Pm_QueueCreateEx(num_msgs, bytes_per_msg, PM_QUEUE_LIGHT_PIPE);
+}
+
+
+/* queue_create -- create a queue as described by flags in memory from
+ * pm_alloc(), ignoring PM_QUEUE_LOCKED and PM_QUEUE_HUGE_PAGES */
+static PmQueueRep *queue_create(long num_msgs, int32_t bytes_per_msg,
+                                int32_t flags)
 {
     int32_t int32s_per_msg = 
             (int32_t) (((bytes_per_msg + sizeof(int32_t) - 1) &
                        ~(sizeof(int32_t) - 1)) / sizeof(int32_t));
-    PmQueueRep *queue = (PmQueueRep *) pm_alloc(sizeof(PmQueueRep));
-    if (!queue) /* memory allocation failed */
+    PmQueueRep *queue;
+    if (flags & PM_QUEUE_RECORD) {
+        queue = (bytes_per_msg >= 0 ?
+                 recq_create(num_msgs, bytes_per_msg) : NULL);
+    } else if (flags & PM_QUEUE_EVENT) {
+        queue = (bytes_per_msg == sizeof(uint64_t) ?
+                 evq_create(num_msgs, (flags & PM_OVERFLOW_MASK) ==
+                                      PM_OVERFLOW_DROP_OLDEST) : NULL);
+    } else if (flags & PM_QUEUE_MPSC) {
+        queue = mpsc_create(num_msgs, int32s_per_msg);
+    } else if (flags & PM_QUEUE_SPSC) {
+        queue = ring_create(num_msgs, int32s_per_msg);
+    } else {
+        queue = pipe_create(num_msgs, int32s_per_msg);
+    }
+    if (!queue)
         return NULL;
+    queue->stats = (PmQueueStatsRep *) pm_alloc(sizeof(PmQueueStatsRep));
+    if (!queue->stats ||
+        ((flags & PM_QUEUE_WAITABLE) && !wait_create(queue))) {
+        Pm_QueueDestroy(queue);
+        return NULL;
+    }
+    memset(queue->stats, 0, sizeof(PmQueueStatsRep));
+    queue->stats->capacity = (is_event_queue(queue) ?
+                              ((PmEventQueueRep *) queue)->cap : num_msgs);
+    if ((flags & PM_OVERFLOW_MASK) &&
+        Pm_QueueSetOverflowPolicy(queue, flags & PM_OVERFLOW_MASK,
+                                  OVERFLOW_BLOCK_MS) != pmNoError) {
+        Pm_QueueDestroy(queue);
+        return NULL;
+    }
+    return queue;
+}
 
-    /* need extra word per message for non-zero encoding */
-    queue->len = num_msgs * (int32s_per_msg + 1);
-    queue->buffer = (int32_t *) pm_alloc(queue->len * sizeof(int32_t));
-    if (!queue->buffer) {
-        pm_free(queue);
+
+PMEXPORT PmQueue *Pm_QueueCreateEx(long num_msgs, int32_t bytes_per_msg,
+                                   int32_t flags)
+{
+    PmQueueRep *local;
+    PmQueueRep *queue = NULL;
+    char *mem;
+    long size;
+    if (!(flags & (PM_QUEUE_LOCKED | PM_QUEUE_HUGE_PAGES)))
+        return queue_create(num_msgs, bytes_per_msg, flags);
+    /* build the queue with pm_alloc(), then copy it to mapped memory */
+    local = queue_create(num_msgs, bytes_per_msg, flags);
+    if (!local)
         return NULL;
-    } else { /* allocate the "peek" buffer */
-        queue->peek = (int32_t *) pm_alloc(int32s_per_msg * sizeof(int32_t));
-        if (!queue->peek) {
-            /* free everything allocated so far and return */
-            pm_free(queue->buffer);
-            pm_free(queue);
-            return NULL;
+    if (is_indexed(local)) { /* the light pipe holds pointers */
+        size = (long) PLACED_REP_OFFSET + queue_bytes(local);
+        mem = storage_map(&size, flags);
+        if (mem) {
+            queue = queue_place(local, mem + PLACED_REP_OFFSET,
+                                QUEUE_PLACED | QUEUE_MAPPED);
+            queue_stats(queue)->mapped = size;
+            if (flags & PM_QUEUE_LOCKED)
+                storage_lock(queue, mem, size);
         }
     }
-    bzero(queue->buffer, queue->len * sizeof(int32_t));
-    queue->head = 0;
-    queue->tail = 0;
-    /* msg_size is in words */
-    queue->msg_size = int32s_per_msg + 1; /* note extra word is counted */
-    queue->overflow = FALSE;
-    queue->peek_overflow = FALSE;
-    queue->peek_flag = FALSE;
+    Pm_QueueDestroy(local);
+    return queue;
+}
+
+
+PMEXPORT long Pm_QueueMemorySize(long num_msgs, int32_t bytes_per_msg,
+                                 int32_t flags)
+{
+    PmQueueRep *local = queue_create(num_msgs, bytes_per_msg, flags);
+    long size = 0;
+    if (!local)
+        return 0;
+    if (is_indexed(local)) /* room to align the storage, see queue_place */
+        size = PM_CACHE_LINE - 1 + (long) PLACED_REP_OFFSET +
+               queue_bytes(local);
+    Pm_QueueDestroy(local);
+    return size;
+}
+
+
+PMEXPORT PmQueue *Pm_QueueCreateInPlace(void *mem, long mem_bytes,
+                                        long num_msgs, int32_t bytes_per_msg,
+                                        int32_t flags)
+{
+    PmQueueRep *local;
+    PmQueueRep *queue = NULL;
+    char *storage = (char *) (((uintptr_t) mem + PM_CACHE_LINE - 1) &
+                              ~(uintptr_t) (PM_CACHE_LINE - 1));
+    /* arg checking */
+    if (!mem)
+        return NULL;
+    local = queue_create(num_msgs, bytes_per_msg, flags);
+    if (!local)
+        return NULL;
+    if (is_indexed(local) &&
+        storage + PLACED_REP_OFFSET + queue_bytes(local) <=
+                (char *) mem + mem_bytes) {
+        queue = queue_place(local, storage + PLACED_REP_OFFSET,
+                            QUEUE_PLACED);
+        queue_stats(queue)->mapped = 0;
+        if (flags & PM_QUEUE_LOCKED)
+            storage_lock(queue, storage,
+                         (long) PLACED_REP_OFFSET + queue_bytes(queue));
+    }
+    Pm_QueueDestroy(local);
     return queue;
 }
 
@@ -70,7 +2185,28 @@ PMEXPORT PmError Pm_QueueDestroy(PmQueue *q)
 {
     PmQueueRep *queue = (PmQueueRep *) q;
         
+    if (queue && queue->wait) {
+        wait_destroy(queue->wait);
+        queue->wait = NULL;
+    }
+    if (queue && queue->stats) {
+        pm_free(queue->stats);
+        queue->stats = NULL;
+    }
+    if (queue && is_event_queue(queue) &&
+        ((PmEventQueueRep *) queue)->seqs) {
+        pm_free(((PmEventQueueRep *) queue)->seqs);
+        ((PmEventQueueRep *) queue)->seqs = NULL;
+    }
     /* arg checking */
+    if (queue && is_shared(queue))
+        return shared_unmap(queue);
+    if (queue && is_placed(queue))
+        return storage_release(queue);
+    if (queue && is_indexed(queue)) { /* a single allocation */
+        pm_free(queue);
+        return pmNoError;
+    }
     if (!queue || !queue->buffer || !queue->peek) 
                 return pmBadPtr;
     
@@ -89,8 +2225,14 @@ PMEXPORT PmError Pm_Dequeue(PmQueue *q, void *msg)
     int32_t *msg_as_int32 = (int32_t *) msg;
 
     /* arg checking */
-    if (!queue)
+    if (!queue || is_record_queue(queue))
         return pmBadPtr;
+    if (is_event_queue(queue))
+        return evq_dequeue((PmEventQueueRep *) q, msg);
+    if (is_mpsc(queue))
+        return mpsc_dequeue((PmMpscRep *) q, msg);
+    if (is_ring(queue))
+        return ring_dequeue((PmRingRep *) q, msg);
     /* a previous peek operation encountered an overflow, but the overflow
      * has not yet been reported to client, so do it now. No message is
      * returned, but on the next call, we will return the peek buffer.
@@ -148,8 +2290,16 @@ PMEXPORT PmError Pm_Dequeue(PmQueue *q, void *msg)
         msg_as_int32[i] = 0;
         i = j;
     }
-    /* signal that data has been removed by zeroing: */
-    bzero((char *) &queue->buffer[head], sizeof(int32_t) * queue->msg_size);
+    /* signal that data has been removed by zeroing. Rather than zeroing
+     * this message, which may share a cache line with the message the
+     * writer is writing, zero the one slack messages back (see
+     * Pm_QueueCreateEx), which is in a line the writer is done with.
+     * This is the deferred clearing suggested by Dokumentov.
+     */
+    bzero((char *) &queue->buffer[queue->clear],
+          sizeof(int32_t) * queue->msg_size);
+    queue->clear += queue->msg_size;
+    if (queue->clear == queue->len) queue->clear = 0;
 
     /* update head */
     head += queue->msg_size;
@@ -167,29 +2317,54 @@ PMEXPORT PmError Pm_SetOverflow(PmQueue *q)
     /* arg checking */
     if (!queue)
         return pmBadPtr;
+    if (is_record_queue(queue)) {
+        PmRecordQueueRep *rq = (PmRecordQueueRep *) q;
+        if (!pm_load_acquire(&rq->overflow)) {
+            pm_store_release(&rq->overflow, pm_load_relaxed(&rq->tail) + 1);
+        }
+        return queue_wake(queue, pmBufferOverflow);
+    }
+    if (is_event_queue(queue)) {
+        PmEventQueueRep *evq = (PmEventQueueRep *) q;
+        if (!pm_load_acquire(&evq->overflow)) {
+            pm_store_release(&evq->overflow, pm_load_relaxed(&evq->tail) + 1);
+        }
+        return queue_wake(queue, pmBufferOverflow);
+    }
+    if (is_mpsc(queue)) {
+        PmMpscRep *mq = (PmMpscRep *) q;
+        mpsc_set_overflow(mq, pm_load_relaxed(&mq->tail));
+        return queue_wake(queue, pmBufferOverflow);
+    }
+    if (is_ring(queue)) {
+        PmRingRep *ring = (PmRingRep *) q;
+        if (!pm_load_acquire(&ring->overflow)) {
+            pm_store_release(&ring->overflow,
+                             pm_load_relaxed(&ring->tail) + 1);
+        }
+        return queue_wake(queue, pmBufferOverflow);
+    }
     /* no more enqueue until receiver acknowledges overflow */
     if (queue->overflow) return pmBufferOverflow;
     tail = queue->tail;
     queue->overflow = tail + 1;
-    return pmBufferOverflow;
+    return queue_wake(queue, pmBufferOverflow);
 }
 
 
-PMEXPORT PmError Pm_Enqueue(PmQueue *q, void *msg)
+/* pipe_enqueue -- Pm_Enqueue() for the PM_QUEUE_LIGHT_PIPE queue */
+static PmError pipe_enqueue(PmQueueRep *queue, void *msg)
 {
-    PmQueueRep *queue = (PmQueueRep *) q;
     long tail;
     int i;
     int32_t *src = (int32_t *) msg;
     int32_t *ptr;
     int32_t *dest;
     int rslt;
-    if (!queue) 
-        return pmBadPtr;
     /* no more enqueue until receiver acknowledges overflow */
     if (queue->overflow) return pmBufferOverflow;
-    rslt = Pm_QueueFull(q);
-    /* already checked above: if (rslt == pmBadPtr) return rslt; */
+    rslt = Pm_QueueFull(queue);
+    /* queue is not NULL, so rslt is not pmBadPtr */
     tail = queue->tail;
     if (rslt) {
         queue->overflow = tail + 1;
@@ -217,9 +2392,136 @@ PMEXPORT PmError Pm_Enqueue(PmQueue *q, void *msg)
 }
 
 
+PMEXPORT PmError Pm_Enqueue(PmQueue *q, void *msg)
+{
+    PmQueueRep *queue = (PmQueueRep *) q;
+    PmError rslt;
+    if (!queue || is_record_queue(queue))
+        return pmBadPtr;
+    if (queue_make_room(queue, 1) == 0)
+        rslt = pmBufferOverflow; /* dropped, but not flagged */
+    else if (is_event_queue(queue))
+        rslt = evq_enqueue((PmEventQueueRep *) q, msg);
+    else if (is_mpsc(queue))
+        rslt = mpsc_enqueue((PmMpscRep *) q, msg);
+    else if (is_ring(queue))
+        rslt = ring_enqueue((PmRingRep *) q, msg);
+    else
+        rslt = pipe_enqueue(queue, msg);
+    queue_count(queue, rslt == pmNoError, 1);
+    return queue_wake(queue, rslt);
+}
+
+
+PMEXPORT int Pm_EnqueueBatch(PmQueue *q, void *msgs, int n)
+{
+    PmQueueRep *queue = (PmQueueRep *) q;
+    char *src = (char *) msgs;
+    int skip = 0;
+    int room;
+    int count;
+    if (!queue || is_record_queue(queue))
+        return pmBadPtr;
+    if (n <= 0)
+        return 0;
+    if (n > queue_stats(queue)->capacity &&
+        pm_load_relaxed(&queue_stats(queue)->policy) ==
+                PM_OVERFLOW_DROP_OLDEST) {
+        /* only the last capacity messages can be kept */
+        skip = n - queue_stats(queue)->capacity;
+        src += skip * queue_msg_bytes(queue);
+    }
+    room = queue_make_room(queue, n - skip);
+    if (room == 0) {
+        count = 0; /* all dropped, but not flagged */
+    } else if (is_event_queue(queue)) {
+        count = evq_enqueue_batch((PmEventQueueRep *) q, src, room);
+    } else if (is_mpsc(queue)) {
+        count = mpsc_enqueue_batch((PmMpscRep *) q, src, room);
+    } else if (is_ring(queue)) {
+        count = ring_enqueue_batch((PmRingRep *) q, src, room);
+    } else {
+        /* the light pipe tags every message, so there is nothing to share */
+        for (count = 0; count < room; count++) {
+            if (pipe_enqueue(queue, src) != pmNoError) break;
+            src += (queue->msg_size - 1) * sizeof(int32_t);
+        }
+    }
+    queue_count(queue, count, n);
+    return queue_wake(queue, count);
+}
+
+
+PMEXPORT int Pm_DequeueBatch(PmQueue *q, void *msgs, int max)
+{
+    PmQueueRep *queue = (PmQueueRep *) q;
+    char *dest = (char *) msgs;
+    int count;
+    if (!queue || is_record_queue(queue))
+        return pmBadPtr;
+    if (max <= 0)
+        return 0;
+    if (is_event_queue(queue))
+        return evq_dequeue_batch((PmEventQueueRep *) q, dest, NULL, max);
+    if (is_mpsc(queue))
+        return mpsc_dequeue_batch((PmMpscRep *) q, dest, max);
+    if (is_ring(queue))
+        return ring_dequeue_batch((PmRingRep *) q, dest, max);
+    for (count = 0; count < max; count++) {
+        PmError rslt = Pm_Dequeue(q, dest);
+        if (rslt == pmBufferOverflow) {
+            if (count > 0) { /* report it on the next call */
+                queue->peek_overflow = TRUE;
+                break;
+            }
+            return pmBufferOverflow;
+        } else if (rslt != pmGotData) {
+            break;
+        }
+        dest += (queue->msg_size - 1) * sizeof(int32_t);
+    }
+    return count;
+}
+
+
+PMEXPORT int Pm_DequeueBatchSoA(PmQueue *q, PmMessage *messages,
+                                PmTimestamp *timestamps, int max)
+{
+    PmQueueRep *queue = (PmQueueRep *) q;
+    /* arg checking */
+    if (!queue || !is_event_queue(queue) || !messages || !timestamps)
+        return pmBadPtr;
+    if (max <= 0)
+        return 0;
+    return evq_dequeue_batch((PmEventQueueRep *) q, (char *) messages,
+                             timestamps, max);
+}
+
+
 PMEXPORT int Pm_QueueEmpty(PmQueue *q)
 {
     PmQueueRep *queue = (PmQueueRep *) q;
+    if (queue && is_record_queue(queue)) {
+        PmRecordQueueRep *rq = (PmRecordQueueRep *) q;
+        return pm_load_relaxed(&rq->head) == pm_load_acquire(&rq->tail) &&
+               !rq->peek_flag;
+    }
+    if (queue && is_event_queue(queue)) {
+        PmEventQueueRep *evq = (PmEventQueueRep *) q;
+        return pm_load_relaxed(&evq->head) == pm_load_acquire(&evq->tail) &&
+               !evq->peek_flag;
+    }
+    if (queue && is_mpsc(queue)) {
+        PmMpscRep *mq = (PmMpscRep *) q;
+        long head = pm_load_relaxed(&mq->head);
+        return pm_load_acquire(mpsc_seq(mq, head)) !=
+               (long) ((unsigned long) head + 1) && !mq->peek_flag;
+    }
+    if (queue && is_ring(queue)) {
+        PmRingRep *ring = (PmRingRep *) q;
+        return pm_load_relaxed(&ring->head) == pm_load_acquire(&ring->tail) &&
+               !ring->peek_flag;
+    }
     return (!queue) ||  /* null pointer -> return "empty" */
            (queue->buffer[queue->head] == 0 && !queue->peek_flag);
 }
@@ -233,6 +2535,32 @@ PMEXPORT int Pm_QueueFull(PmQueue *q)
     /* arg checking */
     if (!queue)
         return pmBadPtr;
+    if (is_record_queue(queue)) {
+        /* full if a record of the largest size would not fit */
+        PmRecordQueueRep *rq = (PmRecordQueueRep *) q;
+        long n = recq_size(rq->max_len);
+        long off;
+        tail = pm_load_relaxed(&rq->tail);
+        off = tail & (rq->size - 1);
+        if (off + n > rq->size) n += rq->size - off; /* padding */
+        return rq->size - recq_count(rq, pm_load_acquire(&rq->head),
+                                     tail) < n;
+    }
+    if (is_event_queue(queue)) {
+        PmEventQueueRep *evq = (PmEventQueueRep *) q;
+        return evq_count(evq, pm_load_acquire(&evq->head),
+                         pm_load_relaxed(&evq->tail)) == evq->cap;
+    }
+    if (is_mpsc(queue)) {
+        PmMpscRep *mq = (PmMpscRep *) q;
+        return mpsc_diff(pm_load_relaxed(&mq->tail),
+                         pm_load_acquire(&mq->head)) >= mq->num_msgs;
+    }
+    if (is_ring(queue)) {
+        PmRingRep *ring = (PmRingRep *) q;
+        tail = pm_load_relaxed(&ring->tail);
+        return ring_next(ring, tail) == pm_load_acquire(&ring->head);
+    }
     tail = queue->tail;
     /* test to see if there is space in the queue */
     for (i = 0; i < queue->msg_size; i++) {
@@ -252,6 +2580,16 @@ PMEXPORT void *Pm_QueuePeek(PmQueue *q)
     /* arg checking */
     if (!queue)
         return NULL;
+    if (is_record_queue(queue)) {
+        PmRecordHeader *hdr = recq_peek((PmRecordQueueRep *) q);
+        return (hdr ? hdr + 1 : NULL);
+    }
+    if (is_event_queue(queue))
+        return evq_peek((PmEventQueueRep *) q);
+    if (is_mpsc(queue))
+        return mpsc_peek((PmMpscRep *) q);
+    if (is_ring(queue))
+        return ring_peek((PmRingRep *) q);
 
     if (queue->peek_flag) {
         return queue->peek;
@@ -281,3 +2619,369 @@ PMEXPORT void *Pm_QueuePeek(PmQueue *q)
     return NULL;
 }
 
+
+
+/* pipe_reserve -- Pm_QueueReserve() for the PM_QUEUE_LIGHT_PIPE queue.
+ * The light pipe must encode the message, so the caller fills in a
+ * buffer that Pm_QueueCommit() passes to pipe_enqueue().
+ */
+static void *pipe_reserve(PmQueueRep *queue)
+{
+    if (queue->overflow) return NULL;
+    if (!queue->reserved) {
+        if (Pm_QueueFull(queue)) {
+            queue->overflow = queue->tail + 1;
+            return NULL;
+        }
+        queue->reserved = TRUE;
+    }
+    return queue->peek + (queue->msg_size - 1);
+}
+
+
+PMEXPORT void *Pm_QueueReserve(PmQueue *q)
+{
+    PmQueueRep *queue = (PmQueueRep *) q;
+    void *slot;
+    /* arg checking */
+    if (!queue)
+        return NULL;
+    if (is_mpsc(queue))
+        return NULL; /* the reservation would have to be per producer */
+    if (is_record_queue(queue))
+        return NULL; /* see Pm_QueueReserveRecord() */
+    if (queue_make_room(queue, 1) == 0)
+        slot = NULL; /* dropped, but not flagged */
+    else if (is_event_queue(queue))
+        slot = evq_reserve((PmEventQueueRep *) q);
+    else if (is_ring(queue))
+        slot = ring_reserve((PmRingRep *) q);
+    else
+        slot = pipe_reserve(queue);
+    if (!slot) { /* the message will be dropped */
+        queue_count(queue, 0, 1);
+        queue_wake(queue, 0);
+    }
+    return slot;
+}
+
+
+PMEXPORT PmError Pm_QueueCommit(PmQueue *q)
+{
+    PmQueueRep *queue = (PmQueueRep *) q;
+    PmError rslt;
+    /* arg checking */
+    if (!queue)
+        return pmBadPtr;
+    if (is_mpsc(queue) || is_record_queue(queue))
+        return pmBadPtr; /* no reservation is possible */
+    if (is_event_queue(queue)) {
+        rslt = evq_commit((PmEventQueueRep *) q);
+    } else if (is_ring(queue)) {
+        rslt = ring_commit((PmRingRep *) q);
+    } else if (!queue->reserved) {
+        rslt = pmBadPtr;
+    } else {
+        queue->reserved = FALSE;
+        rslt = pipe_enqueue(queue, queue->peek + (queue->msg_size - 1));
+    }
+    if (rslt == pmBadPtr)
+        return rslt;
+    queue_count(queue, rslt == pmNoError, 1);
+    return queue_wake(queue, rslt);
+}
+
+
+PMEXPORT void *Pm_QueueReadPtr(PmQueue *q)
+{
+    return Pm_QueuePeek(q);
+}
+
+
+PMEXPORT PmError Pm_QueueRelease(PmQueue *q)
+{
+    PmQueueRep *queue = (PmQueueRep *) q;
+    PmError rslt = pmGotData;
+    /* arg checking */
+    if (!queue)
+        return pmBadPtr;
+    if (is_record_queue(queue))
+        return recq_release((PmRecordQueueRep *) q);
+    if (is_event_queue(queue))
+        return evq_release((PmEventQueueRep *) q);
+    if (is_mpsc(queue))
+        return mpsc_release((PmMpscRep *) q);
+    if (is_ring(queue))
+        return ring_release((PmRingRep *) q);
+    if (queue->peek_overflow) {
+        queue->peek_overflow = FALSE;
+        rslt = pmBufferOverflow;
+    }
+    /* the light pipe has already moved the message to the peek buffer */
+    if (queue->peek_flag) {
+        queue->peek_flag = FALSE;
+    } else if (rslt == pmGotData) {
+        rslt = pmNoData; /* nothing to release */
+    }
+    return rslt;
+}
+
+
+PMEXPORT PmError Pm_QueueArm(PmQueue *q)
+{
+    PmQueueRep *queue = (PmQueueRep *) q;
+    /* arg checking */
+    if (!queue)
+        return pmBadPtr;
+    if (!queue->wait)
+        return pmNotImplemented;
+    return queue_arm(queue);
+}
+
+
+PMEXPORT PmError Pm_QueueWait(PmQueue *q, long timeout_us)
+{
+    PmQueueRep *queue = (PmQueueRep *) q;
+    PmError rslt;
+    /* arg checking */
+    if (!queue)
+        return pmBadPtr;
+    if (!queue->wait)
+        return pmNotImplemented;
+    rslt = queue_arm(queue);
+    if (rslt != pmNoData || timeout_us == 0) {
+        pm_store_release(&queue->wait->waiting, 0);
+        return rslt;
+    }
+    wait_block(queue->wait, timeout_us);
+    /* after a timeout, the writer no longer needs to wake us */
+    pm_store_release(&queue->wait->waiting, 0);
+    return queue_ready(queue) ? pmGotData : pmNoData;
+}
+
+
+PMEXPORT int Pm_QueueGetFd(PmQueue *q)
+{
+    PmQueueRep *queue = (PmQueueRep *) q;
+    if (!queue || !queue->wait)
+        return -1;
+#ifdef WIN32
+    return -1;
+#else
+    return queue->wait->fd[0];
+#endif
+}
+
+
+PMEXPORT PmError Pm_QueueGetStats(PmQueue *q, PmQueueStats *stats)
+{
+    PmQueueRep *queue = (PmQueueRep *) q;
+    PmQueueStatsRep *counts;
+    /* arg checking */
+    if (!queue || !stats)
+        return pmBadPtr;
+    counts = queue_stats(queue);
+    stats->depth = queue_depth(queue, TRUE);
+    stats->capacity = counts->capacity;
+    if (is_mpsc(queue)) {
+        PmMpscRep *mq = (PmMpscRep *) q;
+        stats->enqueued = (unsigned long) pm_load_acquire(&mq->tail);
+        stats->dropped = pm_load_relaxed(&counts->shared_dropped);
+        stats->high_water = pm_load_relaxed(&counts->shared_high_water);
+    } else {
+        stats->enqueued = counts->enqueued;
+        stats->dropped = counts->dropped + counts->evicted;
+        stats->high_water = counts->high_water;
+    }
+    /* the depth may have been read before some of the enqueues counted */
+    stats->dequeued = stats->enqueued - counts->evicted;
+    stats->dequeued = (stats->dequeued > (uint64_t) stats->depth ?
+                       stats->dequeued - stats->depth : 0);
+    if (stats->high_water < stats->depth)
+        stats->high_water = stats->depth;
+    return pmNoError;
+}
+
+
+PMEXPORT PmError Pm_EnqueueRecord(PmQueue *q, const void *data, int32_t len,
+                                  PmTimestamp timestamp)
+{
+    PmRecordQueueRep *rq = (PmRecordQueueRep *) q;
+    PmError rslt;
+    /* arg checking */
+    if (!rq || !is_record_queue(rq) || len < 0 || len > rq->max_len ||
+        (len > 0 && !data))
+        return pmBadPtr;
+    rslt = recq_enqueue(rq, data, len, timestamp);
+    queue_count((PmQueueRep *) q, rslt == pmNoError, 1);
+    return queue_wake((PmQueueRep *) q, rslt);
+}
+
+
+PMEXPORT PmError Pm_DequeueRecord(PmQueue *q, void *data, int32_t *len,
+                                  PmTimestamp *timestamp)
+{
+    PmRecordQueueRep *rq = (PmRecordQueueRep *) q;
+    /* arg checking */
+    if (!rq || !is_record_queue(rq) || !len)
+        return pmBadPtr;
+    return recq_dequeue(rq, data, len, timestamp);
+}
+
+
+PMEXPORT void *Pm_QueuePeekRecord(PmQueue *q, int32_t *len,
+                                  PmTimestamp *timestamp)
+{
+    PmRecordQueueRep *rq = (PmRecordQueueRep *) q;
+    PmRecordHeader *hdr;
+    /* arg checking */
+    if (!rq || !is_record_queue(rq))
+        return NULL;
+    hdr = recq_peek(rq);
+    if (!hdr)
+        return NULL;
+    if (len) *len = hdr->len;
+    if (timestamp) *timestamp = hdr->timestamp;
+    return hdr + 1;
+}
+
+
+PMEXPORT void *Pm_QueueReserveRecord(PmQueue *q, int32_t len)
+{
+    PmRecordQueueRep *rq = (PmRecordQueueRep *) q;
+    void *payload;
+    /* arg checking */
+    if (!rq || !is_record_queue(rq) || len < 0 || len > rq->max_len)
+        return NULL;
+    payload = recq_reserve(rq, len);
+    if (!payload) { /* the record will be dropped */
+        queue_count((PmQueueRep *) q, 0, 1);
+        queue_wake((PmQueueRep *) q, 0);
+    }
+    return payload;
+}
+
+
+PMEXPORT PmError Pm_QueueCommitRecord(PmQueue *q, int32_t len,
+                                      PmTimestamp timestamp)
+{
+    PmRecordQueueRep *rq = (PmRecordQueueRep *) q;
+    PmError rslt;
+    /* arg checking */
+    if (!rq || !is_record_queue(rq))
+        return pmBadPtr;
+    rslt = recq_commit(rq, len, timestamp);
+    if (rslt == pmBadPtr)
+        return rslt;
+    queue_count((PmQueueRep *) q, 1, 1);
+    return queue_wake((PmQueueRep *) q, rslt);
+}
+
+
+PMEXPORT PmQueue *Pm_QueueCreateShared(const char *name, long num_msgs,
+                                       int32_t bytes_per_msg, int32_t flags)
+{
+    char path[SHARED_NAME_MAX];
+    PmQueueRep *local;
+    PmQueueRep *queue = NULL;
+    PmSharedHeader *hdr;
+    long bytes;
+    long size;
+    /* arg checking */
+    if (!shared_name(path, name) || (flags & PM_QUEUE_WAITABLE))
+        return NULL;
+    /* build the queue in private memory, then copy it to the mapping */
+    local = queue_create(num_msgs, bytes_per_msg, flags);
+    if (!local)
+        return NULL;
+    if (!is_indexed(local)) { /* the light pipe holds pointers */
+        Pm_QueueDestroy(local);
+        return NULL;
+    }
+    bytes = queue_bytes(local);
+    size = SHARED_REP_OFFSET + bytes;
+    hdr = shared_map(path, &size);
+    if (hdr) {
+        queue = queue_place(local, (char *) hdr + SHARED_REP_OFFSET,
+                            QUEUE_SHARED);
+        if (flags & PM_QUEUE_LOCKED) /* unmapping unlocks */
+            storage_lock(queue, hdr, size);
+        hdr->size = size;
+#ifdef WIN32
+        hdr->creator = (long) GetCurrentProcessId();
+#else
+        hdr->creator = (long) getpid();
+#endif
+        strcpy(hdr->name, path);
+        pm_fence(); /* the queue must be complete before magic is set */
+        hdr->magic = SHARED_MAGIC;
+    }
+    Pm_QueueDestroy(local);
+    return queue;
+}
+
+
+PMEXPORT PmQueue *Pm_QueueAttachShared(const char *name)
+{
+    char path[SHARED_NAME_MAX];
+    PmSharedHeader *hdr;
+    long size = 0;
+    /* arg checking */
+    if (!shared_name(path, name))
+        return NULL;
+    hdr = shared_map(path, &size);
+    if (!hdr)
+        return NULL;
+    if (hdr->magic != SHARED_MAGIC) { /* not a queue, or not ready */
+#ifdef WIN32
+        UnmapViewOfFile(hdr);
+#else
+        munmap(hdr, size);
+#endif
+        return NULL;
+    }
+    pm_fence(); /* read the queue after magic */
+    return (PmQueue *) ((char *) hdr + SHARED_REP_OFFSET);
+}
+
+
+PMEXPORT PmError Pm_QueueSetOverflowPolicy(PmQueue *q, int32_t policy,
+                                           int32_t block_ms)
+{
+    PmQueueRep *queue = (PmQueueRep *) q;
+    PmQueueStatsRep *stats;
+    /* arg checking */
+    if (!queue)
+        return pmBadPtr;
+    if (policy != PM_OVERFLOW_REPORT && policy != PM_OVERFLOW_DROP_OLDEST &&
+        policy != PM_OVERFLOW_DROP_NEWEST && policy != PM_OVERFLOW_BLOCK)
+        return pmBadPtr;
+    if (policy != PM_OVERFLOW_REPORT &&
+        (is_mpsc(queue) || is_record_queue(queue)))
+        return pmNotImplemented;
+    if (policy == PM_OVERFLOW_DROP_OLDEST) {
+        PmEventQueueRep *evq = (PmEventQueueRep *) q;
+        long i;
+        if (!is_event_queue(queue))
+            return pmNotImplemented;
+        if (!evq->seq_inline && !evq->seqs) {
+            /* another process cannot use memory from pm_alloc() */
+            if (is_shared(queue))
+                return pmNotImplemented;
+            evq->seqs = (pm_atomic_long *)
+                    pm_alloc(evq->cap * sizeof(pm_atomic_long));
+            if (!evq->seqs)
+                return pmInsufficientMemory;
+            for (i = 0; i < evq->cap; i++) /* matches no index + 1 */
+                evq->seqs[i] = -1;
+        }
+        /* the reader must claim messages with compare-and-swap before
+         * the writer may evict them, and must go on doing so in case
+         * the writer is still evicting after the policy changes */
+        evq->shared_head = TRUE;
+    }
+    stats = queue_stats(queue);
+    pm_store_release(&stats->block_ms, block_ms);
+    pm_store_release(&stats->policy, policy);
+    return pmNoError;
+}
@@ -48,13 +48,16 @@ typedef void PmQueue;
     subsequent Pm_Dequeue() will copy from this buffer.
 
     This implementation does not try to keep reader/writer data in
-    separate cache lines or prevent thrashing on cache lines. 
+    separate cache lines or prevent thrashing on cache lines (see
+    #PM_QUEUE_SPSC for a queue that does).
     However, this algorithm differs by doing inserts/removals in
-    units of messages rather than units of machine words. Some
-    performance improvement might be obtained by not clearing data
-    immediately after a read, but instead by waiting for the end
-    of the cache line, especially if messages are smaller than
-    cache lines. See the Dokumentov article for explanation.
+    units of messages rather than units of machine words. As the
+    Dokumentov article suggests, data is not cleared immediately
+    after a read: the reader clears each message once it is at least
+    a cache line behind the message being read, so the reader does
+    not write to the cache line the writer is filling when the queue
+    is nearly empty. A cache line's worth of extra space is allocated
+    so that the queue still holds \p num_msgs messages.
 
     The algorithm is extended to handle "overflow" reporting. To
     report an overflow, the sender writes the current tail position to
@@ -62,14 +65,235 @@ typedef void PmQueue;
     field. The sender will not send more until the field is zeroed.
  */
 PMEXPORT PmQueue *Pm_QueueCreate(long num_msgs, int32_t bytes_per_msg);
-    
+
+/** #Pm_QueueCreateEx() flag: the "light pipe" queue created by
+    #Pm_QueueCreate(). */
+#define PM_QUEUE_LIGHT_PIPE 0
+
+/** #Pm_QueueCreateEx() flag: a ring of fixed-size slots with explicit
+    head and tail indices, published with C11 acquire/release atomics.
+
+    The producer's and consumer's data are kept in separate cache
+    lines, and each side keeps a cached copy of the other side's
+    index, so the other side's cache line is only touched when the
+    queue appears to be full (producer) or empty (consumer). This
+    avoids the false sharing of the light pipe when the producer and
+    consumer run on different cores. Messages are not encoded, so
+    #Pm_QueuePeek() returns a pointer into the queue rather than
+    copying the message to a separate buffer.
+ */
+#define PM_QUEUE_SPSC 1
+
+/** #Pm_QueueCreateEx() flag: a queue specialized for #PmEvent messages.
+
+    Works like #PM_QUEUE_SPSC, but each message occupies exactly one
+    8-byte slot (the light pipe needs 12 bytes per #PmEvent) and is
+    copied with a single 64-bit load and store. The number of slots is
+    \p num_msgs rounded up to a power of two (at least 2), so the queue
+    can hold at
+    least \p num_msgs messages, and positions wrap with a mask instead
+    of a comparison. \p bytes_per_msg must be sizeof(#PmEvent). This is
+    the queue used for input by #Pm_OpenInput().
+ */
+#define PM_QUEUE_EVENT 2
+
+/** #Pm_QueueCreateEx() flag: a bounded queue with any number of writers
+    and one reader.
+
+    Writers claim slots with a compare-and-swap, so several threads
+    (e.g. a sequencer, a user interface and a MIDI thru process) can
+    call #Pm_Enqueue() on the same queue concurrently, and the reader
+    receives their messages in the order the slots were claimed. The
+    queue holds exactly \p num_msgs messages, using storage for
+    \p num_msgs rounded up to a power of two. Overflow is reported as
+    with other queues, but since writers run concurrently, messages
+    from writers that were already enqueuing when the overflow occurred
+    may be received just before the #pmBufferOverflow report.
+    #Pm_QueueReserve() is not supported and always returns NULL. As
+    always, only one thread may read.
+ */
+#define PM_QUEUE_MPSC 4
+
+/** #Pm_QueueCreateEx() flag, combined with one of the others: allow the
+    reader to sleep in #Pm_QueueWait() until a writer adds a message.
+
+    Writers only make a system call to wake the reader when the reader
+    has announced that it is waiting, so enqueuing costs one memory
+    barrier more than without this flag. On POSIX systems, the queue
+    also has a file descriptor (see #Pm_QueueGetFd()) that can be
+    passed to poll() or select() along with other descriptors.
+ */
+#define PM_QUEUE_WAITABLE 8
+
+/** #Pm_QueueCreateEx() flag: a queue of variable-length records, each
+    holding up to \p bytes_per_msg bytes of payload and a timestamp.
+
+    Records are stored contiguously in a ring of bytes, so a record
+    takes only its own length plus 8 bytes, and a whole system
+    exclusive message can be passed with one operation instead of one
+    #PmEvent per 4 bytes. A record that would not fit before the end of
+    the ring starts over at the beginning. The queue holds at least
+    \p num_msgs records of the largest size, and more smaller ones.
+
+    Records are passed with #Pm_EnqueueRecord(), #Pm_DequeueRecord(),
+    #Pm_QueuePeekRecord(), #Pm_QueueReserveRecord() and
+    #Pm_QueueCommitRecord(). #Pm_QueuePeek() and #Pm_QueueReadPtr()
+    return a pointer to the payload of the next record, and
+    #Pm_QueueRelease(), #Pm_QueueEmpty(), #Pm_QueueFull() (true when a
+    record of the largest size would not fit), #Pm_SetOverflow() and
+    #Pm_QueueWait() work as with other queues. The fixed-size
+    functions (#Pm_Enqueue(), #Pm_Dequeue(), #Pm_QueueReserve(), etc.)
+    return #pmBadPtr or NULL. Statistics (see #Pm_QueueGetStats())
+    count records.
+ */
+#define PM_QUEUE_RECORD 16
+
+/** #Pm_QueueCreateEx() flag, combined with one of the others: keep the
+    queue in memory that is touched (pre-faulted) when the queue is
+    created and then locked with mlock() (VirtualLock() on Windows), so
+    that the first messages written to or read from the queue do not
+    cause page faults. If the process is not allowed to lock that much
+    memory, the queue is still created, pre-faulted but not locked.
+    Only index-based queues support this: the light pipe's storage
+    holds pointers, so it cannot be moved to mapped memory, and
+    #Pm_QueueCreateEx() returns NULL for #PM_QUEUE_LIGHT_PIPE with this
+    flag. An input stream's queue is locked if it is opened with
+    #pmKeyLockedInput.
+ */
+#define PM_QUEUE_LOCKED 32
+
+/** #Pm_QueueCreateEx() flag, combined with one of the others: keep the
+    queue in huge pages (2 MB, or the large page size on Windows) if
+    the system has some reserved, otherwise in normal pages, so that a
+    large queue needs fewer TLB entries. Huge pages are pre-faulted
+    and, on most systems, never paged out; combine with
+    #PM_QUEUE_LOCKED to lock normal pages if there are no huge pages.
+    As with #PM_QUEUE_LOCKED, #Pm_QueueCreateEx() returns NULL for
+    #PM_QUEUE_LIGHT_PIPE with this flag.
+ */
+#define PM_QUEUE_HUGE_PAGES 64
+
+/* The overflow policies (PM_OVERFLOW_REPORT, etc.), which are also
+   #Pm_QueueCreateEx() flags, and #PmQueueStats are defined in
+   portmidi.h, since input streams use them too. */
+
+/** create a single-reader, single-writer queue using the
+    implementation selected by \p flags.
+
+    @param num_msgs the number of messages the queue can hold
+
+    @param bytes_per_msg the fixed message size
+
+    @param flags #PM_QUEUE_LIGHT_PIPE, #PM_QUEUE_SPSC, #PM_QUEUE_EVENT,
+    #PM_QUEUE_MPSC or #PM_QUEUE_RECORD, optionally or'ed with
+    #PM_QUEUE_WAITABLE, #PM_QUEUE_LOCKED, #PM_QUEUE_HUGE_PAGES and an
+    overflow policy such as #PM_OVERFLOW_DROP_OLDEST
+    (#PM_OVERFLOW_BLOCK waits up to 10 ms).
+
+    @return the allocated and initialized queue, or NULL if memory
+    cannot be allocated or \p bytes_per_msg, the overflow policy or
+    the memory flags are not supported by the selected
+    implementation (#PM_QUEUE_LIGHT_PIPE, the default, supports neither
+    #PM_QUEUE_LOCKED nor #PM_QUEUE_HUGE_PAGES). Allocation uses pm_alloc(), except that the queue
+    memory is mapped directly from the system with #PM_QUEUE_LOCKED or
+    #PM_QUEUE_HUGE_PAGES.
+
+    All queue functions (#Pm_Enqueue(), #Pm_Dequeue(), #Pm_QueuePeek(),
+    #Pm_SetOverflow(), etc.) work on every kind of queue with the same
+    semantics, including overflow reporting.
+ */
+PMEXPORT PmQueue *Pm_QueueCreateEx(long num_msgs, int32_t bytes_per_msg,
+                                   int32_t flags);
+
+/** get the number of bytes of memory that #Pm_QueueCreateInPlace()
+    needs for a queue.
+
+    @param num_msgs, bytes_per_msg, flags as for #Pm_QueueCreateInPlace().
+
+    @return the number of bytes, or 0 if the queue cannot be created
+    in place.
+ */
+PMEXPORT long Pm_QueueMemorySize(long num_msgs, int32_t bytes_per_msg,
+                                 int32_t flags);
+
+/** create a queue in memory provided by the caller, e.g. memory that
+    is already locked or that is part of a larger structure.
+
+    @param mem the memory for the queue. It does not need any
+    particular alignment.
+
+    @param mem_bytes the size of \p mem, at least the result of
+    #Pm_QueueMemorySize() for the same parameters.
+
+    @param num_msgs, bytes_per_msg, flags as for #Pm_QueueCreateEx(),
+    except that the light pipe and #PM_QUEUE_HUGE_PAGES are not
+    supported. With #PM_QUEUE_LOCKED, \p mem is locked, and it is
+    unlocked by #Pm_QueueDestroy() (locks do not nest, so this unlocks
+    any other data on the same pages).
+
+    @return the queue, or NULL if \p mem is NULL or too small, or
+    \p flags are not supported. The queue is created with pm_alloc()
+    and copied into \p mem, which pre-faults every page of it, so
+    creation is not real-time safe, but using the queue never
+    allocates. #Pm_QueueDestroy() does not free \p mem, which must
+    remain valid until then.
+ */
+PMEXPORT PmQueue *Pm_QueueCreateInPlace(void *mem, long mem_bytes,
+                                        long num_msgs, int32_t bytes_per_msg,
+                                        int32_t flags);
+
+/** create a queue in named shared memory so that the reader and
+    writer(s) can be in different processes.
+
+    @param name a name for the queue, up to 62 characters, that other
+    processes pass to #Pm_QueueAttachShared(). On POSIX systems, this
+    is a shm_open() name (a '/' is added at the front if missing).
+
+    @param num_msgs the number of messages the queue can hold, as in
+    #Pm_QueueCreateEx().
+
+    @param bytes_per_msg the message size, as in #Pm_QueueCreateEx().
+
+    @param flags #PM_QUEUE_SPSC, #PM_QUEUE_EVENT, #PM_QUEUE_MPSC or
+    #PM_QUEUE_RECORD, optionally or'ed with #PM_QUEUE_LOCKED (which
+    locks the whole mapping in this process) and an overflow policy.
+    #PM_QUEUE_HUGE_PAGES is ignored. These queues keep their data and the indices
+    that are shared between reader and writer in one block that holds
+    no pointers, so each process can map it at a different address,
+    and they use the same lock-free protocol as in a single process
+    (no system calls and no copies through the kernel). The light pipe
+    and #PM_QUEUE_WAITABLE are not supported.
+
+    @return the queue, or NULL if the name is in use (or invalid),
+    \p flags are not supported, or memory cannot be allocated.
+
+    The queue functions work on the result as on any other queue, but
+    the usual single reader (and, except with #PM_QUEUE_MPSC, single
+    writer) rule applies across all processes. #Pm_QueueDestroy()
+    unmaps the queue; when called by the creating process it also
+    removes the name, and the memory is freed when the last process
+    has destroyed its handle.
+ */
+PMEXPORT PmQueue *Pm_QueueCreateShared(const char *name, long num_msgs,
+                                       int32_t bytes_per_msg, int32_t flags);
+
+/** map a queue created by another process with #Pm_QueueCreateShared().
+
+    @param name the name passed to #Pm_QueueCreateShared().
+
+    @return the queue, or NULL if there is no such queue or it has not
+    been completely created yet. Use #Pm_QueueDestroy() to unmap it.
+ */
+PMEXPORT PmQueue *Pm_QueueAttachShared(const char *name);
+
 /** destroy a queue and free its storage. 
 
     @param queue a queue created by #Pm_QueueCreate().
 
     @return pmNoError or an error code.
 
-    Uses pm_free(). 
+    Uses pm_free(). A queue created by #Pm_QueueCreateInPlace() only
+    releases its wakeup state and lock; the caller frees the memory.
 
  */
 PMEXPORT PmError Pm_QueueDestroy(PmQueue *queue);
@@ -101,6 +325,69 @@ PMEXPORT PmError Pm_Dequeue(PmQueue *queue, void *msg);
  */
 PMEXPORT PmError Pm_Enqueue(PmQueue *queue, void *msg);
 
+/** insert up to \p n messages into the queue, copying them from \p msgs.
+
+    @param queue a queue created by #Pm_QueueCreate() or #Pm_QueueCreateEx().
+
+    @param msgs address of an array of \p n messages, each of the
+    message size given when the queue was created.
+
+    @param n the number of messages to insert.
+
+    @return the number of messages inserted, or #pmBadPtr if \p queue
+    is NULL. If fewer than \p n messages are inserted, the queue
+    became (or already was) full and the overflow flag is set exactly
+    as if #Pm_Enqueue() had been called for the first message that
+    was not inserted, so the reader will see #pmBufferOverflow after
+    the last message that was inserted.
+
+    With #PM_QUEUE_SPSC queues, all messages are copied before the
+    new tail position is published, so the reader's cache line is
+    touched once per batch rather than once per message.
+ */
+PMEXPORT int Pm_EnqueueBatch(PmQueue *queue, void *msgs, int n);
+
+/** remove up to \p max messages from the queue, copying them into
+    \p msgs.
+
+    @param queue a queue created by #Pm_QueueCreate() or #Pm_QueueCreateEx().
+
+    @param msgs address of an array with room for \p max messages.
+
+    @param max the maximum number of messages to remove.
+
+    @return the number of messages removed (0 if the queue is empty),
+    #pmBufferOverflow, or #pmBadPtr if \p queue is NULL.
+
+    A batch never extends past an overflow: messages up to the point
+    where data was dropped are returned, and the next call returns
+    #pmBufferOverflow. Thus, calling #Pm_DequeueBatch() repeatedly
+    reports exactly what repeated calls to #Pm_Dequeue() would report.
+ */
+PMEXPORT int Pm_DequeueBatch(PmQueue *queue, void *msgs, int max);
+
+/** remove up to \p max events from a #PM_QUEUE_EVENT queue, storing
+    their messages and timestamps in separate arrays.
+
+    @param queue a queue created with #PM_QUEUE_EVENT.
+
+    @param messages address of an array with room for \p max messages.
+
+    @param timestamps address of an array with room for \p max
+    timestamps.
+
+    @param max the maximum number of events to remove.
+
+    @return as for #Pm_DequeueBatch(), or #pmBadPtr if \p queue is not
+    a #PM_QUEUE_EVENT queue or an array is NULL.
+
+    The events are split as they are copied out of the queue, so code
+    that processes messages and timestamps as separate arrays (e.g.
+    with vector instructions) needs no extra pass to separate them.
+ */
+PMEXPORT int Pm_DequeueBatchSoA(PmQueue *queue, PmMessage *messages,
+                                PmTimestamp *timestamps, int max);
+
 /** test if the queue is full.
 
     @param queue a queue created by #Pm_QueueCreate().
@@ -159,6 +446,255 @@ PMEXPORT int Pm_QueueEmpty(PmQueue *queue);
  */
 PMEXPORT void *Pm_QueuePeek(PmQueue *queue);
 
+/** get a pointer to the item at the head of the queue, to be
+    removed by #Pm_QueueRelease().
+
+    @param queue a queue created by #Pm_QueueCreate() or #Pm_QueueCreateEx().
+
+    @result a pointer to the head message or NULL if the queue is empty
+    or the next message was dropped due to overflow.
+
+    This is #Pm_QueuePeek(), and the same overflow rules apply. With
+    #PM_QUEUE_SPSC queues, the pointer is into the queue itself, so a
+    consumer that inspects a message, decides where it goes, and then
+    forwards it (e.g. with #Pm_Write()) never copies the message. The
+    pointer remains valid until #Pm_QueueRelease() or #Pm_Dequeue()
+    is called.
+ */
+PMEXPORT void *Pm_QueueReadPtr(PmQueue *queue);
+
+/** remove the message returned by #Pm_QueueReadPtr() from the queue
+    without copying it.
+
+    @param queue a queue created by #Pm_QueueCreate() or #Pm_QueueCreateEx().
+
+    @return #pmGotData if a message was removed, #pmNoData if there was
+    no message to remove, #pmBufferOverflow if messages were dropped
+    before the removed message (or, when #Pm_QueueReadPtr() returned
+    NULL, at the head of the queue), or #pmBadPtr if \p queue is NULL.
+ */
+PMEXPORT PmError Pm_QueueRelease(PmQueue *queue);
+
+/** get a pointer to storage for the next message so that the writer
+    can build it in place, to be inserted by #Pm_QueueCommit().
+
+    @param queue a queue created by #Pm_QueueCreate() or #Pm_QueueCreateEx().
+
+    @return a pointer to room for one message, or NULL if the queue is
+    full or in the overflow state. When the queue is full, the overflow
+    flag is set as if #Pm_Enqueue() had failed, so the reader will see
+    #pmBufferOverflow where the message would have been.
+
+    With #PM_QUEUE_SPSC queues, the pointer is into the queue itself.
+    Other queues return a separate buffer, which #Pm_QueueCommit()
+    copies with #Pm_Enqueue(). Calling #Pm_QueueReserve() again before
+    #Pm_QueueCommit() returns the same storage. #PM_QUEUE_MPSC queues do
+    not support reservations and always return NULL.
+ */
+PMEXPORT void *Pm_QueueReserve(PmQueue *queue);
+
+/** make the message built in storage from #Pm_QueueReserve() visible
+    to the reader.
+
+    @param queue a queue created by #Pm_QueueCreate() or #Pm_QueueCreateEx().
+
+    @return #pmNoError if successful, or #pmBadPtr if \p queue is NULL
+    or there is no reserved message.
+ */
+PMEXPORT PmError Pm_QueueCommit(PmQueue *queue);
+
+/** insert a record into a #PM_QUEUE_RECORD queue.
+
+    @param queue a queue created with #PM_QUEUE_RECORD.
+
+    @param data the payload, \p len bytes.
+
+    @param len the payload size, from 0 to the \p bytes_per_msg passed
+    to #Pm_QueueCreateEx().
+
+    @param timestamp a time stored with the record.
+
+    @return #pmNoError, #pmBufferOverflow if the record does not fit
+    (the reader will see the overflow where it would have been), or
+    #pmBadPtr if \p queue is not a #PM_QUEUE_RECORD queue or \p len is
+    out of range.
+ */
+PMEXPORT PmError Pm_EnqueueRecord(PmQueue *queue, const void *data,
+                                  int32_t len, PmTimestamp timestamp);
+
+/** remove a record from a #PM_QUEUE_RECORD queue, copying its payload.
+
+    @param queue a queue created with #PM_QUEUE_RECORD.
+
+    @param data where to copy the payload.
+
+    @param len on entry, the size of \p data in bytes; on return, the
+    size of the payload.
+
+    @param timestamp where to store the record's timestamp, or NULL.
+
+    @return #pmGotData, #pmNoData, #pmBufferOverflow (as with
+    #Pm_Dequeue()), #pmBufferTooSmall if the payload is larger than
+    \p *len (the record stays in the queue and \p *len is set to the
+    size needed), or #pmBadPtr.
+ */
+PMEXPORT PmError Pm_DequeueRecord(PmQueue *queue, void *data, int32_t *len,
+                                  PmTimestamp *timestamp);
+
+/** get a pointer to the payload of the next record in a
+    #PM_QUEUE_RECORD queue without removing it.
+
+    @param queue a queue created with #PM_QUEUE_RECORD.
+
+    @param len where to store the payload size, or NULL.
+
+    @param timestamp where to store the record's timestamp, or NULL.
+
+    @return a pointer into the queue, valid until the record is removed
+    with #Pm_QueueRelease() or #Pm_DequeueRecord(), or NULL if the
+    queue is empty or the next record was dropped (see
+    #Pm_QueuePeek()).
+ */
+PMEXPORT void *Pm_QueuePeekRecord(PmQueue *queue, int32_t *len,
+                                  PmTimestamp *timestamp);
+
+/** get a pointer to contiguous storage in a #PM_QUEUE_RECORD queue for
+    the payload of the next record, to be inserted by
+    #Pm_QueueCommitRecord().
+
+    @param queue a queue created with #PM_QUEUE_RECORD.
+
+    @param len the largest payload that will be committed.
+
+    @return a pointer into the queue, or NULL if \p len is out of range
+    or the record does not fit, in which case the overflow flag is set
+    as if #Pm_EnqueueRecord() had failed. Calling this again before
+    #Pm_QueueCommitRecord() replaces the reservation.
+ */
+PMEXPORT void *Pm_QueueReserveRecord(PmQueue *queue, int32_t len);
+
+/** make the record built in storage from #Pm_QueueReserveRecord()
+    visible to the reader.
+
+    @param queue a queue created with #PM_QUEUE_RECORD.
+
+    @param len the payload size, which may be less than was reserved.
+
+    @param timestamp a time stored with the record.
+
+    @return #pmNoError, or #pmBadPtr if there is no reservation or
+    \p len is larger than the reservation.
+ */
+PMEXPORT PmError Pm_QueueCommitRecord(PmQueue *queue, int32_t len,
+                                      PmTimestamp timestamp);
+
+/** wait until the queue has something for the reader to receive.
+
+    @param queue a queue created by #Pm_QueueCreateEx() with the
+    #PM_QUEUE_WAITABLE flag.
+
+    @param timeout_us the maximum time to wait in microseconds (rounded
+    up to the system's timer resolution), or a negative value to wait
+    indefinitely.
+
+    @return #pmGotData if a message (or an overflow report) can be
+    received with #Pm_Dequeue(), #pmNoData if the time ran out,
+    #pmNotImplemented if \p queue is not waitable, or #pmBadPtr if
+    \p queue is NULL.
+
+    Only the reader may call this function. Like #Pm_QueueEmpty(), the
+    result is a hint: #pmNoData can also be returned early, e.g. if the
+    wait is interrupted by a signal, so check the time and call again
+    if necessary.
+ */
+PMEXPORT PmError Pm_QueueWait(PmQueue *queue, long timeout_us);
+
+/** prepare to wait for the queue's file descriptor (see
+    #Pm_QueueGetFd()) to become readable.
+
+    @param queue a queue created by #Pm_QueueCreateEx() with the
+    #PM_QUEUE_WAITABLE flag.
+
+    @return #pmNoData if the reader should now wait, #pmGotData if
+    there is already something to receive (so do not wait),
+    #pmNotImplemented if \p queue is not waitable, or #pmBadPtr if
+    \p queue is NULL.
+
+    The descriptor is only made readable for a reader that has called
+    #Pm_QueueArm(), so call it each time before poll() or select().
+ */
+PMEXPORT PmError Pm_QueueArm(PmQueue *queue);
+
+/** get a file descriptor that becomes readable when a writer adds a
+    message after #Pm_QueueArm().
+
+    @param queue a queue created by #Pm_QueueCreateEx().
+
+    @return the descriptor (an eventfd on Linux, the read end of a pipe
+    on other POSIX systems), or -1 if \p queue is NULL or not waitable
+    or on Windows. Do not read from or close the descriptor.
+ */
+PMEXPORT int Pm_QueueGetFd(PmQueue *queue);
+
+/** get occupancy and overflow statistics for a queue.
+
+    @param queue a queue created by #Pm_QueueCreate() or #Pm_QueueCreateEx().
+
+    @param stats address of the structure to fill in.
+
+    @return #pmNoError, or #pmBadPtr if \p queue or \p stats is NULL.
+
+    The counters are maintained by the writer after each insertion
+    (#Pm_Enqueue(), #Pm_EnqueueBatch(), #Pm_QueueCommit(), or a failed
+    #Pm_QueueReserve()), in storage that the reader does not touch, so
+    keeping them does not slow down the reader. \p dropped counts
+    messages the writer could not insert because the queue was full or
+    an overflow was not yet reported to the reader; overflows flagged
+    with #Pm_SetOverflow() are not counted since the number of lost
+    messages is unknown. \p dequeued is computed as \p enqueued minus
+    \p depth. The high-water mark is updated when the writer inserts,
+    so it is the most that the reader has ever fallen behind.
+
+    This function may be called from any thread. While the queue is in
+    use, the result is a snapshot whose fields may not all be from the
+    same instant. For an input stream, use #Pm_GetInputStats() (or call
+    this on a queue of your own) to choose a bufferSize for
+    #Pm_OpenInput().
+ */
+PMEXPORT PmError Pm_QueueGetStats(PmQueue *queue, PmQueueStats *stats);
+
+/** choose what happens when a writer finds the queue full.
+
+    @param queue a queue created by #Pm_QueueCreate() or #Pm_QueueCreateEx().
+
+    @param policy #PM_OVERFLOW_REPORT, #PM_OVERFLOW_DROP_OLDEST,
+    #PM_OVERFLOW_DROP_NEWEST or #PM_OVERFLOW_BLOCK.
+
+    @param block_ms the longest time #PM_OVERFLOW_BLOCK waits for room,
+    in milliseconds.
+
+    @return #pmNoError, #pmBadPtr if \p queue is NULL or \p policy is
+    unknown, #pmInsufficientMemory if the sequence numbers for
+    #PM_OVERFLOW_DROP_OLDEST cannot be allocated, or #pmNotImplemented
+    if the queue does not support \p policy (#PM_QUEUE_MPSC and
+    #PM_QUEUE_RECORD queues only support #PM_OVERFLOW_REPORT, and a
+    queue in shared memory only supports #PM_OVERFLOW_DROP_OLDEST if
+    it was created with it).
+
+    Call this from the reader's thread (or before writing begins); the
+    writer sees the new policy the next time it enqueues. Dropped
+    messages are counted by #Pm_QueueGetStats(). Once
+    #PM_OVERFLOW_DROP_OLDEST is set, the reader claims each message
+    with a compare-and-swap, so that the writer cannot evict a message
+    while it is read, even if the policy is changed again, and
+    #Pm_QueuePeek() and #Pm_QueueReadPtr() return NULL, since they
+    cannot claim the message they return. If the queue is full of
+    messages written before the writer first evicted one, the new
+    message is dropped instead.
+ */
+PMEXPORT PmError Pm_QueueSetOverflowPolicy(PmQueue *queue, int32_t policy,
+                                           int32_t block_ms);
+
 /** allows the writer (enqueuer) to signal an overflow
     condition to the reader (dequeuer). 
 
@@ -9,6 +9,32 @@
 #include "pminternal.h"
 #include <assert.h>
 
+/* vector instructions for the sysex fast path in pm_read_bytes; both
+ * also require a little-endian byte order */
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define PM_SYSEX_SSE2 1
+#elif defined(__ARM_NEON) && defined(__aarch64__) && \
+      !defined(__ARM_BIG_ENDIAN)
+#include <arm_neon.h>
+#define PM_SYSEX_NEON 1
+#endif
+
+/* input streams can be waited for with poll(), see
+ * Pm_GetPollDescriptors() */
+#if !defined(WIN32) && !defined(_WIN32)
+#define PM_POLL_FDS 1
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+#endif
+
 #define MIDI_CLOCK      0xf8
 #define MIDI_ACTIVE     0xfe
 #define MIDI_STATUS_MASK 0x80
@@ -383,6 +409,13 @@ PmError pm_success_fn(PmInternal *midi)
     return pmNoError;
 }
 
+/* pm_no_descriptors -- for devices whose input is delivered by another
+ * thread or a callback, so the stream's wake_fd is all there is */
+int pm_no_descriptors(PmInternal *midi, int *fds, int max)
+{
+    return 0;
+}
+
 /* none_write -- returns an error if called */
 PmError none_write_short(PmInternal *midi, PmEvent *buffer)
 {
@@ -438,6 +471,8 @@ pm_fns_node pm_none_dictionary = {
     none_close,
     none_poll,
     none_check_host_error,
+    none_poll_descriptors,
+    none_update_filters
 };
 
 
@@ -569,11 +604,103 @@ PMEXPORT PmError Pm_Terminate(void)
 }
 
 
+/* Input settings that the application may change while another thread
+ * reads input are not written to PmInternal directly. The application
+ * fills in the back one of three copies and exchanges it with the
+ * middle one, marking that as new. Before it reads input, the input
+ * thread exchanges a new middle copy with its front one and applies
+ * it (see pm_apply_settings). Neither thread waits for the other, and
+ * the latest settings always reach the input thread.
+ */
+typedef struct {
+    PmInputCallback callback;
+    void *callback_user;
+    PmTimestamp callback_window;
+    PmQueue *sysex_queue;
+    int32_t sysex_record_max;
+    struct pm_coalesce_struct *coalesce; /* NULL to not coalesce */
+    int32_t coalesce_classes;
+    PmTimestamp coalesce_interval;
+} pm_settings_node;
+
+#define PM_SETTINGS_NEW 4 /* in middle: the copy has not been applied */
+
+typedef struct pm_input_settings_struct {
+    pm_settings_node copy[3];
+    pm_atomic_long middle; /* index into copy, or'ed with PM_SETTINGS_NEW */
+    int front; /* index of the copy applied by the input thread */
+    int back; /* index of the copy the application fills in */
+    pm_settings_node requested; /* the latest settings made */
+    /* allocated by the first Pm_SetCoalescing() that enables it, and
+       kept until Pm_Close(); only the input thread uses it after that */
+    struct pm_coalesce_struct *coalesce;
+} pm_input_settings_node, *pm_input_settings_type;
+
+
+/* pm_publish_settings -- hand the settings requested by the application
+ * to the input thread */
+static void pm_publish_settings(PmInternal *midi)
+{
+    pm_input_settings_type s = midi->settings;
+    s->copy[s->back] = s->requested;
+    s->back = (int) (pm_exchange(&s->middle, s->back | PM_SETTINGS_NEW) &
+                     ~PM_SETTINGS_NEW);
+}
+
+
 /* Pm_Read -- read up to length messages from source into buffer */
 /*
  * returns number of messages actually read, or error code
  */
-PMEXPORT int Pm_Read(PortMidiStream *stream, PmEvent *buffer, int32_t length)
+/* the forms in which pm_read returns events */
+#define READ_EVENT 0 /* Pm_Read() */
+#define READ_SOA 1 /* Pm_ReadSoA(), buffer is the messages */
+#define READ_EVENT64 2 /* Pm_Read64() */
+
+/* pm_read_converted -- dequeue up to max events and store them in
+ * buffer, starting at index n, in a form that is not what the queue
+ * holds: any form from a stream opened with Pm_OpenInput64(), and
+ * PmEvent64 from other streams. Returns as Pm_DequeueBatch(). */
+#define READ_CONVERTED_LEN 64
+
+static int pm_read_converted(PmInternal *midi, int form, void *buffer,
+                             PmTimestamp *timestamps, int n, int max)
+{
+    union {
+        pm_event64_slot slots[READ_CONVERTED_LEN];
+        PmEvent events[READ_CONVERTED_LEN];
+    } got_buf;
+    int got;
+    int i;
+    if (max > READ_CONVERTED_LEN) max = READ_CONVERTED_LEN;
+    got = Pm_DequeueBatch(midi->queue, &got_buf, max);
+    for (i = 0; i < got; i++) {
+        PmEvent event;
+        PmTimestamp64 time_ns;
+        if (midi->time_proc64) {
+            event = got_buf.slots[i].event;
+            time_ns = got_buf.slots[i].time_ns;
+        } else {
+            event = got_buf.events[i];
+            time_ns = (PmTimestamp64) event.timestamp * 1000000;
+        }
+        if (form == READ_EVENT) {
+            ((PmEvent *) buffer)[n + i] = event;
+        } else if (form == READ_SOA) {
+            ((PmMessage *) buffer)[n + i] = event.message;
+            timestamps[n + i] = event.timestamp;
+        } else {
+            ((PmEvent64 *) buffer)[n + i].message = event.message;
+            ((PmEvent64 *) buffer)[n + i].time_ns = time_ns;
+        }
+    }
+    return got;
+}
+
+
+/* pm_read -- Pm_Read(), Pm_ReadSoA() or Pm_Read64(), depending on form */
+static int pm_read(PortMidiStream *stream, int form, void *buffer,
+                   PmTimestamp *timestamps, int32_t length)
 {
     PmInternal *midi = (PmInternal *) stream;
     int n = 0;
@@ -600,22 +727,197 @@ PMEXPORT int Pm_Read(PortMidiStream *stream, PmEvent *buffer, int32_t length)
         return pm_errmsg(err);
     }
 
+    /* a batch stops just before an overflow, so keep reading until the
+     * buffer is full or the queue is empty to see any overflow that
+     * falls within length messages */
     while (n < length) {
-        err = Pm_Dequeue(midi->queue, buffer++);
-        if (err == pmBufferOverflow) {
+        int got;
+        if (midi->time_proc64 || form == READ_EVENT64) {
+            got = pm_read_converted(midi, form, buffer, timestamps, n,
+                                    length - n);
+        } else if (form == READ_SOA) {
+            got = Pm_DequeueBatchSoA(midi->queue, (PmMessage *) buffer + n,
+                                     timestamps + n, length - n);
+        } else {
+            got = Pm_DequeueBatch(midi->queue, (PmEvent *) buffer + n,
+                                  length - n);
+        }
+        if (got == pmBufferOverflow) {
             /* ignore the data we have retreived so far */
             return pm_errmsg(pmBufferOverflow);
-        } else if (err == 0) { /* empty queue */
+        } else if (got <= 0) { /* empty queue */
             break;
         }
-        n++;
+        n += got;
     }
     return n;
 }
 
+
+PMEXPORT int Pm_Read(PortMidiStream *stream, PmEvent *buffer, int32_t length)
+{
+    return pm_read(stream, READ_EVENT, buffer, NULL, length);
+}
+
+
+PMEXPORT int Pm_Read64(PortMidiStream *stream, PmEvent64 *buffer,
+                       int32_t length)
+{
+    return pm_read(stream, READ_EVENT64, buffer, NULL, length);
+}
+
+
+PMEXPORT int Pm_ReadSoA(PortMidiStream *stream, PmMessage *messages,
+                        PmTimestamp *timestamps, int32_t length)
+{
+    if (!messages || !timestamps)
+        return pm_errmsg(pmBadPtr);
+    return pm_read(stream, READ_SOA, messages, timestamps, length);
+}
+
+
+PMEXPORT PmError Pm_SetSysExBuffer(PortMidiStream *stream, int32_t num_msgs,
+                                   int32_t max_len)
+{
+    PmInternal *midi = (PmInternal *) stream;
+    PmError err = pmNoError;
+
+    /* arg checking */
+    if (midi == NULL)
+        err = pmBadPtr;
+    else if (!pm_descriptors[midi->device_id].pub.opened)
+        err = pmBadPtr;
+    else if (!pm_descriptors[midi->device_id].pub.input)
+        err = pmBadPtr;
+    else if (midi->settings->requested.sysex_queue || num_msgs <= 0 ||
+             max_len < 2)
+        err = pmBadPtr;
+    else {
+        pm_settings_node *set = &midi->settings->requested;
+        set->sysex_queue = Pm_QueueCreateEx(num_msgs, max_len,
+                                            PM_QUEUE_RECORD |
+                                            midi->queue_flags);
+        if (!set->sysex_queue) {
+            err = pmInsufficientMemory;
+        } else {
+            set->sysex_record_max = max_len;
+            pm_publish_settings(midi);
+        }
+    }
+    return pm_errmsg(err);
+}
+
+
+PMEXPORT PmError Pm_ReadSysEx(PortMidiStream *stream, unsigned char *buffer,
+                              int32_t *len, PmTimestamp *timestamp)
+{
+    PmInternal *midi = (PmInternal *) stream;
+    PmError err = pmNoError;
+    pm_hosterror = FALSE;
+    /* arg checking */
+    if (midi == NULL)
+        err = pmBadPtr;
+    else if (!pm_descriptors[midi->device_id].pub.opened)
+        err = pmBadPtr;
+    else if (!pm_descriptors[midi->device_id].pub.input)
+        err = pmBadPtr;
+    else if (!midi->settings->requested.sysex_queue || !buffer || !len)
+        err = pmBadPtr;
+    /* as in Pm_Read, give the implementation a chance to read the
+       device */
+    else err = (*(midi->dictionary->poll))(midi);
+
+    if (err != pmNoError) {
+        if (err == pmHostError) {
+            midi->dictionary->check_host_error(midi);
+        }
+        return pm_errmsg(err);
+    }
+    /* midi->sysex_queue is set by the input thread */
+    err = Pm_DequeueRecord(midi->settings->requested.sysex_queue, buffer,
+                           len, timestamp);
+    /* pmGotData and pmNoData are not errors */
+    return (err < 0 ? pm_errmsg(err) : err);
+}
+
+#ifdef PM_POLL_FDS
+/* pm_errno_error -- report a failed system call as a host error */
+static PmError pm_errno_error(void)
+{
+    strncpy(pm_hosterror_text, strerror(errno), PM_HOST_ERROR_MSG_LEN - 1);
+    pm_hosterror_text[PM_HOST_ERROR_MSG_LEN - 1] = 0;
+    pm_hosterror = TRUE;
+    return pmHostError;
+}
+
+
+/* pm_wake_open -- create the stream's wake_fd */
+static PmError pm_wake_open(PmInternal *midi)
+{
+    int fds[2];
+#ifdef __linux__
+    fds[0] = fds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fds[0] < 0) {
+        return pm_errno_error();
+    }
+#else
+    int i;
+    if (pipe(fds) < 0) {
+        return pm_errno_error();
+    }
+    for (i = 0; i < 2; i++) {
+        fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+        fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+    }
+#endif
+    midi->wake_fd[0] = fds[0];
+    midi->wake_fd[1] = fds[1]; /* last: pm_input_done() looks at this */
+    return pmNoError;
+}
+
+
+static void pm_wake_close(PmInternal *midi)
+{
+    if (midi->wake_fd[0] >= 0) {
+        close(midi->wake_fd[0]);
+        if (midi->wake_fd[1] != midi->wake_fd[0]) {
+            close(midi->wake_fd[1]);
+        }
+    }
+}
+
+
+/* pm_wake_signal -- make wake_fd readable. If a pipe is full, it is
+ * readable already. */
+static void pm_wake_signal(PmInternal *midi)
+{
+#ifdef __linux__
+    uint64_t one = 1;
+#else
+    char one = 1;
+#endif
+    if (write(midi->wake_fd[1], &one, sizeof(one)) < 0) {
+        return;
+    }
+}
+
+
+/* pm_wake_clear -- make wake_fd unreadable again. The caller must look
+ * at the queue afterward: pm_input_done() signals after enqueueing, so
+ * input that arrives while clearing is found there or signals again.
+ */
+static void pm_wake_clear(PmInternal *midi)
+{
+    char buf[64]; /* an eventfd is read in one 8-byte read */
+    while (read(midi->wake_fd[0], buf, sizeof(buf)) > 0) ;
+}
+#endif
+
+
 PMEXPORT PmError Pm_Poll(PortMidiStream *stream)
 {
     PmInternal *midi = (PmInternal *) stream;
+    PmQueue *sysex_queue; /* midi->sysex_queue is set by the input thread */
     PmError err;
 
     pm_hosterror = FALSE;
@@ -633,7 +935,61 @@ PMEXPORT PmError Pm_Poll(PortMidiStream *stream)
         return pm_errmsg(err);
     }
 
-    return (PmError) !Pm_QueueEmpty(midi->queue);
+    /* whole sysex messages count as input too (Pm_QueueEmpty(NULL) is
+       true) */
+    sysex_queue = midi->settings->requested.sysex_queue;
+#ifdef PM_POLL_FDS
+    if (midi->wake_fd[0] >= 0 && Pm_QueueEmpty(midi->queue) &&
+        Pm_QueueEmpty(sysex_queue)) {
+        pm_wake_clear(midi); /* then look again, see pm_wake_clear() */
+    }
+#endif
+    return (PmError) (!Pm_QueueEmpty(midi->queue) ||
+                      !Pm_QueueEmpty(sysex_queue));
+}
+
+
+PMEXPORT PmError Pm_GetInputStats(PortMidiStream *stream,
+                                  PmQueueStats *stats)
+{
+    PmInternal *midi = (PmInternal *) stream;
+    PmError err;
+
+    /* arg checking */
+    if (midi == NULL)
+        err = pmBadPtr;
+    else if (!pm_descriptors[midi->device_id].pub.opened)
+        err = pmBadPtr;
+    else if (!pm_descriptors[midi->device_id].pub.input)
+        err = pmBadPtr;
+    else
+        err = Pm_QueueGetStats(midi->queue, stats);
+    return pm_errmsg(err);
+}
+
+
+PMEXPORT PmError Pm_SetOverflowPolicy(PortMidiStream *stream, int32_t policy,
+                                      int32_t block_ms)
+{
+    PmInternal *midi = (PmInternal *) stream;
+    PmError err;
+
+    /* arg checking */
+    if (midi == NULL)
+        err = pmBadPtr;
+    else if (!pm_descriptors[midi->device_id].pub.opened)
+        err = pmBadPtr;
+    else if (!pm_descriptors[midi->device_id].pub.input)
+        err = pmBadPtr;
+    /* a device that is read by polling (it has descriptors to wait on)
+       enqueues on the thread that calls Pm_Read(), which would only be
+       waiting for itself */
+    else if (policy == PM_OVERFLOW_BLOCK &&
+             (*midi->dictionary->poll_descriptors)(midi, NULL, 0) > 0)
+        err = pmNotImplemented;
+    else
+        err = Pm_QueueSetOverflowPolicy(midi->queue, policy, block_ms);
+    return pm_errmsg(err);
 }
 
 
@@ -787,6 +1143,35 @@ error_exit:
 }
 
 
+/* Pm_Write64 converts to PmEvents a block of this many at a time;
+ * Pm_Write() does the rest, including sysex messages that span blocks */
+#define WRITE64_LEN 64
+
+PMEXPORT PmError Pm_Write64(PortMidiStream *stream, PmEvent64 *buffer,
+                            int32_t length)
+{
+    PmEvent events[WRITE64_LEN];
+    PmError err = pmNoError;
+    int32_t done = 0;
+
+    if (buffer == NULL && length > 0)
+        return pm_errmsg(pmBadPtr);
+    do {
+        int32_t count = length - done;
+        int32_t i;
+        if (count > WRITE64_LEN) count = WRITE64_LEN;
+        for (i = 0; i < count; i++) {
+            events[i].message = buffer[done + i].message;
+            events[i].timestamp =
+                    (PmTimestamp) (buffer[done + i].time_ns / 1000000);
+        }
+        err = Pm_Write(stream, events, count);
+        done += count;
+    } while (err == pmNoError && done < length);
+    return err;
+}
+
+
 PMEXPORT PmError Pm_WriteShort(PortMidiStream *stream, PmTimestamp when,
                                PmMessage msg)
 {
@@ -876,9 +1261,29 @@ end_of_sysex:
 
 
 
+/* pm_time_ms -- the time_proc of a stream opened with Pm_OpenInput64():
+ * its nanosecond clock in ms */
+static PmTimestamp pm_time_ms(void *time_info)
+{
+    PmInternal *midi = (PmInternal *) time_info;
+    return (PmTimestamp) ((*midi->time_proc64)(midi->time_info64) / 1000000);
+}
+
+
+/* pm_time_ns -- the time_proc of Pm_OpenInput64() when none is given */
+static PmTimestamp64 pm_time_ns(void *time_info)
+{
+    return (PmTimestamp64) Pt_TimeNs();
+}
+
+
+/* pm_create_internal -- time_proc64 is NULL except for
+ * Pm_OpenInput64(), which passes it instead of time_proc. queue_flags
+ * are added to the flags of the input queue (see pmKeyLockedInput). */
 PmError pm_create_internal(PmInternal **stream, PmDeviceID device_id,
                            int is_input, int latency, PmTimeProcPtr time_proc,
-                           void *time_info, int buffer_size)
+                           void *time_info, int buffer_size,
+                           PmTimeProc64Ptr time_proc64, int32_t queue_flags)
 {
     PmInternal *midi;  /* initialized below */
     if (device_id < 0 || device_id >= pm_descriptor_len) {
@@ -900,36 +1305,77 @@ PmError pm_create_internal(PmInternal **stream, PmDeviceID device_id,
     /* if latency != 0, we need a time reference for output.
        we always need a time reference for input.
        If none is provided, use PortTime library */
-    if (time_proc == NULL && (latency != 0 || is_input)) {
+    if (time_proc == NULL && !time_proc64 && (latency != 0 || is_input)) {
         if (!Pt_Started()) 
             Pt_Start(1, 0, 0);
         /* time_get does not take a parameter, so coerce */
         midi->time_proc = (PmTimeProcPtr) Pt_Time;
     }
     midi->time_info = time_info;
+    midi->time_proc64 = time_proc64;
+    midi->time_info64 = time_info;
+    midi->input_ns = 0;
+    if (time_proc64) {
+        midi->time_proc = pm_time_ms;
+        midi->time_info = midi;
+    }
     if (is_input) {
         midi->latency = 0;  /* unused by input */
         if (buffer_size <= 0) buffer_size = 256; /* default buffer size */
-        midi->queue = Pm_QueueCreate(buffer_size, (int32_t) sizeof(PmEvent));
-        if (!midi->queue) {
+        /* the input queue is usually filled and emptied on different
+         * threads, so use a queue that keeps them off each other's
+         * cache lines, and store each PmEvent in a single 8-byte slot: */
+        if (time_proc64) { /* PmEvent and time in ns, see pm_enqueue64 */
+            midi->queue = Pm_QueueCreateEx(buffer_size,
+                                           (int32_t) sizeof(pm_event64_slot),
+                                           PM_QUEUE_SPSC | queue_flags);
+        } else {
+            midi->queue = Pm_QueueCreateEx(buffer_size,
+                                           (int32_t) sizeof(PmEvent),
+                                           PM_QUEUE_EVENT | queue_flags);
+        }
+        midi->settings = (pm_input_settings_type)
+                pm_alloc(sizeof(pm_input_settings_node));
+        if (!midi->queue || !midi->settings) {
             /* free portMidi data */
+            if (midi->queue) Pm_QueueDestroy(midi->queue);
+            if (midi->settings) pm_free(midi->settings);
             *stream = NULL;
             pm_free(midi);
             return pmInsufficientMemory;
         }
+        memset(midi->settings, 0, sizeof(pm_input_settings_node));
+        midi->settings->front = 0;
+        pm_store_release(&midi->settings->middle, 1);
+        midi->settings->back = 2;
     } else {
         /* if latency zero, output immediate (timestamps ignored) */
         /* if latency < 0, use 0 but don't return an error */
         if (latency < 0) latency = 0;
         midi->latency = latency;
         midi->queue = NULL;  /* unused by output; input needs to allocate: */
+        midi->settings = NULL;
     }
+    midi->queue_flags = queue_flags;
     midi->buffer_len = buffer_size; /* portMidi input storage */
     midi->sysex_in_progress = FALSE;
     midi->message = 0; 
     midi->message_count = 0; 
     midi->filters = (is_input ? PM_FILT_ACTIVE : 0);
     midi->channel_mask = 0xFFFF;
+    pm_update_filters(midi);
+    midi->callback = NULL;
+    midi->callback_user = NULL;
+    midi->callback_window = 0;
+    midi->callback_start = 0;
+    midi->callback_len = 0;
+    midi->coalesce = NULL;
+    midi->sysex_queue = NULL;
+    midi->sysex_record = NULL;
+    midi->sysex_record_len = 0;
+    midi->sysex_record_max = 0;
+    midi->sysex_record_time = 0;
+    midi->wake_fd[0] = midi->wake_fd[1] = -1;
     midi->sync_time = 0;
     midi->first_message = TRUE;
     midi->api_info = NULL;
@@ -942,12 +1388,34 @@ PmError pm_create_internal(PmInternal **stream, PmDeviceID device_id,
 }
 
 
-PMEXPORT PmError Pm_OpenInput(PortMidiStream** stream,
-                              PmDeviceID inputDevice,
-                              void *inputDriverInfo,
-                              int32_t bufferSize,
-                              PmTimeProcPtr time_proc,
-                              void *time_info)
+/* pm_get_sysdep -- the value of key in driverInfo (a PmSysDepInfo),
+ * or NULL if it is not there */
+static const void *pm_get_sysdep(enum PmSysDepPropertyKey key,
+                                 void *driverInfo)
+{
+    PmSysDepInfo *info = (PmSysDepInfo *) driverInfo;
+    /* the version where all current properties were introduced is 210 */
+    if (info && info->structVersion >= 210) {
+        int i;
+        for (i = 0; i < info->length; i++) {  /* search for key */
+            if (info->properties[i].key == key) {
+                return info->properties[i].value;
+            }
+        }
+    }
+    return NULL;
+}
+
+
+/* pm_open_input -- Pm_OpenInput(), or Pm_OpenInput64() if time_proc64
+ * is not NULL */
+static PmError pm_open_input(PortMidiStream** stream,
+                             PmDeviceID inputDevice,
+                             void *inputDriverInfo,
+                             int32_t bufferSize,
+                             PmTimeProcPtr time_proc,
+                             PmTimeProc64Ptr time_proc64,
+                             void *time_info)
 {
     PmInternal *midi;
     PmError err = pmNoError;
@@ -964,7 +1432,10 @@ PMEXPORT PmError Pm_OpenInput(PortMidiStream** stream,
 
     /* common initialization of PmInternal structure (midi): */
     err = pm_create_internal(&midi, inputDevice, TRUE, 0, time_proc,
-                             time_info, bufferSize);
+                             time_info, bufferSize, time_proc64,
+                             pm_get_sysdep(pmKeyLockedInput,
+                                           inputDriverInfo) ?
+                                     PM_QUEUE_LOCKED : 0);
     if (err) {
         goto error_return;  /* will return with *stream == NULL */
     }
@@ -977,6 +1448,7 @@ PMEXPORT PmError Pm_OpenInput(PortMidiStream** stream,
         pm_descriptors[inputDevice].pm_internal = NULL;
         /* free portMidi data */
         Pm_QueueDestroy(midi->queue);
+        pm_free(midi->settings);
         pm_free(midi);
     } else {
         /* portMidi input open successful */
@@ -991,6 +1463,35 @@ error_return:
 }
 
 
+PMEXPORT PmError Pm_OpenInput(PortMidiStream** stream,
+                              PmDeviceID inputDevice,
+                              void *inputDriverInfo,
+                              int32_t bufferSize,
+                              PmTimeProcPtr time_proc,
+                              void *time_info)
+{
+    return pm_open_input(stream, inputDevice, inputDriverInfo, bufferSize,
+                         time_proc, NULL, time_info);
+}
+
+
+PMEXPORT PmError Pm_OpenInput64(PortMidiStream** stream,
+                                PmDeviceID inputDevice,
+                                void *inputDriverInfo,
+                                int32_t bufferSize,
+                                PmTimeProc64Ptr time_proc,
+                                void *time_info)
+{
+    if (time_proc == NULL) {
+        if (!Pt_Started())
+            Pt_Start(1, 0, 0);
+        time_proc = pm_time_ns;
+    }
+    return pm_open_input(stream, inputDevice, inputDriverInfo, bufferSize,
+                         NULL, time_proc, time_info);
+}
+
+
 PMEXPORT PmError Pm_OpenOutput(PortMidiStream** stream,
                                PmDeviceID outputDevice,
                                void *outputDriverInfo,
@@ -1016,7 +1517,7 @@ PMEXPORT PmError Pm_OpenOutput(PortMidiStream** stream,
 
     /* common initialization of PmInternal structure (midi): */
     err = pm_create_internal(&midi, outputDevice, FALSE, latency, time_proc,
-                             time_info, bufferSize);
+                             time_info, bufferSize, NULL, 0);
     *stream = midi;
     if (err) {
         goto error_return;
@@ -1133,8 +1634,11 @@ PMEXPORT PmError Pm_SetChannelMask(PortMidiStream *stream, int mask)
 
     if (midi == NULL)
         err = pmBadPtr;
-    else
+    else {
         midi->channel_mask = mask;
+        pm_update_filters(midi);
+        err = (*midi->dictionary->update_filters)(midi);
+    }
 
     return pm_errmsg(err);
 }
@@ -1150,12 +1654,512 @@ PMEXPORT PmError Pm_SetFilter(PortMidiStream *stream, int32_t filters)
         err = pmBadPtr;
     else if (!pm_descriptors[midi->device_id].pub.opened)
         err = pmBadPtr;
-    else
+    else {
         midi->filters = filters;
+        pm_update_filters(midi);
+        err = (*midi->dictionary->update_filters)(midi);
+    }
     return pm_errmsg(err);
 }
 
 
+/* pm_callback_deliver -- pass the held events to the input callback */
+static void pm_callback_deliver(PmInternal *midi)
+{
+    int32_t len = midi->callback_len;
+    midi->callback_len = 0;
+    if (len > 0) {
+        (*midi->callback)(midi, midi->callback_events, len,
+                          midi->callback_user);
+    }
+}
+
+
+/* pm_callback_add -- with an input callback, this replaces enqueueing:
+ * hold the events until pm_input_done() or until the batch is full
+ */
+static void pm_callback_add(PmInternal *midi, const PmEvent *events, int n)
+{
+    while (n > 0) {
+        int32_t count = PM_CALLBACK_BATCH - midi->callback_len;
+        if (count > n) count = n;
+        if (midi->callback_len == 0) {
+            midi->callback_start = events[0].timestamp;
+        }
+        memcpy(midi->callback_events + midi->callback_len, events,
+               count * sizeof(PmEvent));
+        midi->callback_len += count;
+        events += count;
+        n -= count;
+        if (midi->callback_len == PM_CALLBACK_BATCH) {
+            pm_callback_deliver(midi);
+        }
+    }
+}
+
+
+/* pm_event_ns -- the time in ns of input stamped ms, on a stream opened
+ * with Pm_OpenInput64(): input_ns if the device implementation set it
+ * and it is within that millisecond (held input passed on with new
+ * input keeps its own time), else now if that is within the
+ * millisecond (input is usually stamped on arrival), else the
+ * millisecond
+ */
+static PmTimestamp64 pm_event_ns(PmInternal *midi, PmTimestamp ms)
+{
+    PmTimestamp64 now;
+    if (midi->input_ns && (PmTimestamp) (midi->input_ns / 1000000) == ms) {
+        return midi->input_ns;
+    }
+    now = (*midi->time_proc64)(midi->time_info64);
+    if ((PmTimestamp) (now / 1000000) == ms) return now;
+    return (PmTimestamp64) ms * 1000000;
+}
+
+
+/* pm_enqueue64 -- Pm_EnqueueBatch() for a stream opened with
+ * Pm_OpenInput64(): add the time in ns to each event. Returns the
+ * number of events enqueued. */
+#define ENQUEUE64_LEN 16
+
+static int pm_enqueue64(PmInternal *midi, const PmEvent *events, int n)
+{
+    pm_event64_slot slots[ENQUEUE64_LEN];
+    PmTimestamp ms = events[0].timestamp;
+    PmTimestamp64 ns = pm_event_ns(midi, ms);
+    int done = 0;
+    while (done < n) {
+        int count = n - done;
+        int i;
+        int got;
+        if (count > ENQUEUE64_LEN) count = ENQUEUE64_LEN;
+        for (i = 0; i < count; i++) {
+            slots[i].event = events[done + i];
+            if (slots[i].event.timestamp != ms) { /* rare: a new time */
+                ms = slots[i].event.timestamp;
+                ns = pm_event_ns(midi, ms);
+            }
+            slots[i].time_ns = ns;
+        }
+        got = Pm_EnqueueBatch(midi->queue, slots, count);
+        if (got <= 0) break;
+        done += got;
+        if (got < count) break;
+    }
+    return done;
+}
+
+
+/* pm_deliver_short -- enqueue a short message, or hand it to the input
+ * callback, after filtering and coalescing */
+static void pm_deliver_short(PmInternal *midi, PmEvent *event)
+{
+    if (midi->callback) {
+        pm_callback_add(midi, event, 1);
+    } else if (midi->time_proc64) {
+        if (pm_enqueue64(midi, event, 1) < 1) {
+            midi->sysex_in_progress = FALSE;
+            midi->sysex_record = NULL;
+        }
+    } else if (Pm_Enqueue(midi->queue, event) == pmBufferOverflow) {
+        midi->sysex_in_progress = FALSE;
+        midi->sysex_record = NULL;
+    }
+}
+
+
+/* Input coalescing (see Pm_SetCoalescing) holds the latest value of
+ * each key, which is a channel and one of: a controller, a poly
+ * aftertouch key, pitch bend or channel aftertouch. A replaced value
+ * moves behind the other held keys, held values of a channel are
+ * passed on in that order (one that is due waits for earlier ones of
+ * its channel that are not), and all of them before any other message
+ * of that channel, so the messages of a channel stay in order and
+ * their timestamps never decrease. Across channels there is no such
+ * order: a held value keeps the timestamp of its arrival, and may be
+ * passed on after later messages of other channels.
+ */
+#define COALESCE_KEYS_PER_CHANNEL 258
+#define COALESCE_KEYS (16 * COALESCE_KEYS_PER_CHANNEL)
+
+typedef struct pm_coalesce_struct {
+    int32_t classes; /* PM_FILT_ bits of the messages to coalesce */
+    PmTimestamp interval; /* least time between values of a key, in ms */
+    int32_t n_held; /* number of keys in order */
+    uint16_t order[COALESCE_KEYS]; /* held keys, oldest first */
+    unsigned char held[COALESCE_KEYS]; /* true if value[key] is held */
+    PmEvent value[COALESCE_KEYS];
+    PmTimestamp sent[COALESCE_KEYS]; /* when a value was last passed on */
+} pm_coalesce_node, *pm_coalesce_type;
+
+
+/* pm_coalesce_key -- the key of a message to coalesce, or -1 */
+static int pm_coalesce_key(pm_coalesce_type co, PmMessage msg)
+{
+    int status = Pm_MessageStatus(msg);
+    int data1 = Pm_MessageData1(msg) & 0x7F;
+    int base = (status & 0x0F) * COALESCE_KEYS_PER_CHANNEL;
+    if (status < 0x80 || status >= 0xF0 ||
+        !((1 << (16 + (status >> 4))) & co->classes)) {
+        return -1;
+    }
+    switch (status & 0xF0) {
+    case MIDI_CONTROL:
+        /* controllers that only make sense in sequence: data entry,
+           increment and decrement, (N)RPN numbers and channel mode */
+        if (data1 == 6 || data1 == 38 || (data1 >= 96 && data1 <= 101) ||
+            data1 >= 120) {
+            return -1;
+        }
+        return base + data1;
+    case MIDI_POLY_AT:
+        return base + 128 + data1;
+    case MIDI_PITCHBEND:
+        return base + 256;
+    case MIDI_CHANNEL_AT:
+        return base + 257;
+    }
+    return -1;
+}
+
+
+/* pm_coalesce_flush -- pass on the held values of channel, or of all
+ * channels if channel is -1; if due_only, only those of keys whose
+ * last value was passed on at least interval before now, and of a
+ * channel only up to its first value that is not due
+ */
+static void pm_coalesce_flush(PmInternal *midi, int channel, int due_only,
+                              PmTimestamp now)
+{
+    pm_coalesce_type co = midi->coalesce;
+    int32_t n = 0;
+    int32_t i;
+    int kept = 0; /* bit per channel that keeps a held value */
+    for (i = 0; i < co->n_held; i++) {
+        int key = co->order[i];
+        int ch = key / COALESCE_KEYS_PER_CHANNEL;
+        if ((channel < 0 || ch == channel) && !(kept & (1 << ch)) &&
+            (!due_only || now - co->sent[key] >= co->interval)) {
+            co->held[key] = FALSE;
+            co->sent[key] = now;
+            pm_deliver_short(midi, &co->value[key]);
+        } else {
+            kept |= 1 << ch;
+            co->order[n++] = key;
+        }
+    }
+    co->n_held = n;
+}
+
+
+/* pm_coalesce -- called by pm_read_short for an accepted message.
+ * Returns true if the message is held, false if it is to be passed on
+ * now (after the held values it must follow).
+ */
+static int pm_coalesce(PmInternal *midi, PmEvent *event)
+{
+    pm_coalesce_type co = midi->coalesce;
+    int status = Pm_MessageStatus(event->message);
+    int key;
+    if (is_real_time(status)) return FALSE;
+    key = pm_coalesce_key(co, event->message);
+    if (key < 0) {
+        if (co->n_held > 0) {
+            pm_coalesce_flush(midi, status < 0xF0 ? (status & 0x0F) : -1,
+                              FALSE, event->timestamp);
+        }
+        return FALSE;
+    }
+    if (co->held[key]) { /* replace the value that was not passed on */
+        int32_t i = 0;
+        while (co->order[i] != key) i++;
+        /* move the key behind the others: it now holds the latest */
+        memmove(co->order + i, co->order + i + 1,
+                (co->n_held - i - 1) * sizeof(co->order[0]));
+        co->order[co->n_held - 1] = (uint16_t) key;
+        co->value[key] = *event;
+        return TRUE;
+    }
+    if (co->interval > 0 &&
+        event->timestamp - co->sent[key] >= co->interval) {
+        /* not limited now, but goes after older values of its channel */
+        if (co->n_held > 0) {
+            pm_coalesce_flush(midi, status & 0x0F, FALSE, event->timestamp);
+        }
+        co->sent[key] = event->timestamp;
+        return FALSE;
+    }
+    co->held[key] = TRUE;
+    co->value[key] = *event;
+    co->order[co->n_held++] = (uint16_t) key;
+    return TRUE;
+}
+
+
+/* pm_apply_settings -- called by the thread that reads input before it
+ * reads any: apply the settings last made by the application if they
+ * are new, see pm_input_settings_node
+ */
+static void pm_apply_settings(PmInternal *midi)
+{
+    pm_input_settings_type s = midi->settings;
+    pm_settings_node *next;
+    if (!s || !(pm_load_relaxed(&s->middle) & PM_SETTINGS_NEW)) return;
+    s->front = (int) (pm_exchange(&s->middle, s->front) & ~PM_SETTINGS_NEW);
+    next = &s->copy[s->front];
+    if (next->coalesce != midi->coalesce ||
+        (next->coalesce &&
+         (next->coalesce_classes != midi->coalesce->classes ||
+          next->coalesce_interval != midi->coalesce->interval))) {
+        PmTimestamp now = (*midi->time_proc)(midi->time_info);
+        if (midi->coalesce) { /* pass on what is held under the old settings */
+            pm_coalesce_flush(midi, -1, FALSE, now);
+        }
+        midi->coalesce = next->coalesce;
+        if (midi->coalesce) {
+            int key;
+            midi->coalesce->classes = next->coalesce_classes;
+            midi->coalesce->interval = next->coalesce_interval;
+            /* no key has been limited yet */
+            for (key = 0; key < COALESCE_KEYS; key++) {
+                midi->coalesce->sent[key] = now - midi->coalesce->interval;
+            }
+        }
+    }
+    if (midi->callback && (next->callback != midi->callback ||
+                           next->callback_user != midi->callback_user)) {
+        /* held events go to the callback that was set when they came */
+        pm_callback_deliver(midi);
+    }
+    midi->callback_user = next->callback_user;
+    midi->callback_window = next->callback_window;
+    midi->callback = next->callback;
+    /* a sysex message in progress goes on in PmEvents */
+    midi->sysex_record_max = next->sysex_record_max;
+    midi->sysex_queue = next->sysex_queue;
+}
+
+
+/* pm_input_done -- a device implementation calls this after each pass
+ * over the input it has read (and may call it when idle), so that held
+ * controller values that are due are passed on and an input callback
+ * receives what arrived, or, if a coalescing window is set, so that
+ * held events go out once the window has passed. Returns true if
+ * anything is still held, i.e. if it should be called again soon.
+ */
+int pm_input_done(PmInternal *midi)
+{
+    pm_apply_settings(midi);
+    if (midi->coalesce && midi->coalesce->n_held > 0) {
+        pm_coalesce_flush(midi, -1, TRUE,
+                          (*midi->time_proc)(midi->time_info));
+    }
+    if (midi->callback_len > 0 &&
+        (midi->callback_window == 0 ||
+         (*midi->time_proc)(midi->time_info) - midi->callback_start >=
+         midi->callback_window)) {
+        pm_callback_deliver(midi);
+    }
+#ifdef PM_POLL_FDS
+    /* signal whenever input is waiting, not just when it is new: this
+     * costs a system call, but only for streams that have wake_fd, and
+     * cannot miss input that arrives while Pm_Poll() clears wake_fd */
+    if (midi->wake_fd[1] >= 0 && (!Pm_QueueEmpty(midi->queue) ||
+                                  !Pm_QueueEmpty(midi->sysex_queue))) {
+        pm_wake_signal(midi);
+    }
+#endif
+    return midi->callback_len > 0 ||
+           (midi->coalesce && midi->coalesce->n_held > 0);
+}
+
+
+PMEXPORT int Pm_GetPollDescriptors(PortMidiStream *stream, int *fds,
+                                   int max)
+{
+    PmInternal *midi = (PmInternal *) stream;
+    PmError err = pmNoError;
+
+    pm_hosterror = FALSE;
+    /* arg checking */
+    if (midi == NULL)
+        err = pmBadPtr;
+    else if (!pm_descriptors[midi->device_id].pub.opened)
+        err = pmBadPtr;
+    else if (!pm_descriptors[midi->device_id].pub.input)
+        err = pmBadPtr;
+    else if (fds == NULL && max > 0)
+        err = pmBadPtr;
+#ifdef PM_POLL_FDS
+    else if (midi->wake_fd[0] < 0)
+        err = pm_wake_open(midi);
+#else
+    else
+        err = pmNotImplemented;
+#endif
+    if (err != pmNoError) {
+        return pm_errmsg(err);
+    }
+#ifdef PM_POLL_FDS
+    if (max < 0) max = 0;
+    if (max > 0) {
+        fds[0] = midi->wake_fd[0];
+    }
+    return 1 + (*midi->dictionary->poll_descriptors)(
+                       midi, fds + (max > 0), (max > 0 ? max - 1 : 0));
+#else
+    return pmNotImplemented; /* not reached */
+#endif
+}
+
+
+/* more descriptors than any set of streams should need */
+#define PM_WAIT_MAX_FDS 64
+
+PMEXPORT PmError Pm_WaitForInput(PortMidiStream **streams, int n,
+                                 int32_t timeout_us)
+{
+#ifdef PM_POLL_FDS
+    struct pollfd fds[PM_WAIT_MAX_FDS];
+    int stream_fds[PM_WAIT_MAX_FDS];
+    int nfds = 0;
+    struct timespec now;
+    int64_t deadline = 0;
+    int i, j, k;
+
+    if (streams == NULL || n <= 0) {
+        return pm_errmsg(pmBadPtr);
+    }
+    /* gather the descriptors, each once: ALSA streams share theirs */
+    for (i = 0; i < n; i++) {
+        int got = Pm_GetPollDescriptors(streams[i], stream_fds,
+                                        PM_WAIT_MAX_FDS);
+        if (got < 0) {
+            return (PmError) got;
+        } else if (got > PM_WAIT_MAX_FDS) { /* not all were stored */
+            return pm_errmsg(pmBufferTooSmall);
+        }
+        for (j = 0; j < got; j++) {
+            for (k = 0; k < nfds && fds[k].fd != stream_fds[j]; k++) ;
+            if (k < nfds) {
+                continue;
+            } else if (nfds == PM_WAIT_MAX_FDS) {
+                return pm_errmsg(pmBufferTooSmall);
+            }
+            fds[nfds].fd = stream_fds[j];
+            fds[nfds].events = POLLIN;
+            nfds++;
+        }
+    }
+    if (timeout_us >= 0) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        deadline = now.tv_sec * (int64_t) 1000000000 + now.tv_nsec +
+                   timeout_us * (int64_t) 1000;
+    }
+    while (TRUE) {
+        int held = FALSE;
+        int wait_ms = -1;
+        for (i = 0; i < n; i++) {
+            PmInternal *midi = (PmInternal *) streams[i];
+            PmError err = Pm_Poll(streams[i]);
+            if (err != pmNoData) {
+                return err; /* pmGotData or an error */
+            }
+            /* held input belongs to the thread that reads the device,
+               which is this one if the device has descriptors */
+            if ((*midi->dictionary->poll_descriptors)(midi, NULL, 0) > 0 &&
+                (midi->callback_len > 0 ||
+                 (midi->coalesce && midi->coalesce->n_held > 0))) {
+                held = TRUE;
+            }
+        }
+        if (timeout_us >= 0) {
+            int64_t remaining;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            remaining = deadline - now.tv_sec * (int64_t) 1000000000 -
+                        now.tv_nsec;
+            if (remaining <= 0) {
+                return pmNoData;
+            }
+            wait_ms = (int) ((remaining + 999999) / 1000000);
+        }
+        /* held input is passed on when a poll finds it due, so where
+         * polling is what reads the device, poll at least every ms */
+        if (held && (wait_ms < 0 || wait_ms > 1)) {
+            wait_ms = 1;
+        }
+        if (poll(fds, nfds, wait_ms) < 0 && errno != EINTR) {
+            return pm_errmsg(pm_errno_error());
+        }
+    }
+#else
+    return pm_errmsg(pmNotImplemented);
+#endif
+}
+
+
+PMEXPORT PmError Pm_SetInputCallback(PortMidiStream *stream,
+                                     PmInputCallback callback, void *user,
+                                     int32_t batch_us)
+{
+    PmInternal *midi = (PmInternal *) stream;
+    PmError err = pmNoError;
+
+    /* arg checking */
+    if (midi == NULL)
+        err = pmBadPtr;
+    else if (!pm_descriptors[midi->device_id].pub.opened)
+        err = pmBadPtr;
+    else if (!pm_descriptors[midi->device_id].pub.input)
+        err = pmBadPtr;
+    else {
+        pm_settings_node *set = &midi->settings->requested;
+        set->callback = callback;
+        set->callback_user = user;
+        /* microseconds to milliseconds, rounding up, and force a legal
+           value as Pm_OpenOutput does for latency */
+        if (batch_us < 0) batch_us = 0;
+        set->callback_window = (batch_us + 999) / 1000;
+        pm_publish_settings(midi);
+    }
+    return pm_errmsg(err);
+}
+
+
+PMEXPORT PmError Pm_SetCoalescing(PortMidiStream *stream, int32_t classes,
+                                  int32_t interval_ms)
+{
+    PmInternal *midi = (PmInternal *) stream;
+    pm_input_settings_type s;
+    PmError err = pmNoError;
+
+    /* arg checking */
+    if (midi == NULL)
+        err = pmBadPtr;
+    else if (!pm_descriptors[midi->device_id].pub.opened)
+        err = pmBadPtr;
+    else if (!pm_descriptors[midi->device_id].pub.input)
+        err = pmBadPtr;
+    if (err != pmNoError)
+        return pm_errmsg(err);
+
+    classes &= PM_FILT_CONTROL | PM_FILT_PITCHBEND | PM_FILT_AFTERTOUCH;
+    s = midi->settings;
+    if (classes && !s->coalesce) {
+        /* the input thread initializes the rest when it applies this */
+        s->coalesce = (pm_coalesce_type) pm_alloc(sizeof(pm_coalesce_node));
+        if (!s->coalesce)
+            return pm_errmsg(pmInsufficientMemory);
+        memset(s->coalesce, 0, sizeof(pm_coalesce_node));
+    }
+    s->requested.coalesce = (classes ? s->coalesce : NULL);
+    s->requested.coalesce_classes = classes;
+    s->requested.coalesce_interval = (interval_ms < 0 ? 0 : interval_ms);
+    pm_publish_settings(midi);
+    return pmNoError;
+}
+
+
 PMEXPORT PmError Pm_Close(PortMidiStream *stream)
 {
     PmInternal *midi = (PmInternal *) stream;
@@ -1181,6 +2185,14 @@ PMEXPORT PmError Pm_Close(PortMidiStream *stream)
     pm_descriptors[midi->device_id].pm_internal = NULL;
     pm_descriptors[midi->device_id].pub.opened = FALSE;
     if (midi->queue) Pm_QueueDestroy(midi->queue);
+    if (midi->settings && midi->settings->requested.sysex_queue)
+        Pm_QueueDestroy(midi->settings->requested.sysex_queue);
+    if (midi->settings && midi->settings->coalesce)
+        pm_free(midi->settings->coalesce);
+    if (midi->settings) pm_free(midi->settings);
+#ifdef PM_POLL_FDS
+    pm_wake_close(midi);
+#endif
     pm_free(midi); 
 error_return:
     /* system dependent code must set pm_hosterror and
@@ -1283,6 +2295,25 @@ PMEXPORT PmError Pm_Abort(PortMidiStream* stream)
 }
 */
 
+
+/* pm_update_filters -- precompute, for every status byte, whether
+   pm_read_short accepts it under the current filters and channel
+   mask, so that input costs one table lookup per message instead of
+   the tests above. Called whenever filters or channel_mask changes.
+ */
+void pm_update_filters(PmInternal *midi)
+{
+    int status;
+    for (status = 0; status < 256; status++) {
+        midi->accept[status] = (unsigned char)
+                (!pm_status_filtered(status, midi->filters)
+                 && (!is_real_time(status) ||
+                     !pm_realtime_filtered(status, midi->filters))
+                 && !pm_channel_filtered(status, midi->channel_mask));
+    }
+}
+
+
 static void pm_flush_sysex(PmInternal *midi, PmTimestamp timestamp)
 {
     PmEvent event;
@@ -1293,7 +2324,12 @@ static void pm_flush_sysex(PmInternal *midi, PmTimestamp timestamp)
     event.message = midi->message;
     event.timestamp = timestamp;
     /* copied from pm_read_short, avoids filtering */
-    if (Pm_Enqueue(midi->queue, &event) == pmBufferOverflow) {
+    if (midi->callback) {
+        pm_callback_add(midi, &event, 1);
+    } else if (midi->time_proc64) {
+        if (pm_enqueue64(midi, &event, 1) < 1)
+            midi->sysex_in_progress = FALSE;
+    } else if (Pm_Enqueue(midi->queue, &event) == pmBufferOverflow) {
         midi->sysex_in_progress = FALSE;
     }
     midi->message_count = 0;
@@ -1301,6 +2337,185 @@ static void pm_flush_sysex(PmInternal *midi, PmTimestamp timestamp)
 }
 
 
+/* pm_read_bytes collects complete 4-byte sysex words in a local array
+ * and enqueues them with one call to Pm_EnqueueBatch()
+ */
+#define SYSEX_BATCH_LEN 64
+
+typedef struct {
+    PmEvent events[SYSEX_BATCH_LEN];
+    int len;
+    int sysex_start; /* index of first word of the sysex in progress */
+} sysex_batch_node;
+
+static void pm_flush_sysex_batch(PmInternal *midi, sysex_batch_node *batch)
+{
+    if (batch->len > 0 && midi->callback) {
+        pm_callback_add(midi, batch->events, batch->len);
+    } else if (batch->len > 0 &&
+        (midi->time_proc64 ?
+         pm_enqueue64(midi, batch->events, batch->len) :
+         Pm_EnqueueBatch(midi->queue, batch->events, batch->len)) < batch->len &&
+        midi->sysex_in_progress && batch->sysex_start < batch->len) {
+        /* overflow hit the sysex in progress: drop the rest of it,
+           including any bytes accumulated since the word that did not
+           fit (a sysex that began after the overflow point and has no
+           words in the batch yet is left alone, as if its words had
+           not been enqueued yet) */
+        midi->sysex_in_progress = FALSE;
+        midi->message_count = 0;
+        midi->message = 0;
+    }
+    batch->len = 0;
+    batch->sysex_start = 0;
+}
+
+
+/* pm_data_run -- the number of bytes at the start of data, up to len,
+ * that are data bytes (high bit clear), found 16 bytes at a time with
+ * SSE2 or NEON or 8 at a time otherwise */
+static int pm_data_run(const unsigned char *data, int len)
+{
+    int n = 0;
+#if defined(PM_SYSEX_SSE2)
+    for (; n + 16 <= len; n += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (data + n));
+        if (_mm_movemask_epi8(v)) break;
+    }
+#elif defined(PM_SYSEX_NEON)
+    for (; n + 16 <= len; n += 16) {
+        if (vmaxvq_u8(vld1q_u8(data + n)) & MIDI_STATUS_MASK) break;
+    }
+#else
+    for (; n + 8 <= len; n += 8) {
+        uint64_t w;
+        memcpy(&w, data + n, sizeof(w));
+        if (w & 0x8080808080808080ULL) break;
+    }
+#endif
+    /* find the status byte in the block where the loop stopped */
+    while (n < len && !(data[n] & MIDI_STATUS_MASK)) n++;
+    return n;
+}
+
+
+/* pm_pack_sysex -- make n sysex PmEvents from 4 * n data bytes. The
+ * first byte goes in the low-order byte of the message, as in
+ * pm_read_bytes, which is the little-endian order the vector code
+ * relies on.
+ */
+static void pm_pack_sysex(PmEvent *events, const unsigned char *data,
+                          int n, PmTimestamp timestamp)
+{
+    int w = 0;
+#if defined(PM_SYSEX_SSE2)
+    __m128i ts = _mm_set1_epi32(timestamp);
+    for (; w + 4 <= n; w += 4) {
+        __m128i m = _mm_loadu_si128((const __m128i *) (data + 4 * w));
+        _mm_storeu_si128((__m128i *) (events + w), _mm_unpacklo_epi32(m, ts));
+        _mm_storeu_si128((__m128i *) (events + w + 2),
+                         _mm_unpackhi_epi32(m, ts));
+    }
+#elif defined(PM_SYSEX_NEON)
+    uint32x4_t ts = vdupq_n_u32((uint32_t) timestamp);
+    for (; w + 4 <= n; w += 4) {
+        uint32x4x2_t z = vzipq_u32(vreinterpretq_u32_u8(
+                                           vld1q_u8(data + 4 * w)), ts);
+        vst1q_u32((uint32_t *) (events + w), z.val[0]);
+        vst1q_u32((uint32_t *) (events + w + 2), z.val[1]);
+    }
+#endif
+    for (; w < n; w++) {
+        const unsigned char *p = data + 4 * w;
+        events[w].message = p[0] | (p[1] << 8) | (p[2] << 16) | (p[3] << 24);
+        events[w].timestamp = timestamp;
+    }
+}
+
+
+/* pm_read_sysex_run -- the fast path of pm_read_bytes for a sysex in
+ * progress at a word boundary (midi->message_count == 0): pack the
+ * whole words of the run of data bytes at the start of data into the
+ * batch, exactly as the byte-at-a-time code would, and return the
+ * number of bytes used. Stops early if a batch flush overflows, which
+ * ends the sysex. The rest of the run (< 4 bytes) and whatever ends it
+ * are left to the byte-at-a-time code.
+ */
+static int pm_read_sysex_run(PmInternal *midi, sysex_batch_node *batch,
+                             const unsigned char *data, int len,
+                             PmTimestamp timestamp)
+{
+    int words = pm_data_run(data, len) / 4;
+    int used = 0;
+    if (midi->filters & PM_FILT_SYSEX) /* the words would be dropped */
+        return words * 4;
+    while (words > 0 && midi->sysex_in_progress) {
+        int n = SYSEX_BATCH_LEN - batch->len;
+        if (n > words) n = words;
+        pm_pack_sysex(batch->events + batch->len, data + used, n, timestamp);
+        batch->len += n;
+        used += 4 * n;
+        words -= n;
+        if (batch->len == SYSEX_BATCH_LEN) {
+            pm_flush_sysex_batch(midi, batch);
+        }
+    }
+    return used;
+}
+
+
+/* pm_begin_sysex_record -- with a sysex_queue, reserve space for a
+ * whole message at F0. If the message is filtered, or the queue has no
+ * room (which sets its overflow flag), sysex_in_progress stays false
+ * and the message is dropped.
+ */
+static void pm_begin_sysex_record(PmInternal *midi, PmTimestamp timestamp)
+{
+    midi->sysex_in_progress = FALSE;
+    midi->sysex_record = NULL;
+    if (midi->filters & PM_FILT_SYSEX) return;
+    midi->sysex_record = (unsigned char *)
+            Pm_QueueReserveRecord(midi->sysex_queue, midi->sysex_record_max);
+    if (midi->sysex_record) {
+        midi->sysex_record[0] = MIDI_SYSEX;
+        midi->sysex_record_len = 1;
+        midi->sysex_record_time = timestamp;
+        midi->sysex_in_progress = TRUE;
+    }
+}
+
+
+/* pm_read_sysex_record -- the counterpart of pm_read_sysex_run when
+ * whole messages go to sysex_queue: copy the run of data bytes at the
+ * start of data, and EOX if it ends the run, into the message, and
+ * return the number of bytes used. The payload is copied once, however
+ * the device splits it. A message too long for the record is dropped
+ * and reported as an overflow.
+ */
+static int pm_read_sysex_record(PmInternal *midi, const unsigned char *data,
+                                int len)
+{
+    int n = pm_data_run(data, len);
+    int eox = (n < len && data[n] == MIDI_EOX);
+    if (midi->sysex_record_len + n + eox > midi->sysex_record_max) {
+        Pm_SetOverflow(midi->sysex_queue);
+        midi->sysex_in_progress = FALSE;
+        midi->sysex_record = NULL;
+        return n + eox;
+    }
+    memcpy(midi->sysex_record + midi->sysex_record_len, data, n);
+    midi->sysex_record_len += n;
+    if (eox) {
+        midi->sysex_record[midi->sysex_record_len++] = MIDI_EOX;
+        Pm_QueueCommitRecord(midi->sysex_queue, midi->sysex_record_len,
+                             midi->sysex_record_time);
+        midi->sysex_in_progress = FALSE;
+        midi->sysex_record = NULL;
+    }
+    return n + eox;
+}
+
+
 /* pm_read_short and pm_read_bytes
    are the interface between system-dependent MIDI input handlers
    and the system-independent PortMIDI code.
@@ -1321,20 +2536,20 @@ void pm_read_short(PmInternal *midi, PmEvent *event)
     int status;
     /* arg checking */
     assert(midi != NULL);
+    pm_apply_settings(midi);
     /* midi filtering is applied here */
     status = Pm_MessageStatus(event->message);
-    if (!pm_status_filtered(status, midi->filters)
-        && (!is_real_time(status) || 
-            !pm_realtime_filtered(status, midi->filters))
-        && !pm_channel_filtered(status, midi->channel_mask)) {
+    if (midi->accept[status]) {
         /* if sysex is in progress and we get a status byte, it had
            better be a realtime message or the starting SYSEX byte;
            otherwise, we exit the sysex_in_progress state
          */
-        if (midi->sysex_in_progress && (status & MIDI_STATUS_MASK)) {
+        if (midi->sysex_in_progress && (status & MIDI_STATUS_MASK) &&
+            !(midi->sysex_record && is_real_time(status))) {
             /* two choices: real-time or not. If it's real-time, then
              * this should be delivered as a sysex byte because it is
-             * embedded in a sysex message
+             * embedded in a sysex message (unless whole messages go to
+             * sysex_queue, then it is enqueued below)
              */
             if (is_real_time(status)) {
                 midi->message |= (status << (8 * midi->message_count++));
@@ -1344,9 +2559,12 @@ void pm_read_short(PmInternal *midi, PmEvent *event)
             } else { /* otherwise, it's not real-time. This interrupts
                       * a sysex message in progress */
                 midi->sysex_in_progress = FALSE;
+                midi->sysex_record = NULL;
             }
-        } else if (Pm_Enqueue(midi->queue, event) == pmBufferOverflow) {
-            midi->sysex_in_progress = FALSE;
+        } else if (midi->coalesce && pm_coalesce(midi, event)) {
+            ; /* held, see pm_coalesce */
+        } else {
+            pm_deliver_short(midi, event);
         }
     }
 }
@@ -1366,8 +2584,12 @@ unsigned int pm_read_bytes(PmInternal *midi, const unsigned char *data,
 {
     int i = 0; /* index into data, must not be unsigned (!) */
     PmEvent event;
+    sysex_batch_node batch; /* sysex data waiting to be enqueued */
+    batch.len = 0;
+    batch.sysex_start = 0;
     event.timestamp = timestamp;
     assert(midi);
+    pm_apply_settings(midi);
 
     /* Since sysex messages may have embedded real-time messages, we
      * cannot simply send every consecutive group of 4 bytes as sysex
@@ -1416,28 +2638,70 @@ unsigned int pm_read_bytes(PmInternal *midi, const unsigned char *data,
      * cannot have a short message in the middle of a sysex message.
      * To avoid this problem, pm_read_short clears sysex_in_progress
      * when a non-real-time short message arrives.
+     *
+     * Sysex data words are not enqueued one at a time but collected in
+     * batch and enqueued together. To preserve message order, the batch
+     * is flushed before anything is passed to pm_read_short. Overflow
+     * is detected when the batch is flushed, which also clears
+     * sysex_in_progress.
+     *
+     * Most of a long sysex message is runs of data bytes, so at each
+     * word boundary within a sysex, pm_read_sysex_run finds the end of
+     * the run with vector instructions and packs its whole words
+     * directly. Only the bytes around status bytes (F0, EOX, embedded
+     * real-time messages) go through the state machine below.
      */
 
     while (i < len) {
-        unsigned char byte = data[i++];
+        unsigned char byte;
+        if (midi->sysex_record) {
+            i += pm_read_sysex_record(midi, data + i, len - i);
+            if (i == len) break;
+        } else if (midi->sysex_in_progress && midi->message_count == 0 &&
+            len - i >= 4) {
+            i += pm_read_sysex_run(midi, &batch, data + i, len - i,
+                                   timestamp);
+            if (i == len) break;
+        }
+        byte = data[i++];
+        /* messages that pm_read_short would filter out (e.g. active
+           sensing, by default) are dropped here without flushing */
         if (is_real_time(byte)) {
-            event.message = byte;
-            pm_read_short(midi, &event);
+            if (midi->accept[byte]) {
+                pm_flush_sysex_batch(midi, &batch);
+                event.message = byte;
+                pm_read_short(midi, &event);
+            }
         } else if (byte & MIDI_STATUS_MASK && byte != MIDI_EOX) {
             midi->message = byte;
             midi->message_count = 1;
-            if (byte == MIDI_SYSEX) {
+            if (byte == MIDI_SYSEX && midi->coalesce &&
+                midi->coalesce->n_held > 0) {
+                /* held values go before the sysex */
+                pm_flush_sysex_batch(midi, &batch);
+                pm_coalesce_flush(midi, -1, FALSE, timestamp);
+            }
+            if (byte == MIDI_SYSEX && midi->sysex_queue) {
+                midi->message = 0;
+                midi->message_count = 0;
+                pm_begin_sysex_record(midi, timestamp);
+            } else if (byte == MIDI_SYSEX) {
                 midi->sysex_in_progress = TRUE;
+                batch.sysex_start = batch.len;
             } else {
                 /* If Sysex is in progress, we cancel it because we encountered
                    a status byte:
                 */
                 midi->sysex_in_progress = FALSE;
+                midi->sysex_record = NULL;
                 midi->short_message_count = pm_midi_length(midi->message);
                 /* maybe we're done already with a 1-byte message: */
                 if (midi->short_message_count == 1) {
-                    event.message = byte;
-                    pm_read_short(midi, &event);
+                    if (midi->accept[byte]) {
+                        pm_flush_sysex_batch(midi, &batch);
+                        event.message = byte;
+                        pm_read_short(midi, &event);
+                    }
                     midi->message_count = 0;
                 }
             }
@@ -1445,13 +2709,16 @@ unsigned int pm_read_bytes(PmInternal *midi, const unsigned char *data,
             /* accumulate sysex message data or EOX */
             midi->message |= (byte << (8 * midi->message_count++));
             if (midi->message_count == 4 || byte == MIDI_EOX) {
-                event.message = midi->message;
-                /* enqueue if not filtered, and then if there is overflow,
-                   stop sysex_in_progress */
-                if (!(midi->filters & PM_FILT_SYSEX) &&
-                    Pm_Enqueue(midi->queue, &event) == pmBufferOverflow) {
-                    midi->sysex_in_progress = FALSE;
-                } else if (byte == MIDI_EOX) {  /* continue unless EOX */
+                /* enqueue if not filtered; if there is overflow, the
+                   flush will stop sysex_in_progress */
+                if (!(midi->filters & PM_FILT_SYSEX)) {
+                    batch.events[batch.len].message = midi->message;
+                    batch.events[batch.len].timestamp = timestamp;
+                    if (++batch.len == SYSEX_BATCH_LEN) {
+                        pm_flush_sysex_batch(midi, &batch);
+                    }
+                }
+                if (byte == MIDI_EOX) {  /* continue unless EOX */
                     midi->sysex_in_progress = FALSE;
                 }
                 midi->message_count = 0;
@@ -1467,11 +2734,14 @@ unsigned int pm_read_bytes(PmInternal *midi, const unsigned char *data,
                 }
             }
             midi->message |= (byte << (8 * midi->message_count++));
-            if (midi->message_count == midi->short_message_count) {
+            if (midi->message_count == midi->short_message_count &&
+                midi->accept[midi->message & 0xFF]) {
+                pm_flush_sysex_batch(midi, &batch);
                 event.message = midi->message;
                 pm_read_short(midi, &event);
             }
         }
     }
+    pm_flush_sysex_batch(midi, &batch);
     return i;
 }
@@ -252,7 +252,26 @@ enum PmSysDepPropertyKey {
         Can be passed in PmSysDepInfo to Pm_OpenInput or Pm_OpenOutput.
         Pm_CreateVirtualInput or Pm_CreateVirtualOutput. Will override
         any previously set client name and applies to all ports. */
-    pmKeyAlsaClientName = 3
+    pmKeyAlsaClientName = 3,
+    /** Linux ALSA input reader thread, value is any non-NULL pointer.
+        Can be passed in PmSysDepInfo to Pm_OpenInput. Starts a thread
+        that waits in poll() for input from all ALSA input streams and
+        puts it into their queues, so Pm_Poll and Pm_Read only look at
+        the queue and make no system calls. Since ALSA input from all
+        devices is merged, this applies to every ALSA input stream,
+        whether or not it was opened with this key, until all ALSA input
+        streams are closed. A callback set with #Pm_SetInputCallback
+        runs in the reader thread. */
+    pmKeyAlsaInputThread = 4,
+    /** Locked input memory, value is any non-NULL pointer. Can be
+        passed in PmSysDepInfo to Pm_OpenInput or Pm_OpenInput64. The
+        input queue, and the buffer made by #Pm_SetSysExBuffer, are
+        pre-faulted and locked in memory, so that the first input
+        after opening does not take page faults in the thread that
+        receives it. If the process may not lock that much memory, the
+        memory is pre-faulted but not locked. This works on all
+        systems. */
+    pmKeyLockedInput = 5
     /* if system-dependent code introduces more options, register
        the key here to avoid conflicts. */
 };
@@ -357,6 +376,13 @@ typedef int32_t PmTimestamp;
     between different clocks, which need not be synchronized.) */
 typedef PmTimestamp (*PmTimeProcPtr)(void *time_info);
 
+/** Represents a time in nanoseconds, see #PmEvent64. */
+typedef int64_t PmTimestamp64;
+
+/** A function that returns the current time in nanoseconds, see
+    #Pm_OpenInput64. */
+typedef PmTimestamp64 (*PmTimeProc64Ptr)(void *time_info);
+
 /** TRUE if t1 before t2 */
 #define PmBefore(t1,t2) (((t1)-(t2)) < 0)
 /** @} */
@@ -426,6 +452,30 @@ PMEXPORT PmError Pm_OpenInput(PortMidiStream** stream,
                 PmTimeProcPtr time_proc,
                 void *time_info);
 
+/** Open a MIDI device for input with nanosecond timestamps.
+
+    @param time_proc (address of) a procedure that returns time in
+    nanoseconds. It may be NULL, in which case #Pt_TimeNs (PortTime)
+    is used.
+
+    The other parameters and the result are as for #Pm_OpenInput.
+
+    The stream keeps a 64-bit time in nanoseconds with each message,
+    read with #Pm_Read64(). #Pm_Read() and other functions that use
+    #PmTimestamp see the same time in milliseconds (\p time_proc
+    divided by 10^6, which wraps like any #PmTimestamp). Where the
+    system does not report when input arrived more precisely than
+    PortMidi, the time is taken when the message is buffered. Input
+    callbacks (see #Pm_SetInputCallback) and system exclusive messages
+    read whole (see #Pm_ReadSysEx) have millisecond timestamps.
+*/
+PMEXPORT PmError Pm_OpenInput64(PortMidiStream** stream,
+                PmDeviceID inputDevice,
+                void *inputSysDepInfo,
+                int32_t bufferSize,
+                PmTimeProc64Ptr time_proc,
+                void *time_info);
+
 /** Open a MIDI device for output.
 
     @param stream the address of a #PortMidiStream pointer which will
@@ -681,6 +731,9 @@ PMEXPORT PmError Pm_DeleteVirtualDevice(PmDeviceID device);
     start/stop/continue), while allowing note-related messages to pass.
     Or you may be using a sequencer or drum-machine for MIDI clock
     information but want to exclude any notes it may play.
+
+    On Linux (ALSA), message types that no open input stream accepts
+    are dropped by the kernel, so they cost nothing to filter.
  */
 PMEXPORT PmError Pm_SetFilter(PortMidiStream* stream, int32_t filters);
 
@@ -710,6 +763,47 @@ PMEXPORT PmError Pm_SetFilter(PortMidiStream* stream, int32_t filters);
 */
 PMEXPORT PmError Pm_SetChannelMask(PortMidiStream *stream, int mask);
 
+/** Coalesce or rate-limit continuous controller input.
+
+    @param stream an open MIDI input stream.
+
+    @param classes the messages to coalesce, any of #PM_FILT_CONTROL,
+    #PM_FILT_PITCHBEND, #PM_FILT_CHANNEL_AFTERTOUCH and
+    #PM_FILT_POLY_AFTERTOUCH (other bits are ignored), or 0 to stop.
+
+    @param interval_ms 0 to pass on only the latest value of each
+    controller (or key, etc.) and channel read from the device in one
+    pass, otherwise the least time between values of a controller and
+    channel: a value that comes sooner is held, and replaced by any
+    that follows, until the interval has passed.
+
+    @return #pmNoError or an error code.
+
+    This is for controllers that send values faster than they are
+    needed, e.g. pitch bend from expressive controllers, which would
+    otherwise fill the input buffer. Only the latest value survives,
+    and messages of a channel are read in the order they arrived, a
+    replaced value taking the place of its replacement. System
+    exclusive and system common messages are read after all values
+    that came before them; real-time messages are never held back. With
+    \p interval_ms, a value that is due may wait for an earlier value
+    of its channel that is not. Data entry,
+    increment and decrement, (N)RPN and channel mode controllers are
+    never coalesced. Held values go out about a millisecond after they
+    are due (on Windows, within the resolution of system timers),
+    except on Linux (ALSA) without #pmKeyAlsaInputThread, where they go
+    out when #Pm_Poll() or #Pm_Read() reads the device. A held value
+    keeps the time it arrived, so timestamps of one channel never
+    decrease, but order is not kept across channels: timestamps of
+    input from different channels may go backwards.
+
+    This may be called while input arrives. The change is made when the
+    stream next reads the device, and values held until then are passed
+    on first.
+*/
+PMEXPORT PmError Pm_SetCoalescing(PortMidiStream *stream, int32_t classes,
+                                  int32_t interval_ms);
+
 /** Terminate outgoing messages immediately.
 
     @param stream an open MIDI output stream.
@@ -862,6 +956,15 @@ typedef struct {
     PmTimestamp    timestamp;  /**< PortMidi time of message */
 } PmEvent;
 
+/**
+   A #PmEvent with a 64-bit time in nanoseconds, see #Pm_Read64 and
+   #Pm_Write64.
+ */
+typedef struct {
+    PmMessage      message;    /**< as in #PmEvent */
+    PmTimestamp64  time_ns;    /**< PortMidi time of message in ns */
+} PmEvent64;
+
 /** @} */
 
 /** \defgroup grp_io Reading and Writing Midi Messages
@@ -898,14 +1001,228 @@ typedef struct {
     soon as a new message arrives. The remainder of a partial sysex
     message is not considered to be a "new message" and will be
     flushed as well.
+
+    #Pm_SetOverflowPolicy() selects other behavior,
+    e.g. dropping the oldest or the newest messages without reporting
+    #pmBufferOverflow, so that a short burst does not cost the
+    messages that #Pm_Read() has already retrieved.
 */
 PMEXPORT int Pm_Read(PortMidiStream *stream, PmEvent *buffer, int32_t length);
 
+/** Retrieve midi data with nanosecond timestamps.
+
+    This is #Pm_Read() for #PmEvent64. On a stream opened with
+    #Pm_OpenInput64(), \p time_ns is the time kept with each message;
+    on other streams it is the millisecond timestamp times 10^6.
+*/
+PMEXPORT int Pm_Read64(PortMidiStream *stream, PmEvent64 *buffer,
+                       int32_t length);
+
+/** Retrieve midi data into separate message and timestamp arrays.
+
+    @param stream the open input stream.
+
+    @param messages the messages are stored here.
+
+    @param timestamps the timestamps are stored here, with
+    \p timestamps[i] the time of \p messages[i].
+
+    @param length the length of each array (number of entries).
+
+    @return the number of events read, or, if the result is negative,
+    a #PmError value (#pmBadPtr if an array is NULL).
+
+    This is #Pm_Read(), including the handling of buffer overflow, but
+    events are split into the two arrays as they are taken from the
+    input queue, for code that processes messages with vector
+    instructions and would otherwise have to separate them first.
+*/
+PMEXPORT int Pm_ReadSoA(PortMidiStream *stream, PmMessage *messages,
+                        PmTimestamp *timestamps, int32_t length);
+
+/** overflow policy (see #Pm_SetOverflowPolicy() and, in pmutil.h,
+    #Pm_QueueSetOverflowPolicy()), also accepted as a
+    #Pm_QueueCreateEx() flag: when the queue is full, the message
+    is dropped and the writer stops until the reader has received
+    everything before it and then #pmBufferOverflow. This is the
+    default. */
+#define PM_OVERFLOW_REPORT 0
+/** overflow policy: when the queue is full, drop the oldest messages
+    to make room, as in a ring buffer, so the reader always gets the
+    most recent data. Only #PM_QUEUE_EVENT queues support this, and
+    each slot then also needs a sequence number (a long). */
+#define PM_OVERFLOW_DROP_OLDEST 0x100
+/** overflow policy: when the queue is full, drop the new message but
+    keep everything already in the queue, and go on accepting messages
+    as soon as there is room. The reader never sees #pmBufferOverflow. */
+#define PM_OVERFLOW_DROP_NEWEST 0x200
+/** overflow policy: when the queue is full, the writer waits (sleeping
+    1 ms at a time) for room, up to a limit, then drops the message as
+    with #PM_OVERFLOW_REPORT. The writer does not wait while an
+    overflow is waiting to be reported. For writers that are not
+    real-time threads, and only when the reader runs on another
+    thread. */
+#define PM_OVERFLOW_BLOCK 0x400
+/** all overflow policy bits of #Pm_QueueCreateEx() flags */
+#define PM_OVERFLOW_MASK 0x700
+
+/** Choose what happens when input arrives faster than it is read.
+
+    @param stream an open input stream.
+
+    @param policy an overflow policy, as in #Pm_QueueSetOverflowPolicy().
+    #PM_OVERFLOW_DROP_OLDEST and #PM_OVERFLOW_DROP_NEWEST keep a burst
+    of input from costing more than the messages that do not fit:
+    #Pm_Read() never returns #pmBufferOverflow (so it never discards
+    what it has read), and a sysex message that loses data is cut off
+    as after any overflow. #PM_OVERFLOW_BLOCK makes the thread that
+    receives MIDI data wait, so use it only with virtual devices fed by
+    threads that are not real-time. It needs a thread other than the
+    reader's to receive the data, so it is refused where input is read
+    from the system by #Pm_Poll() and #Pm_Read() (on Linux, ALSA input
+    without the reader thread, see #pmKeyAlsaInputThread). Once the
+    queue has overflowed, the receiving thread no longer waits, since
+    everything is dropped until the reader gets the overflow.
+
+    @param block_ms the longest time #PM_OVERFLOW_BLOCK waits for room.
+
+    @return #pmNoError, #pmBadPtr if \p stream is not an open input
+    stream or \p policy is unknown, or #pmNotImplemented if
+    \p policy is #PM_OVERFLOW_BLOCK and the stream's input is read
+    by #Pm_Poll().
+
+    Call this from the thread that calls #Pm_Read().
+ */
+PMEXPORT PmError Pm_SetOverflowPolicy(PortMidiStream *stream, int32_t policy,
+                                      int32_t block_ms);
+
+/** Queue statistics, see #Pm_GetInputStats() and #Pm_QueueGetStats()
+    in pmutil.h. */
+typedef struct {
+    long depth; /**< number of messages in the queue now */
+    long capacity; /**< number of messages the queue can hold */
+    long high_water; /**< largest depth seen by the writer */
+    uint64_t enqueued; /**< total messages inserted */
+    uint64_t dequeued; /**< total messages removed */
+    uint64_t dropped; /**< total messages rejected due to overflow */
+} PmQueueStats;
+
+/** Get statistics (see #Pm_QueueGetStats()) for the queue that holds
+    messages received by an input stream until they are read.
+
+    @param stream an open input stream.
+
+    @param stats address of the structure to fill in.
+
+    @return #pmNoError, or #pmBadPtr if \p stream is not an open input
+    stream or \p stats is NULL.
+
+    \p capacity is at least the bufferSize passed to #Pm_OpenInput(),
+    and \p high_water shows how close the stream has come to
+    #pmBufferOverflow.
+ */
+PMEXPORT PmError Pm_GetInputStats(PortMidiStream *stream,
+                                  PmQueueStats *stats);
+
+/** Receive system exclusive messages whole, see #Pm_ReadSysEx.
+
+    @param stream an open MIDI input stream.
+
+    @param num_msgs the buffer holds at least this many messages of
+    \p max_len bytes, and more shorter ones.
+
+    @param max_len the size in bytes of the longest message that will
+    be received, including F0 and F7. Longer messages are dropped.
+
+    @return #pmNoError, #pmInsufficientMemory, or #pmBadPtr (also if
+    this was called before on the stream).
+
+    From then on, the stream assembles each system exclusive message in
+    a buffer of its own instead of passing it to #Pm_Read() in
+    #PmEvent "words". Real-time messages that arrive inside a system
+    exclusive message are read with #Pm_Read() like any other, and the
+    system exclusive filter (see #Pm_SetFilter()) still applies. This
+    may be called while input arrives: it takes effect when the stream
+    next reads the device, and a message already being received is
+    still passed to #Pm_Read().
+*/
+PMEXPORT PmError Pm_SetSysExBuffer(PortMidiStream *stream, int32_t num_msgs,
+                                   int32_t max_len);
+
+/** Read a whole system exclusive message.
+
+    @param stream an open MIDI input stream on which
+    #Pm_SetSysExBuffer() was called.
+
+    @param buffer receives the message, from F0 through F7.
+
+    @param len on entry, the size of \p buffer in bytes; on return, the
+    size of the message.
+
+    @param timestamp receives the time of the F0 byte, if not NULL.
+
+    @return #pmGotData, #pmNoData, #pmBufferOverflow (some messages did
+    not fit in the buffer or were too long, and were dropped),
+    #pmBufferTooSmall (the message stays and \p *len is set to its
+    size), #pmBadPtr or #pmHostError.
+
+    #Pm_Poll() returns TRUE while either #Pm_Read() or this has data.
+*/
+PMEXPORT PmError Pm_ReadSysEx(PortMidiStream *stream, unsigned char *buffer,
+                              int32_t *len, PmTimestamp *timestamp);
+
+/** A function that receives input, see #Pm_SetInputCallback. */
+typedef void (*PmInputCallback)(PortMidiStream *stream,
+                                const PmEvent *events, int32_t count,
+                                void *user);
+
+/** Deliver input to a function instead of the input buffer.
+
+    @param stream an open MIDI input stream.
+
+    @param callback receives the events, in order, as \p count events
+    at \p events (only valid during the call), with \p user, from the
+    context that reads the device: #Pm_Poll() and #Pm_Read() on Linux
+    (ALSA), otherwise a thread of PortMidi or of the system. It must
+    not block. It may write to output streams (e.g. for MIDI thru) and
+    call #Pm_SetFilter(), #Pm_SetChannelMask(), #Pm_SetCoalescing()
+    and #Pm_SetInputCallback(), but must not open or close streams or
+    read input (#Pm_Poll(), #Pm_Read(), etc.). NULL restores delivery
+    to the buffer read by #Pm_Read().
+
+    @param user passed to \p callback.
+
+    @param batch_us a coalescing window in microseconds. Events read
+    from the device together are always delivered together; with a
+    window, they are held until it has passed since the first of them
+    arrived, so that a burst of input causes fewer calls. Held events
+    are delivered when due as held values are for #Pm_SetCoalescing(),
+    so the window may be exceeded. The window is measured with the
+    stream's time_proc, i.e. in whole milliseconds. 0 delivers at
+    once.
+
+    @return #pmNoError or an error code.
+
+    This avoids the input buffer and the delay until the application
+    next polls it, e.g. for MIDI thru. Filters still apply, and
+    #Pm_Read() still reports #pmBufferOverflow if the device overflows.
+    The callback may be changed at any time. The change is made by the
+    context that reads the device the next time it does, so the old
+    callback may still be called until then, and it receives any
+    events it holds at that point. When the callback runs in another
+    thread, do not free \p user of the old callback until it can no
+    longer be called, e.g. until the stream is closed.
+*/
+PMEXPORT PmError Pm_SetInputCallback(PortMidiStream *stream,
+                                     PmInputCallback callback, void *user,
+                                     int32_t batch_us);
+
 /** Test whether input is available.
 
     @param stream an open input stream.
 
-    @return TRUE, FALSE, or an error value. 
+    @return TRUE, FALSE, or an error value. TRUE means that #Pm_Read()
+    or, after #Pm_SetSysExBuffer(), #Pm_ReadSysEx() has data.
 
     If there was an asynchronous error, pmHostError is returned and you must
     call again to determine if input is (also) available.
@@ -919,6 +1236,59 @@ PMEXPORT int Pm_Read(PortMidiStream *stream, PmEvent *buffer, int32_t length);
 */
 PMEXPORT PmError Pm_Poll(PortMidiStream *stream);
 
+/** Get file descriptors to wait for input with poll(), select() or
+    epoll, so that an application with its own event loop need not call
+    #Pm_Poll() on a timer.
+
+    @param stream an open input stream.
+
+    @param fds an array of at least \p max file descriptors.
+
+    @param max the length of \p fds, which may be 0 to get the count.
+
+    @return the number of descriptors, or an error value. If this is
+    more than \p max, only the first \p max descriptors were stored.
+
+    Wait for any of the descriptors to become readable, then call
+    #Pm_Poll() or #Pm_Read() (and #Pm_ReadSysEx() after
+    #Pm_SetSysExBuffer()) until there is no more input. A descriptor
+    may be readable when there is no input (for example, ALSA input for
+    other streams), so always check. The first descriptor belongs to
+    the stream and is reset by #Pm_Poll() when it returns FALSE, so do
+    not read from it. Any others belong to the device implementation,
+    e.g. the ALSA sequencer, and may be shared with other streams. The
+    descriptors stay valid until the stream is closed.
+
+    With #Pm_SetCoalescing() on Linux (ALSA), held values are passed on
+    only when polled, so poll at least once per coalescing interval.
+    Returns pmNotImplemented on Windows.
+*/
+PMEXPORT int Pm_GetPollDescriptors(PortMidiStream *stream, int *fds,
+                                   int max);
+
+/** Wait until any of several input streams has input.
+
+    @param streams an array of \p n open input streams.
+
+    @param n the number of streams.
+
+    @param timeout_us how long to wait, in microseconds, or -1 to wait
+    until there is input.
+
+    @return TRUE if there is input (then call #Pm_Poll() to find which
+    stream has it), FALSE if there was no input within \p timeout_us,
+    or an error value.
+
+    This uses #Pm_GetPollDescriptors(), so it does not spin while it
+    waits. Input delivered to a callback (see #Pm_SetInputCallback())
+    does not enter the buffer, so a stream with a callback never makes
+    this return TRUE, though the callback is still called while this
+    waits. Returns #pmBufferTooSmall if the streams have more
+    descriptors than it can wait for, and pmNotImplemented on Windows.
+*/
+PMEXPORT PmError Pm_WaitForInput(PortMidiStream **streams, int n,
+                                 int32_t timeout_us);
+
 /** Write MIDI data from a buffer. 
 
     @param stream an open output stream.
@@ -958,6 +1328,15 @@ PMEXPORT PmError Pm_Poll(PortMidiStream *stream);
 PMEXPORT PmError Pm_Write(PortMidiStream *stream, PmEvent *buffer,
                           int32_t length);
 
+/** Write MIDI data with nanosecond timestamps.
+
+    This is #Pm_Write() for #PmEvent64, with \p time_ns in the time
+    base of the stream's time_proc, i.e. its milliseconds times 10^6.
+    Output is scheduled to the millisecond, as with #Pm_Write().
+*/
+PMEXPORT PmError Pm_Write64(PortMidiStream *stream, PmEvent64 *buffer,
+                            int32_t length);
+
 /** Write a timestamped non-system-exclusive midi message.
 
     @param stream an open output stream.
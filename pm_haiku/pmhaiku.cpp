@@ -1,7 +1,9 @@
 /* pmhaiku.cpp -- PortMidi os-dependent code */
 
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 #include <vector>
 #include <MidiConsumer.h>
 #include <MidiEndpoint.h>
@@ -16,8 +18,39 @@ namespace {
     struct PmInputConsumer : BMidiLocalConsumer {
         PmInputConsumer(PmInternal *midi) :
             BMidiLocalConsumer("PortMidi input consumer"),
-            midi(midi)
+            midi(midi),
+            held(false),
+            closing(false)
         {
+            pthread_mutex_init(&lock, NULL);
+            pthread_cond_init(&heldCond, NULL);
+        }
+
+
+        ~PmInputConsumer()
+        {
+            pthread_cond_destroy(&heldCond);
+            pthread_mutex_destroy(&lock);
+        }
+
+
+        // Data() is only called when input arrives, so while input is
+        // held back (see pm_input_done), a thread passes it on when it
+        // is due
+        int StartFlushing()
+        {
+            return pthread_create(&flushThread, NULL, FlushThread, this);
+        }
+
+
+        // call once Data() is no longer called
+        void StopFlushing()
+        {
+            pthread_mutex_lock(&lock);
+            closing = true;
+            pthread_cond_signal(&heldCond);
+            pthread_mutex_unlock(&lock);
+            pthread_join(flushThread, NULL);
         }
 
 
@@ -26,6 +59,7 @@ namespace {
             if (!atomic)
                 return; // should these be also supported?
 
+            pthread_mutex_lock(&lock);
             if (data[0] == B_SYS_EX_START) {
                 pm_read_bytes(midi, data, length, time / 1000);
             } else {
@@ -47,10 +81,45 @@ namespace {
                 event.timestamp = time / 1000;
                 pm_read_short(midi, &event);
             }
+            held = pm_input_done(midi);
+            if (held)
+                pthread_cond_signal(&heldCond);
+            pthread_mutex_unlock(&lock);
         }
 
     private:
+        // while input is held, call pm_input_done every ms
+        static void *FlushThread(void *param)
+        {
+            PmInputConsumer *consumer = (PmInputConsumer *)param;
+            pthread_mutex_lock(&consumer->lock);
+            while (!consumer->closing) {
+                if (consumer->held) {
+                    struct timespec due;
+                    clock_gettime(CLOCK_REALTIME, &due);
+                    due.tv_nsec += 1000000;
+                    if (due.tv_nsec >= 1000000000) {
+                        due.tv_sec++;
+                        due.tv_nsec -= 1000000000;
+                    }
+                    pthread_cond_timedwait(&consumer->heldCond,
+                        &consumer->lock, &due);
+                    if (!consumer->closing)
+                        consumer->held = pm_input_done(consumer->midi);
+                } else {
+                    pthread_cond_wait(&consumer->heldCond, &consumer->lock);
+                }
+            }
+            pthread_mutex_unlock(&consumer->lock);
+            return NULL;
+        }
+
         PmInternal *midi;
+        pthread_mutex_t lock; // held by Data() and FlushThread()
+        pthread_cond_t heldCond; // signaled when held becomes true
+        pthread_t flushThread;
+        bool held; // what pm_input_done last returned
+        bool closing; // tells FlushThread to return
     };
 
     struct PmOutputInfo {
@@ -77,8 +146,17 @@ namespace {
         if (!producer)
             return pmInvalidDeviceId;
         PmInputConsumer *consumer = new PmInputConsumer(midi);
+        int err = consumer->StartFlushing();
+        if (err != 0) {
+            consumer->Release();
+            producer->Release();
+            strcpy(pm_hosterror_text, strerror(err));
+            pm_hosterror = TRUE;
+            return pmHostError;
+        }
         status_t status = producer->Connect(consumer);
         if (status != B_OK) {
+            consumer->StopFlushing();
             consumer->Release();
             producer->Release();
             strcpy(pm_hosterror_text, strerror(status));
@@ -105,6 +183,7 @@ namespace {
             return pmInvalidDeviceId;
         PmInputConsumer *consumer = (PmInputConsumer*)midi->api_info;
         status_t status = producer->Disconnect(consumer);
+        consumer->StopFlushing();
         if (status != B_OK) {
             consumer->Release();
             producer->Release();
@@ -340,7 +419,9 @@ namespace {
         in_abort,
         in_close,
         success_poll,
-        check_host_error
+        check_host_error,
+        none_poll_descriptors,
+        none_update_filters
     };
 
     pm_fns_node pm_out_dictionary = {
@@ -355,7 +436,9 @@ namespace {
         out_abort,
         out_close,
         none_poll,
-        check_host_error
+        check_host_error,
+        none_poll_descriptors,
+        none_update_filters
     };
 
 
@@ -371,7 +454,9 @@ namespace {
         synth_abort,
         synth_close,
         none_poll,
-        check_host_error
+        check_host_error,
+        none_poll_descriptors,
+        none_update_filters
     };
 
 
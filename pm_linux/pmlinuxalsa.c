@@ -21,6 +21,9 @@
 #include "porttime.h"
 
 #include <alsa/asoundlib.h>
+#include <pthread.h>
+#include <poll.h>
+#include <unistd.h>
 
 /* I used many print statements to debug this code. I left them in the
  * source, and you can turn them on by changing false to true below:
@@ -48,6 +51,24 @@ extern pm_fns_node pm_linuxalsa_out_dictionary;
 static snd_seq_t *seq = NULL; /* all input comes here, 
                                  output queue allocated on seq */
 static int queue, queue_used; /* one for all ports, reference counted */
+static int poll_serial; /* counts calls to alsa_poll */
+static int inputs_open; /* number of open ALSA input streams */
+
+/* Optional reader thread (see pmKeyAlsaInputThread): it blocks in
+ * poll() on seq and delivers input to the streams' queues, so alsa_poll
+ * has nothing to do. The thread finds streams through pm_descriptors,
+ * so opening and closing an input holds reader_lock while setting
+ * up or clearing pm_internal and api_info.
+ */
+static pthread_t reader;
+static int reader_running;
+static int reader_wake[2]; /* pipe, written to stop the reader */
+static struct pollfd *reader_fds; /* reader_wake[0], then seq's fds */
+static int reader_nfds;
+static pthread_mutex_t reader_lock = PTHREAD_MUTEX_INITIALIZER;
+/* true in the reader thread, which holds reader_lock while it runs
+ * input callbacks, so calls they make must not lock it again */
+static __thread int on_reader_thread;
 
 #define PORT_IS_CLOSED -999999
 
@@ -58,6 +79,14 @@ typedef struct alsa_info_struct {
     int this_port;
     int in_sysex;
     snd_midi_event_t *parser;
+    /* input: offset from ALSA queue real time to the stream's time in
+     * ns, see alsa_sample_offset() */
+    int have_offset;
+    int offset_serial; /* poll_serial when the offset was last sampled */
+    PmTimestamp64 offset_ns; /* the estimate */
+    PmTimestamp64 window_max_ns; /* largest sample in this window */
+    PmTimestamp64 last_max_ns; /* largest sample in the previous window */
+    PmTimestamp64 window_end_ns; /* queue time when this window ends */
 } alsa_info_node, *alsa_info_type;
 
 
@@ -149,6 +178,8 @@ static alsa_info_type alsa_info_create(int client_port, long id, int is_virtual)
     info->client = GET_DESCRIPTOR_CLIENT(client_port);
     info->port = GET_DESCRIPTOR_PORT(client_port);
     info->in_sysex = 0;
+    info->have_offset = FALSE;
+    info->offset_serial = poll_serial - 1;
     return info;
 }    
 
@@ -249,60 +280,137 @@ static PmError alsa_out_open(PmInternal *midi, void *driverInfo)
 }
     
 
+/* alsa_send_event -- address ev, schedule it for timestamp and put it
+ * in the output buffer */
+static PmError alsa_send_event(PmInternal *midi, snd_seq_event_t *ev,
+                               PmTimestamp timestamp)
+{
+    alsa_info_type info = (alsa_info_type) midi->api_info;
+    int err = 0;
+
+    if (info->is_virtual) {
+        snd_seq_ev_set_subs(ev);
+    } else {
+        snd_seq_ev_set_dest(ev, info->client, info->port);
+    }
+    snd_seq_ev_set_source(ev, info->this_port);
+    if (midi->latency > 0) {
+        /* compute relative time of event = timestamp - now + latency */
+        PmTimestamp now = (midi->time_proc ? 
+                           midi->time_proc(midi->time_info) : 
+                           Pt_Time());
+        int when = timestamp;
+        /* if timestamp is zero, send immediately */
+        /* otherwise compute time delay and use delay if positive */
+        if (when == 0) when = now;
+        when = (when - now) + midi->latency;
+        if (when < 0) when = 0;
+        VERBOSE printf("timestamp %d now %d latency %d, ", 
+                       (int) timestamp, (int) now, midi->latency);
+        VERBOSE printf("scheduling event after %d\n", when);
+        /* message is sent in relative ticks, where 1 tick = 1 ms */
+        snd_seq_ev_schedule_tick(ev, queue, 1, when);
+        /* NOTE: for cases where the user does not supply a time function,
+           we could optimize the code by not starting Pt_Time and using
+           the alsa tick time instead. I didn't do this because it would
+           entail changing the queue management to start the queue tick
+           count when PortMidi is initialized and keep it running until
+           PortMidi is terminated. (This should be simple, but it's not
+           how the code works now.) -RBD */
+    } else { /* send event out without queueing */
+        VERBOSE printf("direct\n");
+        /* ev.queue = SND_SEQ_QUEUE_DIRECT;
+           ev.dest.client = SND_SEQ_ADDRESS_SUBSCRIBERS; */
+        snd_seq_ev_set_direct(ev);
+    }
+    VERBOSE printf("sending event, timestamp %d (%d+%dns) (%s, %s)\n",
+                   ev->time.tick, ev->time.time.tv_sec, ev->time.time.tv_nsec,
+                   (ev->flags & SND_SEQ_TIME_STAMP_MASK ? "real" : "tick"),
+                   (ev->flags & SND_SEQ_TIME_MODE_MASK ? "rel" : "abs"));
+    err = snd_seq_event_output(seq, ev);
+    return check_hosterror(err);
+}
+
+
 static PmError alsa_write_byte(PmInternal *midi, unsigned char byte, 
                                PmTimestamp timestamp)
 {
     alsa_info_type info = (alsa_info_type) midi->api_info;
     snd_seq_event_t ev;
-    int err = 0;
 
     snd_seq_ev_clear(&ev);
     if (snd_midi_event_encode_byte(info->parser, byte, &ev) == 1) {
-        if (info->is_virtual) {
-            snd_seq_ev_set_subs(&ev);
-        } else {
-            snd_seq_ev_set_dest(&ev, info->client, info->port);
-        }
-        snd_seq_ev_set_source(&ev, info->this_port);
-        if (midi->latency > 0) {
-            /* compute relative time of event = timestamp - now + latency */
-            PmTimestamp now = (midi->time_proc ? 
-                               midi->time_proc(midi->time_info) : 
-                               Pt_Time());
-            int when = timestamp;
-            /* if timestamp is zero, send immediately */
-            /* otherwise compute time delay and use delay if positive */
-            if (when == 0) when = now;
-            when = (when - now) + midi->latency;
-            if (when < 0) when = 0;
-            VERBOSE printf("timestamp %d now %d latency %d, ", 
-                           (int) timestamp, (int) now, midi->latency);
-            VERBOSE printf("scheduling event after %d\n", when);
-            /* message is sent in relative ticks, where 1 tick = 1 ms */
-            snd_seq_ev_schedule_tick(&ev, queue, 1, when);
-            /* NOTE: for cases where the user does not supply a time function,
-               we could optimize the code by not starting Pt_Time and using
-               the alsa tick time instead. I didn't do this because it would
-               entail changing the queue management to start the queue tick
-               count when PortMidi is initialized and keep it running until
-               PortMidi is terminated. (This should be simple, but it's not
-               how the code works now.) -RBD */
-        } else { /* send event out without queueing */
-            VERBOSE printf("direct\n");
-            /* ev.queue = SND_SEQ_QUEUE_DIRECT;
-               ev.dest.client = SND_SEQ_ADDRESS_SUBSCRIBERS; */
-            snd_seq_ev_set_direct(&ev);
-        }
-        VERBOSE printf("sending event, timestamp %d (%d+%dns) (%s, %s)\n",
-                       ev.time.tick, ev.time.time.tv_sec, ev.time.time.tv_nsec,
-                       (ev.flags & SND_SEQ_TIME_STAMP_MASK ? "real" : "tick"),
-                       (ev.flags & SND_SEQ_TIME_MODE_MASK ? "rel" : "abs"));
-        err = snd_seq_event_output(seq, &ev);
+        return alsa_send_event(midi, &ev, timestamp);
     }
-    return check_hosterror(err);
+    return pmNoError;
 }
 
 
+#ifndef PM_ALSA_BYTE_ENCODER
+/* alsa_encode_short -- fill in ev for a short message in one step, as
+ * snd_midi_event_encode_byte() would from its bytes. Returns FALSE for
+ * status bytes it does not handle.
+ */
+static int alsa_encode_short(PmMessage msg, snd_seq_event_t *ev)
+{
+    int status = Pm_MessageStatus(msg);
+    int data1 = Pm_MessageData1(msg) & 0x7f;
+    int data2 = Pm_MessageData2(msg) & 0x7f;
+    int channel = status & 0x0f;
+
+    switch (status & 0xf0) {
+    case 0x80:
+        snd_seq_ev_set_noteoff(ev, channel, data1, data2);
+        return TRUE;
+    case 0x90:
+        snd_seq_ev_set_noteon(ev, channel, data1, data2);
+        return TRUE;
+    case 0xa0:
+        snd_seq_ev_set_keypress(ev, channel, data1, data2);
+        return TRUE;
+    case 0xb0:
+        snd_seq_ev_set_controller(ev, channel, data1, data2);
+        return TRUE;
+    case 0xc0:
+        snd_seq_ev_set_pgmchange(ev, channel, data1);
+        return TRUE;
+    case 0xd0:
+        snd_seq_ev_set_chanpress(ev, channel, data1);
+        return TRUE;
+    case 0xe0:
+        snd_seq_ev_set_pitchbend(ev, channel,
+                                 ((data2 << 7) | data1) - 8192);
+        return TRUE;
+    }
+    switch (status) {
+    case 0xf1:
+        ev->type = SND_SEQ_EVENT_QFRAME;
+        ev->data.control.value = data1;
+        break;
+    case 0xf2:
+        ev->type = SND_SEQ_EVENT_SONGPOS;
+        ev->data.control.value = (data2 << 7) | data1;
+        break;
+    case 0xf3:
+        ev->type = SND_SEQ_EVENT_SONGSEL;
+        ev->data.control.value = data1;
+        break;
+    case 0xf6: ev->type = SND_SEQ_EVENT_TUNE_REQUEST; break;
+    case 0xf8: ev->type = SND_SEQ_EVENT_CLOCK; break;
+    case 0xfa: ev->type = SND_SEQ_EVENT_START; break;
+    case 0xfb: ev->type = SND_SEQ_EVENT_CONTINUE; break;
+    case 0xfc: ev->type = SND_SEQ_EVENT_STOP; break;
+    case 0xfe: ev->type = SND_SEQ_EVENT_SENSING; break;
+    case 0xff: ev->type = SND_SEQ_EVENT_RESET; break;
+    default:
+        return FALSE;
+    }
+    snd_seq_ev_set_fixed(ev);
+    return TRUE;
+}
+#endif
+
+
 static PmError alsa_out_close(PmInternal *midi)
 {
     alsa_info_type info = (alsa_info_type) midi->api_info;
@@ -378,100 +486,6 @@ static PmError alsa_create_virtual(int is_input, const char *name,
  }
  
 
-static PmError alsa_in_open(PmInternal *midi, void *driverInfo)
-{
-    int id = midi->device_id;
-    void *client_port = pm_descriptors[id].descriptor;
-    alsa_info_type ainfo = alsa_info_create((long) client_port, id,
-                                            pm_descriptors[id].pub.is_virtual);
-    snd_seq_port_info_t *pinfo;
-    snd_seq_port_subscribe_t *sub;
-    snd_seq_addr_t addr;
-    int err = 0;
-    int is_virtual = pm_descriptors[id].pub.is_virtual;
-    
-    if (!ainfo) return pmInsufficientMemory;
-    midi->api_info = ainfo;
-
-    err = alsa_use_queue();
-    if (err < 0) goto free_ainfo;
-
-    snd_seq_port_info_alloca(&pinfo);
-    if (is_virtual) {
-        ainfo->is_virtual = TRUE;
-        if (snd_seq_get_port_info(seq, ainfo->port, pinfo)) {
-            pinfo = NULL;
-            goto free_ainfo;
-        }
-    } else {
-        /* create a port for this alsa client (seq) where the port
-           number matches the portmidi device ID of the input device */
-        snd_seq_port_info_set_port(pinfo, id);
-        snd_seq_port_info_set_capability(pinfo, SND_SEQ_PORT_CAP_WRITE |
-                SND_SEQ_PORT_CAP_READ  | SND_SEQ_PORT_CAP_SUBS_WRITE);
-
-        snd_seq_port_info_set_type(pinfo, SND_SEQ_PORT_TYPE_MIDI_GENERIC | 
-                                          SND_SEQ_PORT_TYPE_APPLICATION);
-        snd_seq_port_info_set_port_specified(pinfo, 1);
-        
-        const char *port_name = get_sysdep_name(pmKeyAlsaPortName,
-                                                (PmSysDepInfo *) driverInfo);
-        if (port_name) {
-            snd_seq_port_info_set_name(pinfo, port_name);
-        }
-        
-        err = snd_seq_create_port(seq, pinfo);
-        if (err < 0) goto free_queue;
-
-        /* forward messages from input to this alsa client, so this
-         * alsa client is the destination, and the destination port is the
-         * port we just created using the device ID as port number
-         */
-        snd_seq_port_subscribe_alloca(&sub);
-        addr.client = snd_seq_client_id(seq);
-        addr.port = ainfo->this_port;
-        snd_seq_port_subscribe_set_dest(sub, &addr);
-
-        /* forward from the sender which is the device named by 
-           client and port */
-        addr.client = ainfo->client;
-        addr.port = ainfo->port;
-        snd_seq_port_subscribe_set_sender(sub, &addr);
-        snd_seq_port_subscribe_set_time_update(sub, 1);
-        /* this doesn't seem to work: messages come in with real timestamps */
-        snd_seq_port_subscribe_set_time_real(sub, 0);
-        err = snd_seq_subscribe_port(seq, sub);
-        if (err < 0) goto free_this_port;  /* clean up and return on error */
-    }
-
-    maybe_set_client_name(driverInfo);
-
-    return pmNoError;
- free_this_port:
-    snd_seq_delete_port(seq, ainfo->this_port);
- free_queue:
-    alsa_unuse_queue();
- free_ainfo:
-    pm_free(ainfo);
-    return check_hosterror(err);
-}
-
-static PmError alsa_in_close(PmInternal *midi)
-{
-    int err = 0;
-    alsa_info_type info = (alsa_info_type) midi->api_info;
-    if (!info) return pmBadPtr;
-    /* virtual ports stay open because the represent devices */
-    if (!info->is_virtual && info->this_port != PORT_IS_CLOSED) {
-        err = snd_seq_delete_port(seq, info->this_port);
-    }
-    alsa_unuse_queue();
-    midi->api_info = NULL;
-    pm_free(info);
-    return check_hosterror(err);
-}
-        
-
 static PmError alsa_abort(PmInternal *midi)
 {
     /* NOTE: ALSA documentation is vague. This is supposed to 
@@ -521,6 +535,17 @@ static PmError alsa_write_short(PmInternal *midi, PmEvent *event)
     int i;
     alsa_info_type info = (alsa_info_type) midi->api_info;
     if (!info) return pmBadPtr;
+#ifndef PM_ALSA_BYTE_ENCODER
+    /* one event, one clock read: no need for the parser, which takes
+     * the message a byte at a time. (Define PM_ALSA_BYTE_ENCODER to
+     * compare, e.g. with pm_test/fast -t.) */
+    snd_seq_event_t ev;
+    snd_seq_ev_clear(&ev);
+    if (alsa_encode_short(msg, &ev)) {
+        VERBOSE printf("sending 0x%x\n", (unsigned int) msg);
+        return alsa_send_event(midi, &ev, event->timestamp);
+    }
+#endif
     for (i = 0; i < bytes; i++) {
         unsigned char byte = msg;
         VERBOSE printf("sending 0x%x\n", byte);
@@ -549,6 +574,77 @@ static PmTimestamp alsa_synchronize(PmInternal *midi)
 }
 
 
+/* alsa_sample_offset -- sample the offset from ALSA queue real time
+ * to the stream's time. now_ns is read before the queue time, so no
+ * sample exceeds the true offset (a ms clock only makes now_ns
+ * smaller), and the largest recent sample is the best estimate. Taking
+ * the largest over this and the previous one-second window, rather
+ * than over all time, lets the estimate follow drift between the
+ * clocks.
+ */
+static void alsa_sample_offset(PmInternal *midi, PmTimestamp64 now_ns)
+{
+    alsa_info_type info = (alsa_info_type) midi->api_info;
+    snd_seq_queue_status_t *queue_status;
+    const snd_seq_real_time_t *real;
+    PmTimestamp64 queue_ns, sample;
+
+    snd_seq_queue_status_alloca(&queue_status);
+    if (snd_seq_get_queue_status(seq, queue, queue_status) < 0) {
+        return;
+    }
+    real = snd_seq_queue_status_get_real_time(queue_status);
+    queue_ns = real->tv_sec * (PmTimestamp64) 1000000000 + real->tv_nsec;
+    sample = now_ns - queue_ns;
+    if (!info->have_offset || queue_ns >= info->window_end_ns) {
+        info->last_max_ns = (info->have_offset ? info->window_max_ns :
+                                                 sample);
+        info->window_max_ns = sample;
+        info->window_end_ns = queue_ns + 1000000000;
+        info->have_offset = TRUE;
+    } else if (sample > info->window_max_ns) {
+        info->window_max_ns = sample;
+    }
+    info->offset_ns = (info->window_max_ns > info->last_max_ns ?
+                       info->window_max_ns : info->last_max_ns);
+}
+
+
+/* alsa_arrival_ns -- when did ev arrive, in the stream's time (ns)?
+ * Events are stamped by the kernel with real time on our queue when
+ * they arrive (see alsa_in_open), so a burst read late by a slow poll
+ * still gets the times the messages actually came in. Events without
+ * such a stamp get the current time.
+ */
+static PmTimestamp64 alsa_arrival_ns(PmInternal *midi, snd_seq_event_t *ev)
+{
+    alsa_info_type info = (alsa_info_type) midi->api_info;
+    PmTimestamp64 now_ns, arrival;
+
+    if (midi->time_proc64) {
+        now_ns = (*midi->time_proc64)(midi->time_info64);
+    } else {
+        now_ns = (PmTimestamp64) (*midi->time_proc)(midi->time_info) *
+                 1000000;
+    }
+    if ((ev->flags & SND_SEQ_TIME_STAMP_MASK) != SND_SEQ_TIME_STAMP_REAL ||
+        ev->queue != queue) {
+        return now_ns;
+    }
+    /* one sample per poll is plenty, and costs a system call */
+    if (info->offset_serial != poll_serial) {
+        info->offset_serial = poll_serial;
+        alsa_sample_offset(midi, now_ns);
+    }
+    if (!info->have_offset) {
+        return now_ns;
+    }
+    arrival = ev->time.time.tv_sec * (PmTimestamp64) 1000000000 +
+              ev->time.time.tv_nsec + info->offset_ns;
+    return (arrival < now_ns ? arrival : now_ns); /* never in the future */
+}
+
+
 static void handle_event(snd_seq_event_t *ev)
 {
     int device_id = ev->dest.port;
@@ -557,16 +653,16 @@ static void handle_event(snd_seq_event_t *ev)
        continuing to poll other open devices. The closed device may
        have outstanding events from before the close operation.
     */
-    if (!midi) {
+    if (!midi || !midi->api_info) { /* api_info is NULL until opened */
         return;
     }
     PmEvent pm_ev;
-    PmTimestamp timestamp = midi->time_proc(midi->time_info);
+    PmTimestamp64 arrival = alsa_arrival_ns(midi, ev);
+    PmTimestamp timestamp = (PmTimestamp) (arrival / 1000000);
+    if (midi->time_proc64) {
+        midi->input_ns = arrival; /* keep the time in ns */
+    }
 
-    /* time stamp should be in ticks, using our queue where 1 tick = 1ms */
-    /* assert((ev->flags & SND_SEQ_TIME_STAMP_MASK) == SND_SEQ_TIME_STAMP_TICK);
-       Currently, event timestamp is ignored. See long note below. 
-    */
     VERBOSE {
         /* translate time to time_proc basis */
         snd_seq_queue_status_t *queue_status;
@@ -582,20 +678,12 @@ static void handle_event(snd_seq_event_t *ev)
         /* timestamp = (*time_proc)(midi->time_info) + ev->time.tick -
                        snd_seq_queue_status_get_tick_time(queue_status); */
     }
-    /* CURRENT: portmidi timestamp is "now". In a test, timestamps from
-     * hardware (MIDI over USB) were timestamped with the current ALSA
-     * time (snd_seq_queue_status_get_tick_time) and flags indicating 
-     * absolute ticks, but timestamps from another application's virtual
-     * port, sent direct with 0 absolute ticks, were received with a 
-     * large value that is apparently the time since the start time of
-     * the other application. Without any reference to our local time,
-     * this seems useless. PortMidi is supposed to return the local
-     * PortMidi time of the arrival of the message, so the best we can
-     * do is set the timestamp to our local clock.  This seems to be a
-     * design flaw in ALSA -- I pointed this out a decade ago, but if
-     * there is a workaround, I'd still like to know. Maybe there is a
-     * way to use absolute real time and maybe that's sharable across
-     * applications by referencing the system time?
+    /* NOTE: timestamps that senders put on events are meaningless
+     * here: another application's virtual port, sending direct with 0
+     * absolute ticks, delivers the time since the start of that
+     * application. Instead, our port and subscription have the kernel
+     * overwrite the stamp with the arrival time on our own queue, and
+     * alsa_arrival_ns() maps that to the stream's time.
      */
     pm_ev.timestamp = timestamp;
     switch (ev->type) {
@@ -724,6 +812,53 @@ static void handle_event(snd_seq_event_t *ev)
         printf("portmidi handle_event: not handled type %x\n", ev->type);
         break;
     }
+    midi->input_ns = 0; /* only valid for this event */
+}
+
+
+/* alsa_input_event -- handle the result of snd_seq_event_input */
+static void alsa_input_event(int rslt, snd_seq_event_t *ev)
+{
+    /* check for and ignore errors, e.g. input overflow */
+    /* note: if there's overflow, this should be reported
+     * all the way through to client. Since input from all
+     * devices is merged, we need to find all input devices
+     * and set all to the overflow state.
+     * NOTE: this assumes every input is ALSA based.
+     */
+    if (rslt >= 0) {
+        handle_event(ev);
+    } else if (rslt == -ENOSPC) {
+        int i;
+        for (i = 0; i < pm_descriptor_len; i++) {
+            if (pm_descriptors[i].pub.input) {
+                PmInternal *midi_i = pm_descriptors[i].pm_internal;
+                /* careful, device may not be open! (api_info is NULL
+                   until alsa_in_open has finished) */
+                if (midi_i && midi_i->api_info) Pm_SetOverflow(midi_i->queue);
+            }
+        }
+    }
+}
+
+
+/* alsa_input_done -- input from all devices is merged, so let every
+ * open input pass on what it holds (see pm_input_done). Returns true
+ * if any input still holds something that is due later.
+ */
+static int alsa_input_done(void)
+{
+    int held = FALSE;
+    int i;
+    for (i = 0; i < pm_descriptor_len; i++) {
+        if (pm_descriptors[i].pub.input) {
+            PmInternal *midi_i = pm_descriptors[i].pm_internal;
+            if (midi_i && midi_i->api_info && pm_input_done(midi_i)) {
+                held = TRUE;
+            }
+        }
+    }
+    return held;
 }
 
 
@@ -732,33 +867,352 @@ static PmError alsa_poll(PmInternal *midi)
     if (!midi) {
         return pmBadPtr;
     }
+    if (reader_running) {
+        return pmNoError; /* the reader thread does all the work */
+    }
     snd_seq_event_t *ev;
+    poll_serial++; /* each input resamples its offset once, if needed */
     /* expensive check for input data, gets data from device: */
     while (snd_seq_event_input_pending(seq, TRUE) > 0) {
         /* cheap check on local input buffer */
         while (snd_seq_event_input_pending(seq, FALSE) > 0) {
-            /* check for and ignore errors, e.g. input overflow */
-            /* note: if there's overflow, this should be reported
-             * all the way through to client. Since input from all
-             * devices is merged, we need to find all input devices
-             * and set all to the overflow state.
-             * NOTE: this assumes every input is ALSA based.
-             */
             int rslt = snd_seq_event_input(seq, &ev);
-            if (rslt >= 0) {
-                handle_event(ev);
-            } else if (rslt == -ENOSPC) {
-                int i;
-                for (i = 0; i < pm_descriptor_len; i++) {
-                    if (pm_descriptors[i].pub.input) {
-                        PmInternal *midi_i = pm_descriptors[i].pm_internal;
-                        /* careful, device may not be open! */
-                        if (midi_i) Pm_SetOverflow(midi_i->queue);
-                    }
+            alsa_input_event(rslt, ev);
+        }
+    }
+    alsa_input_done();
+    return pmNoError;
+}
+
+
+/* alsa_reader_thread -- wait for input, read everything that has
+ * arrived with one read, and deliver it. Wakes every ms while input is
+ * held back (see pm_input_done) and otherwise only when input arrives,
+ * or when reader_wake says to stop.
+ */
+static void *alsa_reader_thread(void *param)
+{
+    int timeout = -1;
+    on_reader_thread = TRUE;
+    while (TRUE) {
+        int ready = poll(reader_fds, reader_nfds, timeout);
+        if (ready > 0 && reader_fds[0].revents) {
+            break; /* alsa_stop_reader() wrote to reader_wake */
+        }
+        pthread_mutex_lock(&reader_lock);
+        poll_serial++;
+        if (ready > 0) {
+            snd_seq_event_t *ev;
+            /* seq is readable, so the first snd_seq_event_input does
+             * not block; it reads all pending events into seq's buffer.
+             * Then return to poll() rather than asking the kernel.
+             */
+            do {
+                int rslt = snd_seq_event_input(seq, &ev);
+                alsa_input_event(rslt, ev);
+                if (rslt < 0 && rslt != -ENOSPC) break;
+            } while (snd_seq_event_input_pending(seq, FALSE) > 0);
+        }
+        timeout = (alsa_input_done() ? 1 : -1);
+        pthread_mutex_unlock(&reader_lock);
+    }
+    return NULL;
+}
+
+
+static int alsa_start_reader(void)
+{
+    int n = snd_seq_poll_descriptors_count(seq, POLLIN);
+    int err;
+    reader_fds = (struct pollfd *) pm_alloc((n + 1) * sizeof(struct pollfd));
+    if (!reader_fds) {
+        return -ENOMEM;
+    }
+    if (pipe(reader_wake) < 0) {
+        err = -errno;
+        goto free_fds;
+    }
+    reader_fds[0].fd = reader_wake[0];
+    reader_fds[0].events = POLLIN;
+    reader_fds[0].revents = 0;
+    reader_nfds = 1 + snd_seq_poll_descriptors(seq, reader_fds + 1, n,
+                                               POLLIN);
+    err = -pthread_create(&reader, NULL, alsa_reader_thread, NULL);
+    if (err < 0) goto close_pipe;
+    reader_running = TRUE;
+    return 0;
+ close_pipe:
+    close(reader_wake[0]);
+    close(reader_wake[1]);
+ free_fds:
+    pm_free(reader_fds);
+    reader_fds = NULL;
+    return err;
+}
+
+
+static void alsa_stop_reader(void)
+{
+    if (reader_running) {
+        char stop = 0;
+        if (write(reader_wake[1], &stop, 1) != 1) {
+            return; /* cannot happen: the pipe is empty */
+        }
+        pthread_join(reader, NULL);
+        reader_running = FALSE;
+        close(reader_wake[0]);
+        close(reader_wake[1]);
+        pm_free(reader_fds);
+        reader_fds = NULL;
+    }
+}
+
+
+/* the event types that handle_event() passes on as MIDI, and the
+ * status byte of each (with channel 0 for channel messages) */
+static const struct {
+    int type;
+    unsigned char status;
+} event_status[] = {
+    { SND_SEQ_EVENT_NOTEON, 0x90 }, { SND_SEQ_EVENT_NOTEOFF, 0x80 },
+    { SND_SEQ_EVENT_KEYPRESS, 0xa0 }, { SND_SEQ_EVENT_CONTROLLER, 0xb0 },
+    { SND_SEQ_EVENT_CONTROL14, 0xb0 }, { SND_SEQ_EVENT_PGMCHANGE, 0xc0 },
+    { SND_SEQ_EVENT_CHANPRESS, 0xd0 }, { SND_SEQ_EVENT_PITCHBEND, 0xe0 },
+    { SND_SEQ_EVENT_SYSEX, 0xf0 }, { SND_SEQ_EVENT_QFRAME, 0xf1 },
+    { SND_SEQ_EVENT_SONGPOS, 0xf2 }, { SND_SEQ_EVENT_SONGSEL, 0xf3 },
+    { SND_SEQ_EVENT_TUNE_REQUEST, 0xf6 }, { SND_SEQ_EVENT_CLOCK, 0xf8 },
+    { SND_SEQ_EVENT_START, 0xfa }, { SND_SEQ_EVENT_CONTINUE, 0xfb },
+    { SND_SEQ_EVENT_STOP, 0xfc }, { SND_SEQ_EVENT_SENSING, 0xfe },
+    { SND_SEQ_EVENT_RESET, 0xff }
+};
+#define EVENT_STATUS_LEN (sizeof(event_status) / sizeof(event_status[0]))
+
+
+/* alsa_update_event_filter -- have the kernel drop event types that no
+ * open ALSA input accepts, so they are never read and decoded. The
+ * filter is for the whole client, so a type passes if any input takes
+ * it on any channel; each stream's accept table still does the rest,
+ * e.g. channel masks and filters that differ between streams. Call
+ * with reader_lock held, after opening or closing an input.
+ */
+static void alsa_update_event_filter(void)
+{
+    snd_seq_client_info_t *cinfo;
+    int wanted[EVENT_STATUS_LEN];
+    int dropping = FALSE;
+    int i, j, ch;
+
+    for (j = 0; j < EVENT_STATUS_LEN; j++) {
+        int channels = (event_status[j].status < 0xf0 ? 16 : 1);
+        wanted[j] = FALSE;
+        for (i = 0; i < pm_descriptor_len && !wanted[j]; i++) {
+            PmInternal *midi = pm_descriptors[i].pm_internal;
+            if (!midi || !midi->api_info ||
+                pm_descriptors[i].dictionary != &pm_linuxalsa_in_dictionary) {
+                continue; /* not an open ALSA input */
+            }
+            for (ch = 0; ch < channels; ch++) {
+                if (midi->accept[event_status[j].status | ch]) {
+                    wanted[j] = TRUE;
+                    break;
                 }
             }
         }
+        if (!wanted[j]) dropping = TRUE;
+    }
+    snd_seq_client_info_alloca(&cinfo);
+    if (snd_seq_get_client_info(seq, cinfo) < 0) {
+        return; /* no harm done: streams filter for themselves */
+    }
+    /* with no types added, the client takes every event */
+    snd_seq_client_info_event_filter_clear(cinfo);
+    if (dropping) {
+        /* handle_event() needs to know when a device goes away */
+        snd_seq_client_info_event_filter_add(cinfo,
+                                             SND_SEQ_EVENT_PORT_UNSUBSCRIBED);
+        snd_seq_client_info_event_filter_add(cinfo,
+                                             SND_SEQ_EVENT_PORT_SUBSCRIBED);
+        for (j = 0; j < EVENT_STATUS_LEN; j++) {
+            if (wanted[j]) {
+                snd_seq_client_info_event_filter_add(cinfo,
+                                                     event_status[j].type);
+            }
+        }
+    }
+    snd_seq_set_client_info(seq, cinfo);
+}
+
+
+/* alsa_hide_input -- when alsa_in_open fails before it takes
+ * reader_lock: pm_create_internal has already set pm_internal, and the
+ * caller frees midi, so the reader must not find it any more
+ */
+static void alsa_hide_input(int id)
+{
+    pthread_mutex_lock(&reader_lock);
+    pm_descriptors[id].pm_internal = NULL;
+    pthread_mutex_unlock(&reader_lock);
+}
+
+
+static PmError alsa_in_open(PmInternal *midi, void *driverInfo)
+{
+    int id = midi->device_id;
+    void *client_port = pm_descriptors[id].descriptor;
+    alsa_info_type ainfo = alsa_info_create((long) client_port, id,
+                                            pm_descriptors[id].pub.is_virtual);
+    snd_seq_port_info_t *pinfo;
+    snd_seq_port_subscribe_t *sub;
+    snd_seq_addr_t addr;
+    int err = 0;
+    int is_virtual = pm_descriptors[id].pub.is_virtual;
+    
+    if (!ainfo) {
+        alsa_hide_input(id);
+        return pmInsufficientMemory;
+    }
+    if (get_sysdep_name(pmKeyAlsaInputThread, (PmSysDepInfo *) driverInfo) &&
+        !reader_running) {
+        err = alsa_start_reader();
+        if (err < 0) {
+            alsa_hide_input(id);
+            pm_free(ainfo);
+            return check_hosterror(err);
+        }
+    }
+    pthread_mutex_lock(&reader_lock);
+    midi->api_info = ainfo;
+
+    err = alsa_use_queue();
+    if (err < 0) goto free_ainfo;
+
+    snd_seq_port_info_alloca(&pinfo);
+    if (is_virtual) {
+        ainfo->is_virtual = TRUE;
+        if (snd_seq_get_port_info(seq, ainfo->port, pinfo)) {
+            pinfo = NULL;
+            goto free_ainfo;
+        }
+        /* the port may have been created before the queue existed, so
+         * stamp arrivals with real time on the current queue now */
+        snd_seq_port_info_set_timestamping(pinfo, 1);
+        snd_seq_port_info_set_timestamp_real(pinfo, 1);
+        snd_seq_port_info_set_timestamp_queue(pinfo, queue);
+        err = snd_seq_set_port_info(seq, ainfo->port, pinfo);
+        if (err < 0) goto free_queue;
+    } else {
+        /* create a port for this alsa client (seq) where the port
+           number matches the portmidi device ID of the input device */
+        snd_seq_port_info_set_port(pinfo, id);
+        snd_seq_port_info_set_capability(pinfo, SND_SEQ_PORT_CAP_WRITE |
+                SND_SEQ_PORT_CAP_READ  | SND_SEQ_PORT_CAP_SUBS_WRITE);
+
+        snd_seq_port_info_set_type(pinfo, SND_SEQ_PORT_TYPE_MIDI_GENERIC | 
+                                          SND_SEQ_PORT_TYPE_APPLICATION);
+        snd_seq_port_info_set_port_specified(pinfo, 1);
+        /* the kernel stamps arrivals with real time on our queue */
+        snd_seq_port_info_set_timestamping(pinfo, 1);
+        snd_seq_port_info_set_timestamp_real(pinfo, 1);
+        snd_seq_port_info_set_timestamp_queue(pinfo, queue);
+        
+        const char *port_name = get_sysdep_name(pmKeyAlsaPortName,
+                                                (PmSysDepInfo *) driverInfo);
+        if (port_name) {
+            snd_seq_port_info_set_name(pinfo, port_name);
+        }
+        
+        err = snd_seq_create_port(seq, pinfo);
+        if (err < 0) goto free_queue;
+
+        /* forward messages from input to this alsa client, so this
+         * alsa client is the destination, and the destination port is the
+         * port we just created using the device ID as port number
+         */
+        snd_seq_port_subscribe_alloca(&sub);
+        addr.client = snd_seq_client_id(seq);
+        addr.port = ainfo->this_port;
+        snd_seq_port_subscribe_set_dest(sub, &addr);
+
+        /* forward from the sender which is the device named by 
+           client and port */
+        addr.client = ainfo->client;
+        addr.port = ainfo->port;
+        snd_seq_port_subscribe_set_sender(sub, &addr);
+        snd_seq_port_subscribe_set_queue(sub, queue);
+        snd_seq_port_subscribe_set_time_update(sub, 1);
+        snd_seq_port_subscribe_set_time_real(sub, 1);
+        err = snd_seq_subscribe_port(seq, sub);
+        if (err < 0) goto free_this_port;  /* clean up and return on error */
+    }
+
+    maybe_set_client_name(driverInfo);
+
+    inputs_open++;
+    alsa_update_event_filter();
+    pthread_mutex_unlock(&reader_lock);
+    return pmNoError;
+ free_this_port:
+    snd_seq_delete_port(seq, ainfo->this_port);
+ free_queue:
+    alsa_unuse_queue();
+ free_ainfo:
+    midi->api_info = NULL;
+    pm_descriptors[id].pm_internal = NULL; /* hide midi from the reader */
+    pthread_mutex_unlock(&reader_lock);
+    pm_free(ainfo);
+    if (inputs_open == 0) alsa_stop_reader();
+    return check_hosterror(err);
+}
+
+static PmError alsa_in_close(PmInternal *midi)
+{
+    int err = 0;
+    alsa_info_type info = (alsa_info_type) midi->api_info;
+    if (!info) return pmBadPtr;
+    pthread_mutex_lock(&reader_lock);
+    /* virtual ports stay open because the represent devices */
+    if (!info->is_virtual && info->this_port != PORT_IS_CLOSED) {
+        err = snd_seq_delete_port(seq, info->this_port);
+    }
+    alsa_unuse_queue();
+    midi->api_info = NULL;
+    /* Pm_Close clears this too, but the reader must not see midi again */
+    pm_descriptors[midi->device_id].pm_internal = NULL;
+    inputs_open--;
+    alsa_update_event_filter();
+    pthread_mutex_unlock(&reader_lock);
+    pm_free(info);
+    if (inputs_open == 0) alsa_stop_reader();
+    return check_hosterror(err);
+}
+        
+
+/* alsa_poll_descriptors -- seq's descriptors, unless the reader thread
+ * reads seq, in which case the stream's wake_fd tells of input */
+static int alsa_poll_descriptors(PmInternal *midi, int *fds, int max)
+{
+    struct pollfd pfds[8]; /* seq has one */
+    int i, n;
+    if (reader_running) {
+        return 0;
+    }
+    n = snd_seq_poll_descriptors(seq, pfds, 8, POLLIN);
+    for (i = 0; i < n && i < max; i++) {
+        fds[i] = pfds[i].fd;
+    }
+    return n;
+}
+
+
+static PmError alsa_update_filters(PmInternal *midi)
+{
+    if (on_reader_thread) { /* called by an input callback */
+        alsa_update_event_filter();
+        return pmNoError;
     }
+    pthread_mutex_lock(&reader_lock);
+    alsa_update_event_filter();
+    pthread_mutex_unlock(&reader_lock);
     return pmNoError;
 }
 
@@ -781,7 +1235,9 @@ pm_fns_node pm_linuxalsa_in_dictionary = {
     alsa_abort,
     alsa_in_close,
     alsa_poll,
-    alsa_check_host_error
+    alsa_check_host_error,
+    alsa_poll_descriptors,
+    alsa_update_filters
 };
 
 pm_fns_node pm_linuxalsa_out_dictionary = {
@@ -796,7 +1252,9 @@ pm_fns_node pm_linuxalsa_out_dictionary = {
     alsa_abort, 
     alsa_out_close,
     none_poll,
-    alsa_check_host_error
+    alsa_check_host_error,
+    none_poll_descriptors,
+    none_update_filters
 };
 
 
@@ -883,6 +1341,7 @@ PmError pm_linuxalsa_init(void)
 void pm_linuxalsa_term(void)
 {
     if (seq) {
+        alsa_stop_reader();
         snd_seq_close(seq);
         pm_free(pm_descriptors);
         pm_descriptors = NULL;
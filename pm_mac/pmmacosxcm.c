@@ -84,6 +84,7 @@
 #include <CoreMIDI/MIDIServices.h>
 #include <CoreAudio/HostTime.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <libkern/OSAtomic.h>
 
 #define PACKET_BUFFER_SIZE 1024
@@ -216,6 +217,16 @@ typedef struct coremidi_info_struct {
     int isIACdevice;
     Float64 us_per_host_tick; /* host clock frequency, units of min_next_time */
     UInt64 host_ticks_per_byte; /* host clock units per byte at maximum rate */
+    /* input: CoreMIDI calls read_callback only when input arrives, so
+     * while input is held back (see pm_input_done) flush_thread passes
+     * it on when it is due. lock is held by both, and has priority
+     * inheritance so the CoreMIDI thread is not held up by a thread of
+     * lower priority for longer than a pm_input_done call. */
+    pthread_mutex_t lock;
+    pthread_cond_t held_cond; /* signaled when held becomes true */
+    pthread_t flush_thread;
+    int held; /* what pm_input_done last returned */
+    int closing; /* tells flush_thread to return */
 } coremidi_info_node, *coremidi_info_type;
 
 /* private function declarations */
@@ -272,6 +283,7 @@ static void read_callback(const MIDIPacketList *newPackets, PmInternal *midi)
     assert(info);
     
     CM_DEBUG printf("read_callback: numPackets %d: ", newPackets->numPackets);
+    pthread_mutex_lock(&info->lock);
     
     /* synchronize time references every 100ms */
     now = (*midi->time_proc)(midi->time_info);
@@ -316,6 +328,72 @@ static void read_callback(const MIDIPacketList *newPackets, PmInternal *midi)
         pm_read_bytes(midi, packet->data, packet->length, timestamp);
         packet = MIDIPacketNext(packet);
     }
+    info->held = pm_input_done(midi);
+    if (info->held) pthread_cond_signal(&info->held_cond);
+    pthread_mutex_unlock(&info->lock);
+}
+
+
+/* flush_thread -- while input is held, call pm_input_done every ms */
+static void *flush_thread(void *param)
+{
+    PmInternal *midi = (PmInternal *) param;
+    coremidi_info_type info = (coremidi_info_type) midi->api_info;
+    struct timespec ms = { 0, 1000000 };
+    pthread_mutex_lock(&info->lock);
+    while (!info->closing) {
+        if (info->held) {
+            pthread_cond_timedwait_relative_np(&info->held_cond,
+                                               &info->lock, &ms);
+            if (!info->closing) info->held = pm_input_done(midi);
+        } else {
+            pthread_cond_wait(&info->held_cond, &info->lock);
+        }
+    }
+    pthread_mutex_unlock(&info->lock);
+    return NULL;
+}
+
+
+/* start_flush_thread -- create the lock and flush_thread of an input */
+static PmError start_flush_thread(PmInternal *midi)
+{
+    coremidi_info_type info = (coremidi_info_type) midi->api_info;
+    pthread_mutexattr_t attr;
+    int err;
+    info->held = FALSE;
+    info->closing = FALSE;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setprotocol(&attr, PTHREAD_PRIO_INHERIT);
+    err = pthread_mutex_init(&info->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    if (err) goto no_lock;
+    if ((err = pthread_cond_init(&info->held_cond, NULL))) goto no_cond;
+    err = pthread_create(&info->flush_thread, NULL, flush_thread, midi);
+    if (!err) return pmNoError;
+    pthread_cond_destroy(&info->held_cond);
+ no_cond:
+    pthread_mutex_destroy(&info->lock);
+ no_lock:
+    snprintf(pm_hosterror_text, PM_HOST_ERROR_MSG_LEN,
+             "Host error %d: pthread in midi_in_open()", err);
+    pm_hosterror = TRUE;
+    return pmHostError;
+}
+
+
+/* stop_flush_thread -- undo start_flush_thread once read_callback is no
+ * longer called for midi */
+static void stop_flush_thread(PmInternal *midi)
+{
+    coremidi_info_type info = (coremidi_info_type) midi->api_info;
+    pthread_mutex_lock(&info->lock);
+    info->closing = TRUE;
+    pthread_cond_signal(&info->held_cond);
+    pthread_mutex_unlock(&info->lock);
+    pthread_join(info->flush_thread, NULL);
+    pthread_cond_destroy(&info->held_cond);
+    pthread_mutex_destroy(&info->lock);
 }
 
 /* callback for real devices - redirects to read_callback */
@@ -402,9 +480,15 @@ static PmError midi_in_open(PmInternal *midi, void *driverInfo)
     if (!info) {
         return pmInsufficientMemory;
     }
+    if (start_flush_thread(midi) != pmNoError) {
+        midi->api_info = NULL;
+        pm_free(info);
+        return pmHostError;
+    }
     if (!is_virtual) {
         macHostError = MIDIPortConnectSource(portIn, endpoint, midi);
         if (macHostError != noErr) {
+            stop_flush_thread(midi);
             midi->api_info = NULL;
             pm_free(info);
             return  check_hosterror(macHostError,
@@ -488,6 +572,7 @@ static PmError midi_in_close(PmInternal *midi)
         }
         pm_descriptors[midi->device_id].pub.opened = FALSE;  /* force it */
     }
+    stop_flush_thread(midi);
     midi->api_info = NULL;
     pm_free(info);
     return err;
@@ -1044,7 +1129,9 @@ pm_fns_node pm_macosx_in_dictionary = {
     midi_abort,
     midi_in_close,
     success_poll,
-    midi_check_host_error
+    midi_check_host_error,
+    none_poll_descriptors,
+    none_update_filters
 };
 
 pm_fns_node pm_macosx_out_dictionary = {
@@ -1059,7 +1146,9 @@ pm_fns_node pm_macosx_out_dictionary = {
     midi_abort,
     midi_out_close,
     success_poll,
-    midi_check_host_error
+    midi_check_host_error,
+    none_poll_descriptors,
+    none_update_filters
 };
 
 
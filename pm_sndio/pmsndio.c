@@ -123,8 +123,11 @@ void* input_thread(void *param)
 
     while(dev->mode & MIO_IN) {
         if (todo == 0) {
+            /* all input read so far is processed; wake up soon if
+               events are held (see pm_input_done) */
+            int held = pm_input_done(midi);
             nfds = mio_pollfd(dev->hdl, pfd, POLLIN);
-            rc = poll(pfd, nfds, 100);
+            rc = poll(pfd, nfds, held ? 1 : 100);
             if (rc < 0) {
                 if (errno == EINTR)
                     continue;
@@ -346,6 +349,8 @@ pm_fns_node pm_sndio_in_dictionary = {
     sndio_in_close,
     success_poll,
     sndio_has_host_error,
+    none_poll_descriptors,
+    none_update_filters,
 };
 
 pm_fns_node pm_sndio_out_dictionary = {
@@ -361,5 +366,7 @@ pm_fns_node pm_sndio_out_dictionary = {
     sndio_out_close,
     none_poll,
     sndio_has_host_error,
+    none_poll_descriptors,
+    none_update_filters,
 };
 
@@ -10,6 +10,16 @@
  * Modified 9 Aug 2017 with -m, -p to test when timestamps are
  * wrapping from negative to positive or positive to negative.
  *
+ * -t measures throughput: how fast Pm_WriteShort() can send a mix of
+ * notes, controllers and pitch bends. Sent to a device or to a port
+ * with a receiver, this is mostly how fast the system accepts MIDI.
+ * To see PortMidi's own cost per message, e.g. to compare the ALSA
+ * encoders (build PortMidi with and without -DPM_ALSA_BYTE_ENCODER),
+ * use latency 0 and the virtual port, and connect nothing to it:
+ *     fast -t -l 0 -s 10 -d <number of "Create virtual port">
+ * and type ENTER at the pause. ALSA then drops each event as soon as
+ * it has been encoded and buffered.
+ *
  * Roger B. Dannenberg, Aug 2017
  */
 
@@ -40,6 +50,7 @@ int deviceno = -9999;
 int duration = 0;
 int expired_timestamps = FALSE;
 int use_timeoffset = 0;
+int throughput = FALSE;
 
 /* read a number from console */
 /**/
@@ -69,6 +80,40 @@ PmTimestamp get_time(void *info)
 }
 
 
+/* throughput_test -- send as fast as possible for duration seconds and
+ *    report the rate. Each group of 4 messages is note-on, controller,
+ *    pitch bend and note-off, so no note is left on. is_virtual is
+ *    TRUE if midi is fast's own virtual port.
+ */
+void throughput_test(PmStream *midi, int is_virtual)
+{
+    static const PmMessage mix[4] = {
+        Pm_Message(0x90, 60, 100), Pm_Message(0xB0, 7, 100),
+        Pm_Message(0xE0, 0, 0x40), Pm_Message(0x80, 60, 0) };
+    PmTimestamp start = get_time(NULL);
+    PmTimestamp now = start;
+    long msgcnt = 0;
+    int i;
+
+    while (((PmTimestamp) (now - start)) < duration * 1000) {
+        for (i = 0; i < 1000; i++) {
+            Pm_WriteShort(midi, now, mix[i & 3]);
+        }
+        msgcnt += 1000;
+        now = get_time(NULL);
+    }
+    if (now == start) now++; /* duration 0: avoid dividing by zero */
+    printf("%ld messages in %d ms: %.0f messages/s, %.3f us/message\n",
+           msgcnt, (int) (now - start), msgcnt * 1000.0 / (now - start),
+           (now - start) * 1000.0 / msgcnt);
+    if (!is_virtual || latency != 0) {
+        printf("(this includes the time to deliver the messages; use the "
+               "virtual port\n with no receiver and latency 0 to measure "
+               "PortMidi alone)\n");
+    }
+}
+
+
 void fast_test(void)
 {
     PmStream *midi;
@@ -95,6 +140,8 @@ void fast_test(void)
             err = Pm_OpenOutput(&midi, deviceno, DRIVER_INFO, buffer_size,
                                 get_time, NULL, latency);
             pause = TRUE;
+        } else {
+            err = (PmError) deviceno; /* could not create the port */
         }
     } else if (err >= pmNoError) {
         err = Pm_OpenOutput(&midi, deviceno, DRIVER_INFO, buffer_size,
@@ -121,6 +168,10 @@ void fast_test(void)
     }
     printf("sending output...\n");
     fflush(stdout); /* make sure message goes to console */
+    if (throughput) {
+        throughput_test(midi, pause);
+        goto close;
+    }
 
     /* every 10ms send on/off pairs at timestamps set to current time */
     now = get_time(NULL);
@@ -159,6 +210,7 @@ void fast_test(void)
         now = get_time(NULL);
         polling_count++;
     }
+  close:
     /* close device (this not explicitly needed in most implementations) */
     printf("ready to close and terminate... (type RETURN):");
     while (getchar() != '\n') ;
@@ -173,14 +225,16 @@ void fast_test(void)
 void show_usage(void)
 {
     printf("Usage: fast [-h] [-l latency] [-r rate] [-d device] [-s dur] "
-           "[-n] [-p] [-m]\n"
+           "[-n] [-p] [-m] [-t]\n"
            ", where latency is in ms,\n"
            "        rate is messages per second,\n"
            "        device is the PortMidi device number,\n"
            "        dur is the length of the test in seconds,\n"
            "        -n means send timestamps in the past,\n"
            "        -p means use a large positive time offset,\n"
-           "        -m means use a large negative time offset, and\n"
+           "        -m means use a large negative time offset,\n"
+           "        -t means send as fast as possible (ignoring rate)\n"
+           "           and report the throughput, and\n"
            "        -h means help.\n");
 }
 
@@ -234,6 +288,9 @@ int main(int argc, char *argv[])
             } else if (strcmp(argv[i], "-m") == 0) {
                 printf("Time offset set to -10000 (-m)\n");
                 use_timeoffset = -10000;
+            } else if (strcmp(argv[i], "-t") == 0) {
+                printf("Measuring throughput (-t)\n");
+                throughput = TRUE;
             } else {
                 show_usage();
             }
@@ -245,7 +302,7 @@ int main(int argc, char *argv[])
         latency = (int32_t) get_number("Latency in ms: "); 
     }
 
-    if (!rate_valid) {
+    if (!rate_valid && !throughput) {
         // coerce from "%d" to known size
         msgrate = (int32_t) get_number("Rate in messages per second: ");
     }
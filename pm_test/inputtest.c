@@ -0,0 +1,547 @@
+/* inputtest.c -- check input processing without a MIDI device
+
+   Usage: inputtest
+
+   Feeds input to streams the way a device driver does, through
+   pm_read_short, pm_read_bytes and pm_input_done, and checks what the
+   application receives:
+
+   1. filtering with the accept table (see Pm_SetFilter) against the
+      tests on filters and channel_mask that it replaced,
+   2. pm_read_bytes on buffers of random input against the same bytes
+      passed one at a time, which never takes the sysex fast path,
+   3. delivery to an input callback (see Pm_SetInputCallback),
+   4. whole sysex messages (see Pm_SetSysExBuffer), and
+   5. the order of coalesced input (see Pm_SetCoalescing).
+
+   Like pm_bench_filter, this calls PortMidi internals (pminternal.h),
+   here through a fake input device, so no MIDI device is needed.
+   Output should be "inputtest passed"; otherwise it shows the first
+   check that failed.
+ */
+
+#include "stdlib.h"
+#include "stdio.h"
+#include "string.h"
+#include "portmidi.h"
+#include "pmutil.h"
+#include "pminternal.h"
+
+#define BUF_LEN 4096
+
+#define MIDI_SYSEX 0xF0
+#define MIDI_EOX 0xF7
+#define MIDI_CLOCK 0xF8
+#define MIDI_ACTIVE 0xFE
+
+PmEvent got[BUF_LEN];
+int got_len = 0;
+int got_calls = 0;
+PmTimestamp now = 0; /* the time of the fake device, in ms */
+pm_fns_node fake_dictionary;
+PmDeviceID fake_id;
+
+
+PmTimestamp fake_time(void *time_info)
+{
+    (void) time_info;
+    return now;
+}
+
+
+PmError fake_open(PmInternal *midi, void *driverInfo)
+{
+    (void) midi;
+    (void) driverInfo;
+    return pmNoError;
+}
+
+
+/* open_fake -- open the fake input device, or return NULL */
+PortMidiStream *open_fake(void)
+{
+    PortMidiStream *stream;
+    if (Pm_OpenInput(&stream, fake_id, NULL, BUF_LEN, fake_time, NULL)) {
+        printf("Could not open fake input device\n");
+        return NULL;
+    }
+    return stream;
+}
+
+
+/* feed -- a message from the device at time now */
+void feed(PortMidiStream *stream, int status, int data1, int data2)
+{
+    PmEvent event;
+    event.message = Pm_Message(status, data1, data2);
+    event.timestamp = now;
+    pm_read_short((PmInternal *) stream, &event);
+}
+
+
+/* feed_bytes -- bytes from the device at time now */
+void feed_bytes(PortMidiStream *stream, const unsigned char *data, int len)
+{
+    pm_read_bytes((PmInternal *) stream, data, len, now);
+}
+
+
+/* expect -- check that Pm_Read() returns exactly the n events in want */
+int expect(PortMidiStream *stream, const char *test, PmEvent *want, int n)
+{
+    PmEvent buffer[64];
+    int len = Pm_Read(stream, buffer, 64);
+    int i;
+    for (i = 0; i < len || i < n; i++) {
+        if (i >= len || i >= n ||
+            buffer[i].message != want[i].message ||
+            buffer[i].timestamp != want[i].timestamp) {
+            printf("%s: event %d is ", test, i);
+            if (i < len) {
+                printf("%x at %d", (unsigned) buffer[i].message,
+                       buffer[i].timestamp);
+            } else {
+                printf("missing");
+            }
+            if (i < n) {
+                printf(", expected %x at %d\n", (unsigned) want[i].message,
+                       want[i].timestamp);
+            } else {
+                printf(", expected none\n");
+            }
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+/* rand32 -- 32 random bits (RAND_MAX may be only 0x7FFF) */
+uint32_t rand32(void)
+{
+    return ((uint32_t) rand() << 20) ^ ((uint32_t) rand() << 10) ^
+           (uint32_t) rand();
+}
+
+
+/* the tests pm_read_short made on every message before the accept
+ * table, as in pm_bench_filter.c */
+#define old_channel_filtered(status, mask) \
+    ((((status) & 0xF0) != 0xF0) && (!(Pm_Channel((status) & 0x0F) & (mask))))
+#define old_realtime_filtered(status, filters) \
+    ((((status) & 0xF0) == 0xF0) && ((1 << ((status) & 0xF)) & (filters)))
+#define old_status_filtered(status, filters) \
+    ((1 << (16 + ((status) >> 4))) & (filters))
+
+
+/* test_accept_table -- set random filters and channel masks with the
+ *    API and check that every status passes exactly when the old
+ *    tests would pass it
+ */
+int test_accept_table(void)
+{
+    PortMidiStream *stream = open_fake();
+    int round;
+    if (!stream) return 1;
+    srand(1);
+    for (round = 0; round < 1000; round++) {
+        /* the first round has nothing filtered */
+        int32_t filters = round ? (int32_t) rand32() : 0;
+        int mask = round ? (int) (rand32() & 0xFFFF) : 0xFFFF;
+        PmEvent want[128];
+        int n = 0;
+        int status;
+        Pm_SetFilter(stream, filters);
+        Pm_SetChannelMask(stream, mask);
+        for (status = 0x80; status < 0x100; status++) {
+            if (!old_status_filtered(status, filters)
+                && (!is_real_time(status) ||
+                    !old_realtime_filtered(status, filters))
+                && !old_channel_filtered(status, mask)) {
+                want[n].message = Pm_Message(status, 1, 2);
+                want[n++].timestamp = now;
+            }
+            feed(stream, status, 1, 2);
+            /* break up the input so that Pm_Read gets at most 64 */
+            if (status % 64 == 63) {
+                if (expect(stream, "accept table", want, n)) {
+                    printf("with filters %x and channel mask %x\n",
+                           (unsigned) filters, mask);
+                    return 1;
+                }
+                n = 0;
+            }
+        }
+    }
+    Pm_Close(stream);
+    return 0;
+}
+
+
+/* read_all -- dequeue everything in midi's queue into events */
+int read_all(PmInternal *midi, PmEvent *events)
+{
+    int n = 0;
+    int got;
+    while ((got = Pm_DequeueBatch(midi->queue, events + n,
+                                  BUF_LEN - n)) > 0) {
+        n += got;
+    }
+    return n;
+}
+
+
+/* test_read_bytes -- the bytes of a buffer of random input are passed
+ *    to pm_read_bytes in random pieces on one fake PmInternal, and one
+ *    at a time on another; the events must be the same
+ */
+int test_read_bytes(void)
+{
+    static const unsigned char status[] = {
+        MIDI_SYSEX, MIDI_SYSEX, MIDI_EOX, MIDI_EOX, MIDI_CLOCK,
+        MIDI_ACTIVE, 0x90, 0xB3, 0xC5, 0xF2, 0xF1, 0xF6 };
+    static const int32_t filters[] = {
+        0, PM_FILT_ACTIVE, PM_FILT_SYSEX, PM_FILT_ACTIVE | PM_FILT_CLOCK };
+    PmInternal whole, bytes;
+    unsigned char data[1024 + 16];
+    PmEvent events[BUF_LEN];
+    int round;
+    memset(&whole, 0, sizeof(whole));
+    memset(&bytes, 0, sizeof(bytes));
+    whole.queue = Pm_QueueCreateEx(BUF_LEN, sizeof(PmEvent), PM_QUEUE_EVENT);
+    bytes.queue = Pm_QueueCreateEx(BUF_LEN, sizeof(PmEvent), PM_QUEUE_EVENT);
+    if (!whole.queue || !bytes.queue) {
+        printf("Could not allocate queue\n");
+        return 1;
+    }
+    srand(2);
+    for (round = 0; round < 2000; round++) {
+        /* vary the alignment, the density of status bytes (from none
+         * to one in 4) and the filters */
+        int offset = rand() % 16;
+        int len = 1 + rand() % 1024;
+        int density = 4 << (rand() % 10);
+        int i, n, n2;
+        whole.filters = bytes.filters = filters[round % 4];
+        pm_update_filters(&whole);
+        pm_update_filters(&bytes);
+        for (i = 0; i < len; i++) {
+            data[offset + i] = (rand() % density == 0 ?
+                    status[rand() % sizeof(status)] : rand() & 0x7F);
+        }
+        for (i = 0; i < len; i += n) {
+            int j;
+            n = 1 + rand() % (len - i);
+            pm_read_bytes(&whole, data + offset + i, n, i);
+            for (j = 0; j < n; j++) {
+                pm_read_bytes(&bytes, data + offset + i + j, 1, i);
+            }
+        }
+        n = read_all(&whole, got);
+        n2 = read_all(&bytes, events);
+        for (i = 0; i < n || i < n2; i++) {
+            if (i >= n || i >= n2 || got[i].message != events[i].message ||
+                got[i].timestamp != events[i].timestamp) {
+                printf("pm_read_bytes: event %d of round %d differs\n", i,
+                       round);
+                return 1;
+            }
+        }
+    }
+    Pm_QueueDestroy(whole.queue);
+    Pm_QueueDestroy(bytes.queue);
+    return 0;
+}
+
+
+void callback(PortMidiStream *stream, const PmEvent *events, int32_t count,
+              void *user)
+{
+    (void) stream;
+    (void) user;
+    memcpy(got + got_len, events, count * sizeof(PmEvent));
+    got_len += count;
+    got_calls++;
+}
+
+
+/* test_callback -- input goes to the callback, in order and in one call
+ *    per read of the device, or held for the window
+ */
+int test_callback(void)
+{
+    static const unsigned char sysex[] = {
+        MIDI_SYSEX, 1, 2, 3, MIDI_CLOCK, 4, 5, 6, MIDI_EOX };
+    /* the clock is embedded in the sysex data, as pm_read_short does */
+    static const PmMessage want[] = {
+        0x403C90, 0x3C80, 0x030201F0, 0x060504F8, 0xF7 };
+    PortMidiStream *stream = open_fake();
+    PmEvent event;
+    int i;
+    if (!stream) return 1;
+    now = 10;
+    Pm_SetInputCallback(stream, callback, NULL, 0);
+    feed(stream, 0x90, 60, 64);
+    feed(stream, MIDI_ACTIVE, 0, 0); /* filtered by default */
+    feed(stream, 0x80, 60, 0);
+    feed_bytes(stream, sysex, sizeof(sysex));
+    if (got_calls != 0 || pm_input_done((PmInternal *) stream) ||
+        got_calls != 1 || got_len != 5) {
+        printf("callback: %d calls with %d events, expected 1 with 5\n",
+               got_calls, got_len);
+        return 1;
+    }
+    for (i = 0; i < got_len; i++) {
+        if (got[i].message != want[i] || got[i].timestamp != now) {
+            printf("callback: event %d is %x, expected %x\n", i,
+                   (unsigned) got[i].message, (unsigned) want[i]);
+            return 1;
+        }
+    }
+    if (expect(stream, "callback", NULL, 0)) return 1;
+
+    /* a window of 5 ms holds input until 5 ms after it arrived */
+    got_len = got_calls = 0;
+    Pm_SetInputCallback(stream, callback, NULL, 5000);
+    feed(stream, 0x90, 60, 64);
+    now = 14;
+    feed(stream, 0x80, 60, 0);
+    if (!pm_input_done((PmInternal *) stream) || got_calls != 0) {
+        printf("callback: window did not hold input\n");
+        return 1;
+    }
+    now = 15;
+    if (pm_input_done((PmInternal *) stream) || got_calls != 1 ||
+        got_len != 2) {
+        printf("callback: window did not deliver input when due\n");
+        return 1;
+    }
+
+    /* without a callback, held input goes to the old callback and new
+     * input to the buffer */
+    got_len = got_calls = 0;
+    feed(stream, 0x90, 60, 64);
+    Pm_SetInputCallback(stream, NULL, NULL, 0);
+    feed(stream, 0x80, 60, 0);
+    if (got_calls != 1 || got_len != 1 || got[0].message != 0x403C90) {
+        printf("callback: old callback did not get held input\n");
+        return 1;
+    }
+    event.message = 0x3C80;
+    event.timestamp = now;
+    if (expect(stream, "callback", &event, 1)) return 1;
+    Pm_Close(stream);
+    return 0;
+}
+
+
+/* expect_sysex -- check that Pm_ReadSysEx() returns result and, with
+ *    pmGotData, the n bytes in want, received at timestamp
+ */
+int expect_sysex(PortMidiStream *stream, PmError result,
+                 const unsigned char *want, int32_t n, PmTimestamp timestamp)
+{
+    unsigned char buffer[64];
+    int32_t len = sizeof(buffer);
+    PmTimestamp time;
+    PmError err = Pm_ReadSysEx(stream, buffer, &len, &time);
+    if (err != result) {
+        printf("sysex: Pm_ReadSysEx returned %d, expected %d\n", err,
+               result);
+        return 1;
+    }
+    if (err == pmGotData &&
+        (len != n || memcmp(buffer, want, n) != 0 || time != timestamp)) {
+        printf("sysex: got %d bytes at %d, expected %d at %d\n", len, time,
+               n, timestamp);
+        return 1;
+    }
+    return 0;
+}
+
+
+/* test_sysex_records -- whole sysex messages from Pm_ReadSysEx, however
+ *    the device splits them
+ */
+int test_sysex_records(void)
+{
+    static const unsigned char part1[] = { MIDI_SYSEX, 1, 2 };
+    static const unsigned char part2[] = { 3, MIDI_CLOCK, 4, MIDI_EOX };
+    static const unsigned char message[] = { MIDI_SYSEX, 1, 2, 3, 4, MIDI_EOX };
+    static const unsigned char cut[] = { MIDI_SYSEX, 1, 2, 0x90, 60, 64 };
+    unsigned char long_message[20];
+    unsigned char small[4];
+    int32_t len = sizeof(small);
+    PortMidiStream *stream = open_fake();
+    PmEvent want[2];
+    if (!stream) return 1;
+    if (Pm_SetSysExBuffer(stream, 4, 16) ||
+        expect_sysex(stream, pmNoData, NULL, 0, 0)) return 1;
+
+    /* split, with a real-time message in it that goes to Pm_Read */
+    now = 20;
+    feed_bytes(stream, part1, sizeof(part1));
+    now = 21;
+    feed_bytes(stream, part2, sizeof(part2));
+    pm_input_done((PmInternal *) stream);
+    if (!Pm_Poll(stream) ||
+        Pm_ReadSysEx(stream, small, &len, NULL) != pmBufferTooSmall ||
+        len != sizeof(message) ||
+        expect_sysex(stream, pmGotData, message, sizeof(message), 20) ||
+        expect_sysex(stream, pmNoData, NULL, 0, 0)) return 1;
+    want[0].message = MIDI_CLOCK;
+    want[0].timestamp = 21;
+    if (expect(stream, "sysex", want, 1)) return 1;
+
+    /* a status byte ends the message, which is dropped */
+    feed_bytes(stream, cut, sizeof(cut));
+    want[0].message = 0x403C90;
+    want[0].timestamp = now;
+    if (expect_sysex(stream, pmNoData, NULL, 0, 0) ||
+        expect(stream, "sysex", want, 1)) return 1;
+
+    /* a message longer than 16 bytes is dropped as an overflow, and as
+     * with Pm_Read, so is input until the overflow is read */
+    memset(long_message, 5, sizeof(long_message));
+    long_message[0] = MIDI_SYSEX;
+    long_message[sizeof(long_message) - 1] = MIDI_EOX;
+    feed_bytes(stream, long_message, sizeof(long_message));
+    feed_bytes(stream, message, sizeof(message));
+    if (expect_sysex(stream, pmBufferOverflow, NULL, 0, 0) ||
+        expect_sysex(stream, pmNoData, NULL, 0, 0)) return 1;
+    feed_bytes(stream, message, sizeof(message));
+    if (expect_sysex(stream, pmGotData, message, sizeof(message), now) ||
+        expect_sysex(stream, pmNoData, NULL, 0, 0)) return 1;
+    Pm_Close(stream);
+    return 0;
+}
+
+
+/* test_coalescing -- held values keep the order of their channel */
+int test_coalescing(void)
+{
+    static const unsigned char sysex[] = { MIDI_SYSEX, 1, 2, 3, MIDI_EOX };
+    PortMidiStream *stream = open_fake();
+    PmEvent want[5];
+    int i;
+    if (!stream) return 1;
+
+    /* without an interval, only the latest value of a key is passed on,
+     * when the device has been read */
+    now = 0;
+    Pm_SetCoalescing(stream, PM_FILT_CONTROL | PM_FILT_PITCHBEND, 0);
+    for (i = 0; i < 10; i++) {
+        feed(stream, 0xE0, 0, 64 + i);
+    }
+    if (expect(stream, "coalescing", NULL, 0) ||
+        pm_input_done((PmInternal *) stream)) return 1;
+    want[0].message = Pm_Message(0xE0, 0, 73);
+    want[0].timestamp = now;
+    if (expect(stream, "coalescing", want, 1)) return 1;
+
+    /* other messages of a channel go after its held values, and those
+     * of other channels do not */
+    feed(stream, 0xB0, 1, 1);
+    feed(stream, 0xB1, 1, 2);
+    feed(stream, 0x90, 60, 64);
+    want[0].message = Pm_Message(0xB0, 1, 1);
+    want[1].message = Pm_Message(0x90, 60, 64);
+    want[1].timestamp = now;
+    if (expect(stream, "coalescing", want, 2)) return 1;
+    /* a sysex goes after all of them */
+    feed_bytes(stream, sysex, sizeof(sysex));
+    want[0].message = Pm_Message(0xB1, 1, 2);
+    want[1].message = 0x030201F0;
+    want[2].message = MIDI_EOX;
+    want[2].timestamp = now;
+    if (expect(stream, "coalescing", want, 3)) return 1;
+
+    /* with an interval of 10 ms: cc 1 and 2 pass, both are then held,
+     * and cc 1 is replaced, which puts it behind cc 2 */
+    Pm_SetCoalescing(stream, PM_FILT_CONTROL, 10);
+    now = 100;
+    feed(stream, 0xB0, 1, 0);
+    feed(stream, 0xB0, 2, 0);
+    now = 101;
+    feed(stream, 0xB0, 1, 1);
+    now = 102;
+    feed(stream, 0xB0, 2, 1);
+    now = 103;
+    feed(stream, 0xB0, 1, 2);
+    /* cc 3 is not limited, but goes after the held values */
+    now = 104;
+    feed(stream, 0xB0, 3, 9);
+    for (i = 0; i < 4; i++) want[i].timestamp = 100;
+    want[0].message = Pm_Message(0xB0, 1, 0);
+    want[1].message = Pm_Message(0xB0, 2, 0);
+    want[2].message = Pm_Message(0xB0, 2, 1);
+    want[2].timestamp = 102;
+    want[3].message = Pm_Message(0xB0, 1, 2);
+    want[3].timestamp = 103;
+    want[4].message = Pm_Message(0xB0, 3, 9);
+    want[4].timestamp = 104;
+    if (expect(stream, "coalescing", want, 5)) return 1;
+
+    /* a due value waits for an earlier held value of its channel: cc 5
+     * passes at 200 and cc 4 at 205, cc 4 is held at 206 (due at 215)
+     * and cc 5 at 207 (due at 210) */
+    now = 200;
+    feed(stream, 0xB0, 5, 0);
+    now = 205;
+    feed(stream, 0xB0, 4, 0);
+    now = 206;
+    feed(stream, 0xB0, 4, 1);
+    now = 207;
+    feed(stream, 0xB0, 5, 1);
+    want[0].message = Pm_Message(0xB0, 5, 0);
+    want[0].timestamp = 200;
+    want[1].message = Pm_Message(0xB0, 4, 0);
+    want[1].timestamp = 205;
+    if (expect(stream, "coalescing", want, 2)) return 1;
+    now = 210;
+    if (!pm_input_done((PmInternal *) stream) ||
+        expect(stream, "coalescing", NULL, 0)) return 1;
+    now = 215;
+    if (pm_input_done((PmInternal *) stream)) return 1;
+    want[0].message = Pm_Message(0xB0, 4, 1);
+    want[0].timestamp = 206;
+    want[1].message = Pm_Message(0xB0, 5, 1);
+    want[1].timestamp = 207;
+    if (expect(stream, "coalescing", want, 2)) return 1;
+    Pm_Close(stream);
+    return 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+    (void) argv;
+    if (argc != 1) {
+        printf("Usage: inputtest\n");
+        return 1;
+    }
+    Pm_Initialize();
+    fake_dictionary = pm_none_dictionary;
+    fake_dictionary.open = fake_open;
+    fake_dictionary.close = pm_success_fn;
+    fake_dictionary.poll = pm_success_fn;
+    fake_id = pm_add_device("inputtest", "fake input", TRUE, FALSE, NULL,
+                            &fake_dictionary);
+    if (fake_id < 0) {
+        printf("Could not add fake input device\n");
+        return 1;
+    }
+    printf("test accept table\n");
+    if (test_accept_table()) return 1;
+    printf("test pm_read_bytes\n");
+    if (test_read_bytes()) return 1;
+    printf("test input callback\n");
+    if (test_callback()) return 1;
+    printf("test sysex records\n");
+    if (test_sysex_records()) return 1;
+    printf("test coalescing\n");
+    if (test_coalescing()) return 1;
+    Pm_Terminate();
+    printf("inputtest passed\n");
+    return 0;
+}
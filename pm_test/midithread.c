@@ -27,7 +27,8 @@
   thread to the main thread, and main_to_midi transfers messages from
   the main thread to the midi thread. Queues are safe for use between
   threads as long as ONE thread writes and ONE thread reads. You must 
-  NEVER allow two threads to write to the same queue.
+  NEVER allow two threads to write to the same queue, unless it was
+  created by Pm_QueueCreateEx() with the PM_QUEUE_MPSC flag.
 
   This program transposes incoming midi data by an amount controlled
   by the main program. To change the transposition, type an integer
@@ -174,7 +175,6 @@ int main(int argc, char *argv[])
     int32_t n;
     const PmDeviceInfo *info;
     char line[STRING_MAX];
-    int spin;
     int done = FALSE;
     int i;
     int input = -1, output = -1;
@@ -207,7 +207,10 @@ int main(int argc, char *argv[])
      * a given queue must have the same size. We'll just use int32_t's
      * for our messages in this simple example
      */
-    midi_to_main = Pm_QueueCreate(32, sizeof(int32_t));
+    /* the main thread sleeps in Pm_QueueWait() until midi_to_main
+     * has a message, rather than spinning */
+    midi_to_main = Pm_QueueCreateEx(32, sizeof(int32_t),
+                                    PM_QUEUE_LIGHT_PIPE | PM_QUEUE_WAITABLE);
     assert(midi_to_main != NULL);
     main_to_midi = Pm_QueueCreate(32, sizeof(int32_t));
     assert(main_to_midi != NULL);
@@ -287,17 +290,17 @@ int main(int argc, char *argv[])
             msg = QUIT_MSG;
             Pm_Enqueue(main_to_midi, &msg);
             /* wait for acknowlegement */
-            do {
-                spin = Pm_Dequeue(midi_to_main, &msg);
-            } while (spin == 0); /* spin */ ;
+            while (Pm_Dequeue(midi_to_main, &msg) == 0) {
+                Pm_QueueWait(midi_to_main, -1);
+            }
             done = TRUE; /* leave the command loop and wrap up */
         } else if (strcmp(line, "m") == 0) {
             msg = MONITOR_MSG;
             Pm_Enqueue(main_to_midi, &msg);
             printf("Waiting for note...\n");
-            do {
-                spin = Pm_Dequeue(midi_to_main, &msg);
-            } while (spin == 0); /* spin */ ;
+            while (Pm_Dequeue(midi_to_main, &msg) == 0) {
+                Pm_QueueWait(midi_to_main, -1);
+            }
             // convert int32_t to long for safe printing
             printf("... pitch is %ld\n", (long) msg);
         } else if (strcmp(line, "t") == 0) {
@@ -152,6 +152,7 @@ void process_midi(PtTimestamp timestamp, void *userData)
 {
     PmError result;
     PmEvent buffer; /* just one message at a time */
+    PmEvent *next; /* application message in out_queue */
 
     current_timestamp++; /* update every millisecond */
 
@@ -217,11 +218,10 @@ void process_midi(PtTimestamp timestamp, void *userData)
     }
 
 
-    /* see if there is application midi data to process */
-    while (!Pm_QueueEmpty(out_queue)) {
+    /* see if there is application midi data to process. The message
+       is examined and written where it sits in out_queue, then released */
+    while ((next = (PmEvent *) Pm_QueueReadPtr(out_queue))) {
         /* see if it is time to output the next message */
-        PmEvent *next = (PmEvent *) Pm_QueuePeek(out_queue);
-        assert(next); /* must be non-null because queue is not empty */
         if (next->timestamp <= current_timestamp) {
             /* time to send a message, first make sure it's not blocked */
             int status = Pm_MessageStatus(next->message);
@@ -233,8 +233,7 @@ void process_midi(PtTimestamp timestamp, void *userData)
                     thru_sysex_in_progress = FALSE;
                 } else break; /* output is blocked, so exit loop */
             }
-            Pm_Dequeue(out_queue, &buffer);
-            Pm_Write(midi_out, &buffer, 1);
+            Pm_Write(midi_out, next, 1);
 
             /* inspect message to update app_sysex_in_progress */
             if (status == MIDI_SYSEX) app_sysex_in_progress = TRUE;
@@ -243,12 +242,13 @@ void process_midi(PtTimestamp timestamp, void *userData)
                 app_sysex_in_progress = FALSE;
             }
             if (app_sysex_in_progress && /* look for EOX */
-                (((buffer.message & 0xFF) == MIDI_EOX) ||
-                 (((buffer.message >> 8) & 0xFF) == MIDI_EOX) ||
-                 (((buffer.message >> 16) & 0xFF) == MIDI_EOX) ||
-                 (((buffer.message >> 24) & 0xFF) == MIDI_EOX))) {
+                (((next->message & 0xFF) == MIDI_EOX) ||
+                 (((next->message >> 8) & 0xFF) == MIDI_EOX) ||
+                 (((next->message >> 16) & 0xFF) == MIDI_EOX) ||
+                 (((next->message >> 24) & 0xFF) == MIDI_EOX))) {
                 app_sysex_in_progress = FALSE;
             }
+            Pm_QueueRelease(out_queue);
         } else break; /* wait until indicated timestamp */
     }
 }
@@ -282,9 +282,11 @@ void initialize(int input, int output, int virtual)
     const PmDeviceInfo *info;
 
     /* make the message queues */
-    in_queue = Pm_QueueCreate(IN_QUEUE_SIZE, sizeof(PmEvent));
+    in_queue = Pm_QueueCreateEx(IN_QUEUE_SIZE, sizeof(PmEvent),
+                                PM_QUEUE_SPSC);
     assert(in_queue != NULL);
-    out_queue = Pm_QueueCreate(OUT_QUEUE_SIZE, sizeof(PmEvent));
+    out_queue = Pm_QueueCreateEx(OUT_QUEUE_SIZE, sizeof(PmEvent),
+                                 PM_QUEUE_SPSC);
     assert(out_queue != NULL);
 
     /* always start the timer before you start midi */
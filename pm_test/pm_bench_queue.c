@@ -0,0 +1,509 @@
+/* pm_bench_queue.c -- measure the PortMidi queues (see pmutil.h)
+
+   Usage: pm_bench_queue [-n messages] [-r round-trips]
+
+   Every queue variant is measured three ways:
+
+   1. throughput: a producer thread enqueues messages of 4 to 64 bytes
+      as fast as the consumer (the main thread) takes them, with both
+      threads on the same core and, if there are two cores, on
+      different cores. The consumer either copies each message
+      (Pm_Dequeue) or reads it in place (Pm_QueueReadPtr and
+      Pm_QueueRelease, the "peek" path).
+   2. round-trip latency: the main thread sends one message at a time
+      to an echo thread through one queue and waits for the reply on
+      another.
+   3. fill level: one thread enqueues and dequeues with the queue kept
+      empty, half full or 90% full.
+
+   Times come from the monotonic clock. Throughput and fill-level
+   results give the mean cost per message and percentiles of the mean
+   over blocks of BLOCK messages, since the clock is too coarse (and
+   too slow) to time every message. Latency results are percentiles of
+   individual round trips. Threads that wait for each other spin for a
+   while and then yield, so same-core results include context switches.
+
+   Thread placement uses pthread_setaffinity_np() on Linux and
+   SetThreadAffinityMask() on Windows. Elsewhere threads are not pinned
+   and "same core" and "cross core" only differ by chance.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE /* for pthread_setaffinity_np() */
+#endif
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "portmidi.h"
+#include "pmutil.h"
+#include "time.h"
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#endif
+
+#define CAPACITY 256 /* messages per queue */
+#define BLOCK 64 /* messages per throughput sample */
+#define SPINS 64 /* polls before a waiting thread yields */
+#define MAX_BYTES 64
+
+/* the variants compared; SHARED is not a queue flag, but selects
+ * Pm_QueueCreateShared() with the reader using Pm_QueueAttachShared() */
+#define SHARED 0x40000000
+
+typedef struct {
+    const char *name;
+    int32_t flags;
+} variant_type;
+
+variant_type variants[] = {
+    { "light pipe", PM_QUEUE_LIGHT_PIPE },
+    { "SPSC ring", PM_QUEUE_SPSC },
+    { "PmEvent", PM_QUEUE_EVENT },
+    { "MPSC", PM_QUEUE_MPSC },
+    { "record", PM_QUEUE_RECORD },
+    { "SPSC shared", PM_QUEUE_SPSC | SHARED },
+    { NULL, 0 }
+};
+
+int sizes[] = { 4, 8, 16, 32, 64, 0 };
+
+/* a queue with the handles its writer and reader use */
+typedef struct {
+    PmQueue *writer;
+    PmQueue *reader;
+    int32_t bytes;
+    int record;
+} bench_queue_type;
+
+/* what a second thread does */
+typedef struct {
+    bench_queue_type *in; /* echo each message read from in to out */
+    bench_queue_type *out;
+    long n;
+    int cpu;
+} bench_thread_type;
+
+long n_msgs = 200000;
+long n_trips = 20000;
+int n_cpus = 1;
+int pinned = FALSE;
+
+
+/* bench_now -- the monotonic clock in ns */
+double bench_now(void)
+{
+#ifdef WIN32
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER t;
+    if (!freq.QuadPart) QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&t);
+    return (double) t.QuadPart * 1e9 / (double) freq.QuadPart;
+#else
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e9 + t.tv_nsec;
+#endif
+}
+
+
+/* bench_pin -- run the calling thread on cpu only. Returns FALSE if
+ * threads cannot be pinned on this system. */
+int bench_pin(int cpu)
+{
+#if defined(WIN32)
+    return SetThreadAffinityMask(GetCurrentThread(),
+                                 (DWORD_PTR) 1 << cpu) != 0;
+#elif defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    return FALSE;
+#endif
+}
+
+
+/* bench_backoff -- called each time a thread finds nothing to do */
+void bench_backoff(int *spins)
+{
+    if (++*spins < SPINS) return;
+    *spins = 0;
+#ifdef WIN32
+    SwitchToThread();
+#else
+    sched_yield();
+#endif
+}
+
+
+int bench_create(bench_queue_type *q, variant_type *v, int32_t bytes)
+{
+    char name[32];
+    q->bytes = bytes;
+    q->record = (v->flags & PM_QUEUE_RECORD) != 0;
+    if (v->flags & SHARED) {
+        static int count = 0;
+        sprintf(name, "pm_bench_%ld_%d", (long) time(NULL), count++);
+        q->writer = Pm_QueueCreateShared(name, CAPACITY, bytes,
+                                         v->flags & ~SHARED);
+        q->reader = (q->writer ? Pm_QueueAttachShared(name) : NULL);
+    } else {
+        q->writer = q->reader = Pm_QueueCreateEx(CAPACITY, bytes, v->flags);
+    }
+    return q->reader != NULL;
+}
+
+
+void bench_destroy(bench_queue_type *q)
+{
+    if (q->reader != q->writer) Pm_QueueDestroy(q->reader);
+    Pm_QueueDestroy(q->writer);
+}
+
+
+/* bench_put -- enqueue msg, waiting for room if the queue is full */
+void bench_put(bench_queue_type *q, int32_t *msg)
+{
+    int spins = 0;
+    while (Pm_QueueFull(q->writer)) bench_backoff(&spins);
+    if (q->record) {
+        Pm_EnqueueRecord(q->writer, msg, q->bytes, 0);
+    } else {
+        Pm_Enqueue(q->writer, msg);
+    }
+}
+
+
+/* bench_get -- dequeue the first word of a message into msg if there
+ * is one, by copying the message or, if peek, reading it in place */
+int bench_get(bench_queue_type *q, int32_t *msg, int peek)
+{
+    int32_t len = MAX_BYTES;
+    if (peek) {
+        int32_t *ptr = (int32_t *) (q->record ?
+                Pm_QueuePeekRecord(q->reader, NULL, NULL) :
+                Pm_QueueReadPtr(q->reader));
+        if (!ptr) return FALSE;
+        msg[0] = ptr[0];
+        return Pm_QueueRelease(q->reader) == pmGotData;
+    } else if (q->record) {
+        return Pm_DequeueRecord(q->reader, msg, &len, NULL) == pmGotData;
+    }
+    return Pm_Dequeue(q->reader, msg) == pmGotData;
+}
+
+
+/* bench_wait_get -- bench_get, waiting for a message */
+void bench_wait_get(bench_queue_type *q, int32_t *msg, int peek)
+{
+    int spins = 0;
+    while (!bench_get(q, msg, peek)) bench_backoff(&spins);
+}
+
+
+void bench_thread_body(bench_thread_type *t)
+{
+    int32_t msg[MAX_BYTES / sizeof(int32_t)];
+    long i;
+    if (pinned) bench_pin(t->cpu);
+    memset(msg, 0, sizeof(msg));
+    for (i = 0; i < t->n; i++) {
+        if (t->in) {
+            bench_wait_get(t->in, msg, FALSE);
+        } else {
+            msg[0] = (int32_t) i;
+        }
+        bench_put(t->out, msg);
+    }
+}
+
+
+#ifdef WIN32
+typedef HANDLE thread_type;
+
+DWORD WINAPI bench_thread_main(LPVOID arg)
+{
+    bench_thread_body((bench_thread_type *) arg);
+    return 0;
+}
+
+int bench_start(thread_type *thread, bench_thread_type *t)
+{
+    *thread = CreateThread(NULL, 0, bench_thread_main, t, 0, NULL);
+    return *thread != NULL;
+}
+
+void bench_join(thread_type thread)
+{
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+}
+#else
+typedef pthread_t thread_type;
+
+void *bench_thread_main(void *arg)
+{
+    bench_thread_body((bench_thread_type *) arg);
+    return NULL;
+}
+
+int bench_start(thread_type *thread, bench_thread_type *t)
+{
+    return pthread_create(thread, NULL, bench_thread_main, t) == 0;
+}
+
+void bench_join(thread_type thread)
+{
+    pthread_join(thread, NULL);
+}
+#endif
+
+
+int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+
+/* percentile -- the p-th percentile (0 to 1) of sorted samples */
+double percentile(double *samples, long n, double p)
+{
+    return samples[(long) (p * (n - 1) + 0.5)];
+}
+
+
+/* bench_throughput -- time n_msgs messages through a queue from a
+ * producer thread on cpu to the main thread (on cpu 0) */
+int bench_throughput(variant_type *v, int32_t bytes, int cpu, int peek)
+{
+    bench_queue_type q;
+    bench_thread_type producer;
+    thread_type thread;
+    int32_t msg[MAX_BYTES / sizeof(int32_t)];
+    long n_samples = n_msgs / BLOCK;
+    double *samples = (double *) malloc(n_samples * sizeof(double));
+    double start, block_start, now;
+    long i;
+
+    if (!samples || !bench_create(&q, v, bytes)) {
+        printf("Could not create %s queue\n", v->name);
+        return 1;
+    }
+    producer.in = NULL;
+    producer.out = &q;
+    producer.n = n_samples * BLOCK;
+    producer.cpu = cpu;
+    if (!bench_start(&thread, &producer)) {
+        printf("Could not start producer thread\n");
+        return 1;
+    }
+    start = block_start = bench_now();
+    for (i = 0; i < producer.n; i++) {
+        bench_wait_get(&q, msg, peek);
+        if (msg[0] != (int32_t) i) {
+            printf("%s: received message %ld out of order\n", v->name, i);
+            return 1;
+        }
+        if ((i + 1) % BLOCK == 0) {
+            now = bench_now();
+            samples[i / BLOCK] = (now - block_start) / BLOCK;
+            block_start = now;
+        }
+    }
+    now = bench_now();
+    bench_join(thread);
+    bench_destroy(&q);
+    qsort(samples, n_samples, sizeof(double), compare_doubles);
+    printf("%-12s %5d  %-5s %-7s %8.1f %8.1f %8.1f %8.2f\n", v->name,
+           (int) bytes, (cpu ? "cross" : "same"), (peek ? "peek" : "dequeue"),
+           (now - start) / producer.n, percentile(samples, n_samples, 0.5),
+           percentile(samples, n_samples, 0.99),
+           producer.n * 1e3 / (now - start));
+    free(samples);
+    return 0;
+}
+
+
+/* bench_latency -- time n_trips round trips of one message between the
+ * main thread and an echo thread on cpu */
+int bench_latency(variant_type *v, int32_t bytes, int cpu)
+{
+    bench_queue_type ping, pong;
+    bench_thread_type echo;
+    thread_type thread;
+    int32_t msg[MAX_BYTES / sizeof(int32_t)];
+    double *samples = (double *) malloc(n_trips * sizeof(double));
+    double start;
+    long i;
+
+    if (!samples || !bench_create(&ping, v, bytes) ||
+        !bench_create(&pong, v, bytes)) {
+        printf("Could not create %s queues\n", v->name);
+        return 1;
+    }
+    echo.in = &ping;
+    echo.out = &pong;
+    echo.n = n_trips;
+    echo.cpu = cpu;
+    if (!bench_start(&thread, &echo)) {
+        printf("Could not start echo thread\n");
+        return 1;
+    }
+    memset(msg, 0, sizeof(msg));
+    for (i = 0; i < n_trips; i++) {
+        msg[0] = (int32_t) i;
+        start = bench_now();
+        bench_put(&ping, msg);
+        bench_wait_get(&pong, msg, FALSE);
+        samples[i] = bench_now() - start;
+        if (msg[0] != (int32_t) i) {
+            printf("%s: received reply %ld out of order\n", v->name, i);
+            return 1;
+        }
+    }
+    bench_join(thread);
+    bench_destroy(&ping);
+    bench_destroy(&pong);
+    qsort(samples, n_trips, sizeof(double), compare_doubles);
+    printf("%-12s %5d  %-5s %8.0f %8.0f %8.0f %8.0f %8.0f\n", v->name,
+           (int) bytes, (cpu ? "cross" : "same"),
+           percentile(samples, n_trips, 0.5),
+           percentile(samples, n_trips, 0.9),
+           percentile(samples, n_trips, 0.99),
+           percentile(samples, n_trips, 0.999), samples[n_trips - 1]);
+    free(samples);
+    return 0;
+}
+
+
+/* bench_fill -- time an enqueue and a dequeue per message in one thread
+ * with fill messages kept in the queue */
+int bench_fill(variant_type *v, int32_t bytes, long fill, int peek)
+{
+    bench_queue_type q;
+    int32_t msg[MAX_BYTES / sizeof(int32_t)];
+    long n_samples = n_msgs / BLOCK;
+    double *samples = (double *) malloc(n_samples * sizeof(double));
+    double start, block_start, now;
+    long i;
+
+    if (!samples || !bench_create(&q, v, bytes)) {
+        printf("Could not create %s queue\n", v->name);
+        return 1;
+    }
+    memset(msg, 0, sizeof(msg));
+    for (i = 0; i < fill; i++) {
+        bench_put(&q, msg);
+    }
+    start = block_start = bench_now();
+    for (i = 0; i < n_samples * BLOCK; i++) {
+        bench_put(&q, msg);
+        if (!bench_get(&q, msg, peek)) {
+            printf("%s: queue is unexpectedly empty\n", v->name);
+            return 1;
+        }
+        if ((i + 1) % BLOCK == 0) {
+            now = bench_now();
+            samples[i / BLOCK] = (now - block_start) / BLOCK;
+            block_start = now;
+        }
+    }
+    now = bench_now();
+    bench_destroy(&q);
+    qsort(samples, n_samples, sizeof(double), compare_doubles);
+    printf("%-12s %5d  %3ld%%  %-7s %8.1f %8.1f %8.1f\n", v->name,
+           (int) bytes, fill * 100 / CAPACITY, (peek ? "peek" : "dequeue"),
+           (now - start) / (n_samples * BLOCK),
+           percentile(samples, n_samples, 0.5),
+           percentile(samples, n_samples, 0.99));
+    free(samples);
+    return 0;
+}
+
+
+/* supported -- whether variant v takes messages of the given size */
+int supported(variant_type *v, int32_t bytes)
+{
+    return !(v->flags & PM_QUEUE_EVENT) || bytes == sizeof(PmEvent);
+}
+
+
+int main(int argc, char *argv[])
+{
+    variant_type *v;
+    int i;
+    int cpu;
+    int peek;
+    long fills[] = { 0, CAPACITY / 2, CAPACITY * 9 / 10, -1 };
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            n_msgs = atol(argv[++i]);
+        } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            n_trips = atol(argv[++i]);
+        } else {
+            printf("Usage: pm_bench_queue [-n messages] [-r round-trips]\n");
+            return 1;
+        }
+    }
+    if (n_msgs < BLOCK || n_trips < 1) {
+        printf("need at least %d messages and 1 round trip\n", BLOCK);
+        return 1;
+    }
+#ifdef WIN32
+    {
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        n_cpus = (int) info.dwNumberOfProcessors;
+    }
+#else
+    n_cpus = (int) sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    pinned = bench_pin(0);
+    printf("%d cpu(s), threads %s\n", n_cpus,
+           (pinned ? "pinned" : "not pinned"));
+
+    printf("\nthroughput, %ld messages (ns/msg: mean, and p50 and p99 of "
+           "blocks of %d)\n", n_msgs, BLOCK);
+    printf("%-12s %5s  %-5s %-7s %8s %8s %8s %8s\n", "queue", "bytes",
+           "cores", "read", "mean", "p50", "p99", "Mmsg/s");
+    for (v = variants; v->name; v++) {
+        for (i = 0; sizes[i]; i++) {
+            if (!supported(v, sizes[i])) continue;
+            for (cpu = 0; cpu < 2 && cpu < n_cpus; cpu++) {
+                for (peek = FALSE; peek <= TRUE; peek++) {
+                    if (bench_throughput(v, sizes[i], cpu, peek)) return 1;
+                }
+            }
+        }
+    }
+
+    printf("\nround-trip latency, %ld trips (ns)\n", n_trips);
+    printf("%-12s %5s  %-5s %8s %8s %8s %8s %8s\n", "queue", "bytes",
+           "cores", "p50", "p90", "p99", "p99.9", "max");
+    for (v = variants; v->name; v++) {
+        for (cpu = 0; cpu < 2 && cpu < n_cpus; cpu++) {
+            if (bench_latency(v, sizeof(PmEvent), cpu)) return 1;
+        }
+    }
+
+    printf("\nfill level, one thread, %ld messages (ns per enqueue and "
+           "dequeue: mean, and p50 and p99 of blocks of %d)\n", n_msgs, BLOCK);
+    printf("%-12s %5s  %4s  %-7s %8s %8s %8s\n", "queue", "bytes", "fill",
+           "read", "mean", "p50", "p99");
+    for (v = variants; v->name; v++) {
+        for (i = 0; fills[i] >= 0; i++) {
+            for (peek = FALSE; peek <= TRUE; peek++) {
+                if (bench_fill(v, sizeof(PmEvent), fills[i], peek)) return 1;
+            }
+        }
+    }
+    return 0;
+}
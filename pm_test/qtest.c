@@ -1,7 +1,20 @@
+#ifdef __linux__
+#define _GNU_SOURCE /* for pthread_setaffinity_np() */
+#endif
 #include "portmidi.h"
 #include "pmutil.h"
+#include "porttime.h"
 #include "stdlib.h"
 #include "stdio.h"
+#include "string.h"
+#include "time.h"
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#endif
 
 
 /* make_msg -- make a psuedo-random message of length n whose content
@@ -44,14 +57,17 @@ int cmp_msg(long msg[], long msg2[], int n, int i)
 }
 
 
-int main(int argc, char *argv[])
+/* test_queue -- run all tests on queues created with the given flags */
+/**/
+int test_queue(int32_t flags)
 {
     int msg_len;
     for (msg_len = 4; msg_len < 100; msg_len += 5) {
-        PmQueue *queue = Pm_QueueCreate(100, msg_len * sizeof(long));
+        PmQueue *queue = Pm_QueueCreateEx(100, msg_len * sizeof(long), flags);
         int i;
         long msg[100];
         long msg2[100];
+        PmQueueStats stats;
 
 	printf("msg_len = %d\n", msg_len);
         if (!queue) {
@@ -143,6 +159,14 @@ int main(int argc, char *argv[])
             printf("Pm_Dequeue overflow expected\n");
 	    return 1;
         }
+        /* the statistics should show the full queue and the drop */
+        if (Pm_QueueGetStats(queue, &stats) != pmNoError ||
+            stats.depth != 0 || stats.capacity != 100 ||
+            stats.high_water != 100 || stats.dropped != 1 ||
+            stats.enqueued != stats.dequeued) {
+            printf("Pm_QueueGetStats gave unexpected statistics\n");
+            return 1;
+        }
     
 	/* after overflow is detected (and cleared), sender can
 	 * send again
@@ -168,7 +192,921 @@ int main(int argc, char *argv[])
 	        return 1;
             }
         }
+        /* test batches, including overflow in the middle of a batch */
+        printf("test 5\n");
+        for (i = 0; i < 100; i += 7) {
+            long batch[7 * 100];
+            int j, n;
+            for (j = 0; j < 7; j++) {
+                make_msg(batch + j * msg_len, msg_len, i + j);
+            }
+            n = Pm_EnqueueBatch(queue, batch, 7);
+            if (n != (i + 7 <= 100 ? 7 : 100 - i)) {
+                printf("Pm_EnqueueBatch error\n");
+                return 1;
+            }
+        }
+        for (i = 0; i < 100; ) {
+            long batch[9 * 100];
+            int j;
+            int n = Pm_DequeueBatch(queue, batch, 9);
+            if (n <= 0) {
+                printf("Pm_DequeueBatch error\n");
+                return 1;
+            }
+            for (j = 0; j < n; j++, i++) {
+                make_msg(msg, msg_len, i);
+                if (!cmp_msg(msg, batch + j * msg_len, msg_len, i)) {
+                    return 1;
+                }
+            }
+        }
+        if (i != 100 || Pm_DequeueBatch(queue, msg2, 9) != pmBufferOverflow ||
+            Pm_DequeueBatch(queue, msg2, 9) != 0) {
+            printf("Pm_DequeueBatch overflow expected\n");
+            return 1;
+        }
+        /* test reserve/commit and read pointer/release, including
+         * overflow when a reservation fails */
+        printf("test 6\n");
+        if (flags & PM_QUEUE_MPSC) { /* reservations are not supported */
+            if (Pm_QueueReserve(queue) || Pm_QueueCommit(queue) != pmBadPtr) {
+                printf("Pm_QueueReserve should fail\n");
+                return 1;
+            }
+            Pm_QueueDestroy(queue);
+            continue;
+        }
+        for (i = 0; i < 110; i++) {
+            long *slot = (long *) Pm_QueueReserve(queue);
+            if (!slot) {
+                break; /* this is supposed to execute after 100 messages */
+            }
+            make_msg(slot, msg_len, i);
+            if (Pm_QueueCommit(queue) != pmNoError) {
+                printf("Pm_QueueCommit error\n");
+                return 1;
+            }
+        }
+        if (i != 100 || Pm_QueueCommit(queue) != pmBadPtr) {
+            printf("Pm_QueueReserve overflow expected\n");
+            return 1;
+        }
+        for (i = 0; i < 100; i++) {
+            long *ptr = (long *) Pm_QueueReadPtr(queue);
+            make_msg(msg, msg_len, i);
+            if (!ptr || !cmp_msg(msg, ptr, msg_len, i)) {
+                printf("Pm_QueueReadPtr error\n");
+                return 1;
+            }
+            if (Pm_QueueRelease(queue) != pmGotData) {
+                printf("Pm_QueueRelease error\n");
+                return 1;
+            }
+        }
+        if (Pm_QueueReadPtr(queue) != NULL ||
+            Pm_QueueRelease(queue) != pmBufferOverflow ||
+            Pm_QueueRelease(queue) != pmNoData) {
+            printf("Pm_QueueRelease overflow expected\n");
+            return 1;
+        }
         Pm_QueueDestroy(queue);
     }
     return 0;
 }
+
+
+/* make_event -- make a psuedo-random event whose content is purely a
+ *    function of i (event 0 is all zeros)
+ */
+void make_event(PmEvent *ev, int i)
+{
+    ev->message = i * 0x010101;
+    ev->timestamp = i * 7;
+}
+
+
+/* test_event_queue -- test the PmEvent queue, which holds at least
+ *    100 messages (128, since it is rounded up to a power of two)
+ */
+int test_event_queue(void)
+{
+    PmQueue *queue = Pm_QueueCreateEx(100, sizeof(PmEvent), PM_QUEUE_EVENT);
+    PmEvent ev, ev2;
+    PmEvent batch[9];
+    int i;
+
+    if (!queue) {
+        printf("Could not allocate queue\n");
+        return 1;
+    }
+    if (Pm_QueueCreateEx(100, sizeof(long) * 3, PM_QUEUE_EVENT)) {
+        printf("Pm_QueueCreateEx accepted a message that is not a PmEvent\n");
+        return 1;
+    }
+    /* insert/remove, including zero events, with peek */
+    printf("test 1\n");
+    for (i = 0; i < 1357; i++) {
+        PmEvent *peek;
+        make_event(&ev, i % 3 ? i : 0);
+        if (Pm_Enqueue(queue, &ev)) {
+            printf("Pm_Enqueue error\n");
+            return 1;
+        }
+        peek = (PmEvent *) Pm_QueuePeek(queue);
+        if (!peek || peek->message != ev.message ||
+            Pm_Dequeue(queue, &ev2) != 1 || ev2.message != ev.message ||
+            ev2.timestamp != ev.timestamp) {
+            printf("Received event %d doesn't match sent event\n", i);
+            return 1;
+        }
+    }
+    /* test overflow with the whole power-of-two capacity, and batches */
+    printf("test 2\n");
+    for (i = 0; i < 140; i++) {
+        make_event(&ev, i);
+        if (Pm_Enqueue(queue, &ev) == pmBufferOverflow) {
+            break; /* this is supposed to execute after 128 messages */
+        }
+    }
+    if (i != 128 || !Pm_QueueFull(queue)) {
+        printf("Pm_Enqueue overflow expected after 128 messages\n");
+        return 1;
+    }
+    for (i = 0; i < 128; ) {
+        int j;
+        int n = Pm_DequeueBatch(queue, batch, 9);
+        if (n <= 0) {
+            printf("Pm_DequeueBatch error\n");
+            return 1;
+        }
+        for (j = 0; j < n; j++, i++) {
+            make_event(&ev, i);
+            if (batch[j].message != ev.message) {
+                printf("Received event %d doesn't match sent event\n", i);
+                return 1;
+            }
+        }
+    }
+    if (i != 128 || Pm_Dequeue(queue, &ev2) != pmBufferOverflow ||
+        Pm_Dequeue(queue, &ev2) != 0) {
+        printf("Pm_Dequeue overflow expected\n");
+        return 1;
+    }
+    /* reserve/commit and read pointer/release */
+    printf("test 3\n");
+    for (i = 0; i < 1000; i++) {
+        PmEvent *slot = (PmEvent *) Pm_QueueReserve(queue);
+        PmEvent *ptr;
+        if (!slot) {
+            printf("Pm_QueueReserve error\n");
+            return 1;
+        }
+        make_event(slot, i);
+        Pm_QueueCommit(queue);
+        ptr = (PmEvent *) Pm_QueueReadPtr(queue);
+        make_event(&ev, i);
+        if (!ptr || ptr->message != ev.message ||
+            Pm_QueueRelease(queue) != pmGotData) {
+            printf("Pm_QueueReadPtr error\n");
+            return 1;
+        }
+    }
+    /* column-wise batches, which wrap around the end of the buffer
+       since test 3 left the queue part way through it */
+    printf("test 4\n");
+    for (i = 0; i < 100; i++) {
+        make_event(&ev, i);
+        Pm_Enqueue(queue, &ev);
+    }
+    for (i = 0; i < 100; ) {
+        PmMessage messages[9];
+        PmTimestamp timestamps[9];
+        int j;
+        int n = Pm_DequeueBatchSoA(queue, messages, timestamps, 9);
+        if (n <= 0) {
+            printf("Pm_DequeueBatchSoA error\n");
+            return 1;
+        }
+        for (j = 0; j < n; j++, i++) {
+            make_event(&ev, i);
+            if (messages[j] != ev.message || timestamps[j] != ev.timestamp) {
+                printf("Received event %d doesn't match sent event\n", i);
+                return 1;
+            }
+        }
+    }
+    for (i = 0; i < 140; i++) {
+        make_event(&ev, i);
+        Pm_Enqueue(queue, &ev);
+    }
+    {
+        PmMessage messages[128];
+        PmTimestamp timestamps[128];
+        if (Pm_DequeueBatchSoA(queue, messages, timestamps, 128) != 128 ||
+            timestamps[127] != 127 * 7 ||
+            Pm_DequeueBatchSoA(queue, messages, timestamps, 128) !=
+                pmBufferOverflow ||
+            Pm_DequeueBatchSoA(queue, messages, NULL, 128) != pmBadPtr) {
+            printf("Pm_DequeueBatchSoA overflow expected\n");
+            return 1;
+        }
+    }
+    if (!Pm_QueueEmpty(queue)) {
+        printf("Queue should be empty\n");
+        return 1;
+    }
+    Pm_QueueDestroy(queue);
+    return 0;
+}
+
+
+/* make_record -- fill a record of pseudo-random length (up to 1000
+ *    bytes, sometimes 0) whose length and content are purely a
+ *    function of i, and return the length
+ */
+int32_t make_record(unsigned char *data, int i)
+{
+    int32_t len = (i * 37) % 1001;
+    int32_t j;
+    for (j = 0; j < len; j++) {
+        data[j] = (unsigned char) (i + j);
+    }
+    return len;
+}
+
+
+/* cmp_record -- compare a received record with record i */
+int cmp_record(unsigned char *data, int32_t len, PmTimestamp ts, int i)
+{
+    unsigned char expect[1000];
+    if (len != make_record(expect, i) || ts != i * 7 ||
+        memcmp(data, expect, len) != 0) {
+        printf("Received record %d doesn't match sent record\n", i);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+
+/* test_record_queue -- test the variable-length record queue, which
+ *    holds at least 10 records of up to 1000 bytes
+ */
+int test_record_queue(void)
+{
+    PmQueue *queue = Pm_QueueCreateEx(10, 1000, PM_QUEUE_RECORD);
+    unsigned char data[1000];
+    unsigned char data2[1000];
+    int32_t len;
+    PmTimestamp ts;
+    PmQueueStats stats;
+    int i, j;
+
+    if (!queue) {
+        printf("Could not allocate queue\n");
+        return 1;
+    }
+    if (Pm_Enqueue(queue, data) != pmBadPtr ||
+        Pm_EnqueueRecord(queue, data, 1001, 0) != pmBadPtr) {
+        printf("Pm_Enqueue should not accept a fixed-size or long message\n");
+        return 1;
+    }
+    /* insert/remove records of varying size, wrapping many times */
+    printf("test 1\n");
+    for (i = 0; i < 1357; i++) {
+        for (j = i; j < i + 3; j++) {
+            len = make_record(data, j);
+            if (Pm_EnqueueRecord(queue, data, len, j * 7) != pmNoError) {
+                printf("Pm_EnqueueRecord error\n");
+                return 1;
+            }
+        }
+        for (j = i; j < i + 3; j++) {
+            len = sizeof(data2);
+            if (Pm_DequeueRecord(queue, data2, &len, &ts) != pmGotData) {
+                printf("Pm_DequeueRecord error\n");
+                return 1;
+            }
+            if (!cmp_record(data2, len, ts, j)) return 1;
+        }
+    }
+    /* overflow, and a buffer that is too small */
+    printf("test 2\n");
+    for (i = 0; i < 1000; i++) {
+        if (Pm_EnqueueRecord(queue, data, 1000, i * 7) == pmBufferOverflow) {
+            break; /* this is supposed to execute after at least 10 */
+        }
+    }
+    if (i < 10 || !Pm_QueueFull(queue)) {
+        printf("Pm_EnqueueRecord overflow expected after 10 or more\n");
+        return 1;
+    }
+    len = 999;
+    if (Pm_DequeueRecord(queue, data2, &len, &ts) != pmBufferTooSmall ||
+        len != 1000) {
+        printf("Pm_DequeueRecord should report the size needed\n");
+        return 1;
+    }
+    for (j = 0; j < i; j++) {
+        len = sizeof(data2);
+        if (Pm_DequeueRecord(queue, data2, &len, &ts) != pmGotData ||
+            len != 1000 || ts != j * 7) {
+            printf("Pm_DequeueRecord error\n");
+            return 1;
+        }
+    }
+    if (Pm_DequeueRecord(queue, data2, &len, &ts) != pmBufferOverflow ||
+        Pm_DequeueRecord(queue, data2, &len, &ts) != pmNoData) {
+        printf("Pm_DequeueRecord overflow expected\n");
+        return 1;
+    }
+    /* reserve/commit (committing less than reserved) and peek/release */
+    printf("test 3\n");
+    for (i = 0; i < 1000; i++) {
+        unsigned char *payload = (unsigned char *)
+                                 Pm_QueueReserveRecord(queue, 1000);
+        if (!payload) {
+            printf("Pm_QueueReserveRecord error\n");
+            return 1;
+        }
+        len = make_record(payload, i);
+        Pm_QueueCommitRecord(queue, len, i * 7);
+        payload = (unsigned char *) Pm_QueuePeekRecord(queue, &len, &ts);
+        if (!payload || !cmp_record(payload, len, ts, i) ||
+            Pm_QueueRelease(queue) != pmGotData) {
+            printf("Pm_QueuePeekRecord error\n");
+            return 1;
+        }
+    }
+    if (!Pm_QueueEmpty(queue) || Pm_QueueGetStats(queue, &stats) ||
+        stats.depth != 0 || stats.capacity != 10 || stats.dropped != 1 ||
+        stats.enqueued != 3 * 1357 + 1000 + (uint64_t) j) {
+        printf("Queue should be empty\n");
+        return 1;
+    }
+    Pm_QueueDestroy(queue);
+    return 0;
+}
+
+
+/* test_shared -- create a shared queue, attach to it (from the same
+ *    process, but at a different address) and pass messages from one
+ *    mapping to the other
+ */
+int test_shared(int32_t flags)
+{
+    char name[32];
+    PmQueue *queue;
+    PmQueue *other;
+    PmQueueStats stats;
+    long msg[10];
+    long msg2[10];
+    int i;
+
+    sprintf(name, "pm_qtest_%ld", (long) time(NULL));
+    queue = Pm_QueueCreateShared(name, 100, sizeof(msg), flags);
+    other = Pm_QueueAttachShared(name);
+    if (!queue || !other || other == queue) {
+        printf("Could not create and attach shared queue\n");
+        return 1;
+    }
+    if (Pm_QueueCreateShared(name, 100, sizeof(msg), flags)) {
+        printf("Pm_QueueCreateShared should fail when name is in use\n");
+        return 1;
+    }
+    printf("test 1\n");
+    for (i = 0; i < 1357; i++) {
+        make_msg(msg, 10, i);
+        if (Pm_Enqueue(queue, msg)) {
+            printf("Pm_Enqueue error\n");
+            return 1;
+        }
+        if (Pm_Dequeue(other, msg2) != 1) {
+            printf("Pm_Dequeue error\n");
+            return 1;
+        }
+        if (!cmp_msg(msg, msg2, 10, i)) {
+            return 1;
+        }
+    }
+    printf("test 2\n");
+    for (i = 0; i < 110; i++) {
+        make_msg(msg, 10, i);
+        if (Pm_Enqueue(queue, msg) == pmBufferOverflow) {
+            break; /* this is supposed to execute after 100 messages */
+        }
+    }
+    for (i = 0; i < 100; i++) {
+        make_msg(msg, 10, i);
+        if (Pm_Dequeue(other, msg2) != 1 || !cmp_msg(msg, msg2, 10, i)) {
+            printf("Pm_Dequeue error\n");
+            return 1;
+        }
+    }
+    if (Pm_Dequeue(other, msg2) != pmBufferOverflow) {
+        printf("Pm_Dequeue overflow expected\n");
+        return 1;
+    }
+    if (Pm_QueueGetStats(other, &stats) != pmNoError ||
+        stats.depth != 0 || stats.capacity != 100 ||
+        stats.high_water != 100 || stats.dropped != 1 ||
+        stats.enqueued != 1457) {
+        printf("Pm_QueueGetStats gave unexpected statistics\n");
+        return 1;
+    }
+    Pm_QueueDestroy(other);
+    Pm_QueueDestroy(queue);
+    if ((other = Pm_QueueAttachShared(name))) {
+        printf("Shared queue name should be removed\n");
+        return 1;
+    }
+    return 0;
+}
+
+
+/* test_in_place -- create queues in caller-provided memory */
+int test_in_place(void)
+{
+    PmQueue *queue;
+    PmQueueStats stats;
+    PmEvent ev, ev2;
+    char *mem;
+    long size = Pm_QueueMemorySize(100, sizeof(PmEvent), PM_QUEUE_EVENT);
+    int i;
+
+    if (size <= 100 * (long) sizeof(PmEvent) ||
+        Pm_QueueMemorySize(100, sizeof(long), PM_QUEUE_LIGHT_PIPE) != 0) {
+        printf("Pm_QueueMemorySize gave an unexpected size\n");
+        return 1;
+    }
+    mem = (char *) malloc(size + 1);
+    /* mem + 1 is misaligned, which the queue must allow for */
+    if (Pm_QueueCreateInPlace(mem + 1, size - 64, 100, sizeof(PmEvent),
+                              PM_QUEUE_EVENT) ||
+        Pm_QueueCreateInPlace(mem + 1, size, 100, sizeof(long),
+                              PM_QUEUE_LIGHT_PIPE)) {
+        printf("Pm_QueueCreateInPlace accepted an unsupported queue\n");
+        return 1;
+    }
+    queue = Pm_QueueCreateInPlace(mem + 1, size, 100, sizeof(PmEvent),
+                                  PM_QUEUE_EVENT | PM_QUEUE_LOCKED |
+                                  PM_QUEUE_WAITABLE | PM_OVERFLOW_DROP_NEWEST);
+    if (!queue) {
+        printf("Pm_QueueCreateInPlace failed\n");
+        return 1;
+    }
+    printf("test 1\n");
+    for (i = 0; i < 300; i++) {
+        ev.message = i;
+        ev.timestamp = -i;
+        Pm_Enqueue(queue, &ev);
+    }
+    for (i = 0; i < 128; i++) {
+        if (Pm_Dequeue(queue, &ev2) != 1 || ev2.message != (PmMessage) i ||
+            ev2.timestamp != -i) {
+            printf("Pm_Dequeue error\n");
+            return 1;
+        }
+    }
+    if (Pm_QueueGetStats(queue, &stats) != pmNoError ||
+        stats.capacity != 128 || stats.enqueued != 128 ||
+        stats.dropped != 172 || !Pm_QueueEmpty(queue)) {
+        printf("Pm_QueueGetStats gave unexpected statistics\n");
+        return 1;
+    }
+    Pm_QueueDestroy(queue);
+    free(mem);
+    return 0;
+}
+
+
+/* test_overflow_policies -- test the overflow policies other than the
+ *    default, which test_queue() and test_event_queue() cover
+ */
+int test_overflow_policies(void)
+{
+    PmQueue *queue;
+    PmQueueStats stats;
+    PmEvent ev, ev2;
+    PmEvent batch[150];
+    long msg[4];
+    long msgs[60 * 4];
+    int i;
+
+    if (Pm_QueueCreateEx(100, sizeof(PmEvent),
+                         PM_QUEUE_MPSC | PM_OVERFLOW_DROP_OLDEST) ||
+        Pm_QueueCreateEx(100, sizeof(PmEvent),
+                         PM_QUEUE_SPSC | PM_OVERFLOW_DROP_OLDEST)) {
+        printf("PM_OVERFLOW_DROP_OLDEST should need a PmEvent queue\n");
+        return 1;
+    }
+    /* drop oldest: the newest 128 messages are kept */
+    printf("test 1\n");
+    queue = Pm_QueueCreateEx(100, sizeof(PmEvent),
+                             PM_QUEUE_EVENT | PM_OVERFLOW_DROP_OLDEST);
+    for (i = 0; i < 200; i++) {
+        make_event(&ev, i);
+        if (Pm_Enqueue(queue, &ev) != pmNoError) {
+            printf("Pm_Enqueue should not overflow\n");
+            return 1;
+        }
+    }
+    for (i = 72; i < 200; i++) {
+        make_event(&ev, i);
+        if (Pm_Dequeue(queue, &ev2) != 1 || ev2.message != ev.message) {
+            printf("Pm_Dequeue should get message %d\n", i);
+            return 1;
+        }
+    }
+    if (Pm_Dequeue(queue, &ev2) != pmNoData ||
+        Pm_QueueGetStats(queue, &stats) || stats.dropped != 72 ||
+        stats.dequeued != 128 || stats.depth != 0) {
+        printf("Pm_Dequeue should find the queue empty\n");
+        return 1;
+    }
+    /* a batch larger than the queue keeps its last 128 messages, and
+     * messages cannot be peeked, since they might be evicted */
+    for (i = 0; i < 150; i++) make_event(&batch[i], i);
+    if (Pm_EnqueueBatch(queue, batch, 150) != 128 ||
+        Pm_QueueReadPtr(queue) ||
+        Pm_Enqueue(queue, &ev) != pmNoError ||
+        Pm_QueueRelease(queue) != pmNoData ||
+        Pm_DequeueBatch(queue, batch, 150) != 128 ||
+        batch[0].message != (23 * 0x010101) ||
+        batch[127].message != ev.message) {
+        printf("PM_OVERFLOW_DROP_OLDEST batch error\n");
+        return 1;
+    }
+    Pm_QueueDestroy(queue);
+
+    /* set on a queue in use: new messages are dropped until the reader
+     * has read what was written before, then the oldest */
+    queue = Pm_QueueCreateEx(100, sizeof(PmEvent), PM_QUEUE_EVENT);
+    for (i = 0; i < 10; i++) {
+        Pm_Enqueue(queue, &ev);
+        Pm_Dequeue(queue, &ev2);
+    }
+    if (Pm_QueueSetOverflowPolicy(queue, PM_OVERFLOW_DROP_OLDEST, 0)) {
+        printf("Pm_QueueSetOverflowPolicy error\n");
+        return 1;
+    }
+    for (i = 0; i < 150; i++) {
+        make_event(&ev, i);
+        if (Pm_Enqueue(queue, &ev) != (i < 128 ? pmNoError :
+                                                 pmBufferOverflow)) {
+            printf("Pm_Enqueue should drop messages after 128\n");
+            return 1;
+        }
+    }
+    if (Pm_DequeueBatch(queue, batch, 150) != 128 ||
+        batch[127].message != (127 * 0x010101)) {
+        printf("Pm_DequeueBatch should get the first 128 messages\n");
+        return 1;
+    }
+    for (i = 0; i < 150; i++) {
+        make_event(&ev, i);
+        Pm_Enqueue(queue, &ev);
+    }
+    if (Pm_DequeueBatch(queue, batch, 150) != 128 ||
+        batch[0].message != (22 * 0x010101)) {
+        printf("Pm_DequeueBatch should get the last 128 messages\n");
+        return 1;
+    }
+    Pm_QueueDestroy(queue);
+
+    /* drop newest: the queued messages are kept, and no overflow is
+     * reported */
+    printf("test 2\n");
+    queue = Pm_QueueCreateEx(100, sizeof(long) * 4,
+                             PM_QUEUE_SPSC | PM_OVERFLOW_DROP_NEWEST);
+    for (i = 0; i < 110; i++) {
+        make_msg(msg, 4, i);
+        if (Pm_Enqueue(queue, msg) != (i < 100 ? pmNoError :
+                                                 pmBufferOverflow)) {
+            printf("Pm_Enqueue should drop messages after 100\n");
+            return 1;
+        }
+    }
+    for (i = 0; i < 50; i++) {
+        Pm_Dequeue(queue, msg);
+    }
+    if (Pm_EnqueueBatch(queue, msgs, 60) != 50) {
+        printf("Pm_EnqueueBatch should drop messages after 50\n");
+        return 1;
+    }
+    for (i = 0; i < 100; i++) {
+        if (Pm_Dequeue(queue, msg) != 1) {
+            printf("Pm_Dequeue error\n");
+            return 1;
+        }
+    }
+    if (Pm_Dequeue(queue, msg) != pmNoData ||
+        Pm_QueueGetStats(queue, &stats) || stats.dropped != 20) {
+        printf("Pm_Dequeue should find the queue empty\n");
+        return 1;
+    }
+    Pm_QueueDestroy(queue);
+
+    /* block: after waiting, the message is dropped and reported */
+    printf("test 3\n");
+    queue = Pm_QueueCreate(10, sizeof(long) * 4);
+    if (Pm_QueueSetOverflowPolicy(queue, PM_OVERFLOW_BLOCK, 2)) {
+        printf("Pm_QueueSetOverflowPolicy error\n");
+        return 1;
+    }
+    for (i = 0; i < 10; i++) {
+        Pm_Enqueue(queue, msg);
+    }
+    if (Pm_Enqueue(queue, msg) != pmBufferOverflow) {
+        printf("Pm_Enqueue should overflow after blocking\n");
+        return 1;
+    }
+    for (i = 0; i < 10; i++) {
+        Pm_Dequeue(queue, msg);
+    }
+    if (Pm_Dequeue(queue, msg) != pmBufferOverflow) {
+        printf("Pm_Dequeue overflow expected\n");
+        return 1;
+    }
+    Pm_QueueDestroy(queue);
+    return 0;
+}
+
+
+/* test_mpsc_producers -- a second producer, running in the PortTime
+ *    callback thread, and the main thread each send MPSC_MSGS messages
+ *    to the same queue, which the main thread reads. Each message is
+ *    the producer number and the producer's message count, so the
+ *    messages of each producer must arrive in order, with none missing
+ *    (a producer resends a message that is dropped due to overflow).
+ */
+#define MPSC_MSGS 20000
+PmQueue *mpsc_queue;
+volatile int mpsc_go = FALSE;
+
+void mpsc_producer(PtTimestamp timestamp, void *userData)
+{
+    long msg[2];
+    (void) timestamp;
+    (void) userData;
+    if (!mpsc_go) return;
+    mpsc_go = FALSE;
+    msg[0] = 1;
+    for (msg[1] = 0; msg[1] < MPSC_MSGS; ) {
+        if (Pm_Enqueue(mpsc_queue, msg) == pmNoError) {
+            msg[1]++;
+        } else {
+            Pt_Sleep(1); /* wait for the reader to catch up */
+        }
+    }
+}
+
+
+int test_mpsc_producers(void)
+{
+    long msg[2];
+    long next[2] = {0, 0}; /* next message expected from each producer */
+    long sent = 0;
+    mpsc_queue = Pm_QueueCreateEx(100, sizeof(msg), PM_QUEUE_MPSC);
+    if (!mpsc_queue) {
+        printf("Could not allocate queue\n");
+        return 1;
+    }
+    Pt_Start(1, &mpsc_producer, NULL);
+    mpsc_go = TRUE;
+    while (next[0] < MPSC_MSGS || next[1] < MPSC_MSGS) {
+        if (sent < MPSC_MSGS) {
+            msg[0] = 0;
+            msg[1] = sent;
+            if (Pm_Enqueue(mpsc_queue, msg) == pmNoError) sent++;
+        }
+        if (Pm_Dequeue(mpsc_queue, msg) == 1) {
+            if (msg[0] < 0 || msg[0] > 1 || msg[1] != next[msg[0]]) {
+                printf("Message %ld from producer %ld out of order\n",
+                       msg[1], msg[0]);
+                return 1;
+            }
+            next[msg[0]]++;
+        }
+    }
+    /* at most an overflow report can be left */
+    if (Pm_Dequeue(mpsc_queue, msg) == 1 || Pm_Dequeue(mpsc_queue, msg)) {
+        printf("MPSC queue should be empty\n");
+        return 1;
+    }
+    Pt_Stop();
+    Pm_QueueDestroy(mpsc_queue);
+    return 0;
+}
+
+
+/* test_wait -- the PortTime callback sends WAIT_MSGS messages, one per
+ *    millisecond, which the main thread receives by sleeping in
+ *    Pm_QueueWait() rather than polling
+ */
+#define WAIT_MSGS 100
+PmQueue *wait_queue;
+volatile int wait_go = FALSE;
+
+void wait_producer(PtTimestamp timestamp, void *userData)
+{
+    static long count = 0;
+    (void) timestamp;
+    (void) userData;
+    if (wait_go && count < WAIT_MSGS) {
+        Pm_Enqueue(wait_queue, &count);
+        count++;
+    }
+}
+
+
+int test_wait(int32_t flags)
+{
+    long msg;
+    long n = 0;
+    PmQueue *plain = Pm_QueueCreateEx(10, sizeof(long), flags);
+    wait_queue = Pm_QueueCreateEx(WAIT_MSGS, sizeof(long),
+                                  flags | PM_QUEUE_WAITABLE);
+    if (!plain || !wait_queue) {
+        printf("Could not allocate queue\n");
+        return 1;
+    }
+    if (Pm_QueueWait(plain, 0) != pmNotImplemented ||
+        Pm_QueueGetFd(plain) != -1 ||
+        Pm_QueueWait(wait_queue, 2000) != pmNoData) {
+        printf("Pm_QueueWait error\n");
+        return 1;
+    }
+    Pm_QueueDestroy(plain);
+    Pt_Start(1, &wait_producer, NULL);
+    wait_go = TRUE;
+    while (n < WAIT_MSGS) {
+        if (Pm_QueueWait(wait_queue, 1000000) != pmGotData) {
+            printf("Pm_QueueWait timed out\n");
+            return 1;
+        }
+        while (Pm_Dequeue(wait_queue, &msg) == 1) {
+            if (msg != n) {
+                printf("Received message %ld out of order\n", n);
+                return 1;
+            }
+            n++;
+        }
+    }
+    Pt_Stop();
+    Pm_QueueDestroy(wait_queue);
+    return 0;
+}
+
+
+/* benchmark: a producer running in the PortTime callback thread sends
+ * BENCH_MSGS events as fast as it can to the consumer in the main
+ * thread. When the two threads run on different cores, throughput is
+ * mostly limited by cache lines moving between the cores, so build
+ * pmutil.c with QUEUE_EAGER_CLEAR defined to see what the light pipe's
+ * deferred clearing saves. The threads are pinned to cores 0 and 1 as
+ * in pm_bench_queue; with one core (or where threads cannot be
+ * pinned) the results measure scheduling rather than cache traffic.
+ */
+#define BENCH_MSGS 1000000
+/* a side that waits this many times in a row for the other sleeps for
+ * 1 ms, in case the two threads are sharing a core */
+#define BENCH_SPINS 100000
+PmQueue *bench_queue;
+volatile int bench_go = FALSE;
+int bench_pinned = FALSE;
+
+
+/* bench_pin -- run the calling thread on cpu only. Returns FALSE if
+ * threads cannot be pinned on this system. */
+int bench_pin(int cpu)
+{
+#if defined(WIN32)
+    return SetThreadAffinityMask(GetCurrentThread(),
+                                 (DWORD_PTR) 1 << cpu) != 0;
+#elif defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    (void) cpu;
+    return FALSE;
+#endif
+}
+
+
+void bench_producer(PtTimestamp timestamp, void *userData)
+{
+    PmEvent ev;
+    long i;
+    (void) userData;
+    if (!bench_go) return;
+    bench_go = FALSE;
+    if (bench_pinned) bench_pin(1);
+    for (i = 0; i < BENCH_MSGS; i++) {
+        int spins = 0;
+        ev.message = i;
+        ev.timestamp = timestamp;
+        while (Pm_QueueFull(bench_queue)) { /* wait for the consumer */
+            if (++spins == BENCH_SPINS) {
+                Pt_Sleep(1);
+                spins = 0;
+            }
+        }
+        Pm_Enqueue(bench_queue, &ev);
+    }
+}
+
+
+int bench_queue_type(const char *name, int32_t flags)
+{
+    PmEvent ev;
+    long n = 0;
+    int spins = 0;
+    PtTimestamp start;
+    double elapsed;
+    bench_queue = Pm_QueueCreateEx(256, sizeof(PmEvent), flags);
+    if (!bench_queue) {
+        printf("Could not allocate queue\n");
+        return 1;
+    }
+    start = Pt_Time();
+    bench_go = TRUE;
+    while (n < BENCH_MSGS) {
+        if (Pm_Dequeue(bench_queue, &ev) == 1) {
+            if (ev.message != n) {
+                printf("Received event %ld out of order\n", n);
+                return 1;
+            }
+            n++;
+            spins = 0;
+        } else if (++spins == BENCH_SPINS) { /* wait for the producer */
+            Pt_Sleep(1);
+            spins = 0;
+        }
+    }
+    elapsed = (Pt_Time() - start) * 0.001;
+    printf("%s: %ld messages in %g s, %g messages/s\n", name, n, elapsed,
+           elapsed > 0 ? n / elapsed : 0);
+    Pm_QueueDestroy(bench_queue);
+    return 0;
+}
+
+
+int benchmark(void)
+{
+    int n_cpus;
+#ifdef WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    n_cpus = (int) info.dwNumberOfProcessors;
+#else
+    n_cpus = (int) sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    bench_pinned = n_cpus >= 2 && bench_pin(0);
+    if (bench_pinned) {
+        printf("producer on cpu 1, consumer on cpu 0\n");
+    } else {
+        printf("%d cpu(s), threads not pinned: this measures scheduling "
+               "more than the queues\n", n_cpus);
+    }
+    Pt_Start(1, &bench_producer, NULL);
+    if (bench_queue_type("light pipe", PM_QUEUE_LIGHT_PIPE) ||
+        bench_queue_type("SPSC ring", PM_QUEUE_SPSC) ||
+        bench_queue_type("PmEvent", PM_QUEUE_EVENT)) {
+        return 1;
+    }
+    Pt_Stop();
+    return 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1 && strcmp(argv[1], "-b") == 0) {
+        return benchmark();
+    }
+    printf("light pipe queue\n");
+    if (test_queue(PM_QUEUE_LIGHT_PIPE)) return 1;
+    printf("SPSC ring queue\n");
+    if (test_queue(PM_QUEUE_SPSC)) return 1;
+    printf("PmEvent queue\n");
+    if (test_event_queue()) return 1;
+    printf("record queue\n");
+    if (test_record_queue()) return 1;
+    printf("MPSC queue\n");
+    if (test_queue(PM_QUEUE_MPSC) || test_mpsc_producers()) return 1;
+    printf("overflow policies\n");
+    if (test_overflow_policies()) return 1;
+    printf("locked and in-place queues\n");
+    if (test_queue(PM_QUEUE_SPSC | PM_QUEUE_LOCKED) ||
+        test_queue(PM_QUEUE_MPSC | PM_QUEUE_HUGE_PAGES) ||
+        test_in_place()) return 1;
+    printf("shared queue\n");
+    if (test_shared(PM_QUEUE_SPSC) || test_shared(PM_QUEUE_MPSC)) return 1;
+    printf("waitable queue\n");
+    if (test_wait(PM_QUEUE_SPSC)) return 1;
+    printf("qtest passed\n");
+    return 0;
+}
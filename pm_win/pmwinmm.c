@@ -42,6 +42,7 @@
 static void CALLBACK winmm_in_callback(HMIDIIN hMidiIn,
                                        UINT wMsg, DWORD_PTR dwInstance, 
                                        DWORD_PTR dwParam1, DWORD_PTR dwParam2);
+static VOID CALLBACK winmm_in_flush(PVOID param, BOOLEAN timer_fired);
 static void CALLBACK winmm_streamout_callback(HMIDIOUT hmo, UINT wMsg,
                                               DWORD_PTR dwInstance, 
                                               DWORD_PTR dwParam1,
@@ -137,6 +138,10 @@ typedef struct winmm_info_struct {
     long delta;                 /* difference between stream time and
                                        real time */
     CRITICAL_SECTION lock;      /* prevents reentrant callbacks (input only) */
+    HANDLE flush_timer;         /* input: while input is held back (see
+                                   pm_input_done), a one-shot timer that
+                                   calls winmm_in_flush, or NULL */
+    int closing;                /* input: do not start flush_timer */
 } winmm_info_node, *winmm_info_type;
 
 
@@ -406,6 +411,8 @@ static winmm_info_type winmm_info_create(void)
     info->hdr = NULL; /* not used for input */
     info->sync_time = 0;
     info->delta = 0;
+    info->flush_timer = NULL;
+    info->closing = FALSE;
     return info;
 }
 
@@ -519,7 +526,16 @@ no_memory:
 static PmError winmm_in_close(PmInternal *midi)
 {
     winmm_info_type info = (winmm_info_type) midi->api_info;
+    HANDLE timer;
     if (!info) return pmBadPtr;
+    /* stop flushing held input: INVALID_HANDLE_VALUE waits for a
+       winmm_in_flush that is running, which needs info->lock */
+    EnterCriticalSection(&info->lock);
+    info->closing = TRUE;
+    timer = info->flush_timer;
+    info->flush_timer = NULL;
+    LeaveCriticalSection(&info->lock);
+    if (timer) DeleteTimerQueueTimer(NULL, timer, INVALID_HANDLE_VALUE);
     /* device to close */
     if ((pm_hosterror = midiInStop(info->handle.in))) {
         midiInReset(info->handle.in); /* try to reset and close port */
@@ -540,6 +556,40 @@ static PmError winmm_in_close(PmInternal *midi)
 }
 
 
+/* winmm_in_hold -- pm_input_done returned true: start flush_timer if
+ * it is not running. Call with info->lock held. If the timer cannot be
+ * created, held input waits for more input. */
+static void winmm_in_hold(PmInternal *midi, winmm_info_type info)
+{
+    if (!info->flush_timer && !info->closing &&
+        !CreateTimerQueueTimer(&info->flush_timer, NULL, winmm_in_flush,
+                               midi, 1, 0, WT_EXECUTEDEFAULT)) {
+        info->flush_timer = NULL;
+    }
+}
+
+
+/* winmm_in_flush -- the device calls winmm_in_callback only when input
+ * arrives, so while input is held back (coalesced values, or events
+ * waiting for an input callback's window), a timer calls this to pass
+ * it on when it is due
+ */
+static VOID CALLBACK winmm_in_flush(PVOID param, BOOLEAN timer_fired)
+{
+    PmInternal *midi = (PmInternal *) param;
+    winmm_info_type info = (winmm_info_type) midi->api_info;
+    HANDLE timer;
+    EnterCriticalSection(&info->lock);
+    timer = info->flush_timer; /* NULL if winmm_in_close took it */
+    info->flush_timer = NULL;
+    if (pm_input_done(midi)) winmm_in_hold(midi, info);
+    LeaveCriticalSection(&info->lock);
+    /* a one-shot timer is still deleted, but without waiting for this
+       callback to return */
+    if (timer) DeleteTimerQueueTimer(NULL, timer, NULL);
+}
+
+
 /* Callback function executed via midiInput SW interrupt (via midiInOpen). */
 static void FAR PASCAL winmm_in_callback(
     HMIDIIN hMidiIn,       /* midiInput device Handle */
@@ -585,6 +635,7 @@ static void FAR PASCAL winmm_in_callback(
             event.timestamp = (PmTimestamp)dwParam2;
             event.message = (PmMessage)dwParam1;
             pm_read_short(midi, &event);
+            if (pm_input_done(midi)) winmm_in_hold(midi, info);
         }
         LeaveCriticalSection(&info->lock);
         break;
@@ -603,6 +654,7 @@ static void FAR PASCAL winmm_in_callback(
         /* can there be more than one message in one buffer? */
         /* assume yes and iterate through them */
         pm_read_bytes(midi, data + processed, remaining, (PmTimestamp)dwParam2);
+        if (pm_input_done(midi)) winmm_in_hold(midi, info);
 
         /* when a device is closed, the pending MIM_LONGDATA buffers are
            returned to this callback with dwBytesRecorded == 0. In this
@@ -1113,7 +1165,9 @@ pm_fns_node pm_winmm_in_dictionary = {
                                          winmm_in_abort,
                                          winmm_in_close,
                                          success_poll,
-                                         winmm_check_host_error
+                                         winmm_check_host_error,
+                                         none_poll_descriptors,
+                                         none_update_filters
                                      };
 
 pm_fns_node pm_winmm_out_dictionary = {
@@ -1128,7 +1182,9 @@ pm_fns_node pm_winmm_out_dictionary = {
                                           winmm_out_abort,
                                           winmm_out_close,
                                           none_poll,
-                                          winmm_check_host_error
+                                          winmm_check_host_error,
+                                          none_poll_descriptors,
+                                          none_update_filters
                                       };
 
 
@@ -55,6 +55,9 @@ typedef enum {
 /** real time or time offset in milliseconds. */
 typedef int32_t PtTimestamp;
 
+/** real time or time offset in nanoseconds, see #Pt_TimeNs. */
+typedef int64_t PtTimestamp64;
+
 /** a function that gets a current time */
 typedef void (PtCallback)(PtTimestamp timestamp, void *userData);
 
@@ -89,6 +92,15 @@ PMEXPORT int Pt_Started(void);
 */
 PMEXPORT PtTimestamp Pt_Time(void);
 
+/** get the current time in ns.
+
+    @return the current time, on the clock of #Pt_Time() but with the
+    resolution of the system's monotonic clock, so that
+    Pt_TimeNs() / 1000000 is Pt_Time() (on Windows, to within the
+    millisecond that the two system clocks may differ).
+*/
+PMEXPORT PtTimestamp64 Pt_TimeNs(void);
+
 /** pauses the current thread, allowing other threads to run.
 
     @param duration the length of the pause in ms. The true duration 
@@ -81,6 +81,12 @@ extern "C" {
     }
 
 
+    PtTimestamp64 Pt_TimeNs()
+    {
+        return (PtTimestamp64) (system_time() - time_offset) * 1000;
+    }
+
+
     void Pt_Sleep(int32_t duration)
     {
         snooze(duration * 1000);
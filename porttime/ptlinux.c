@@ -133,6 +133,15 @@ PtTimestamp Pt_Time(void)
 }
 
 
+PtTimestamp64 Pt_TimeNs(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+    return (PtTimestamp64) (now.tv_sec - time_offset.tv_sec) * 1000000000 +
+           (now.tv_nsec - time_offset.tv_nsec);
+}
+
+
 void Pt_Sleep(int32_t duration)
 {
     usleep(duration * 1000);
@@ -134,6 +134,13 @@ PtTimestamp Pt_Time(void)
 }
 
 
+PtTimestamp64 Pt_TimeNs(void)
+{
+    CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+    return (PtTimestamp64) ((now - startTime) * 1.0e9);
+}
+
+
 void Pt_Sleep(int32_t duration)
 {
     usleep(duration * 1000);
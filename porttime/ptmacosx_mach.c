@@ -199,6 +199,13 @@ PtTimestamp Pt_Time(void)
 }
 
 
+PtTimestamp64 Pt_TimeNs(void)
+{
+    UInt64 clock_time = AudioGetCurrentHostTime() - start_time;
+    return (PtTimestamp64) AudioConvertHostTimeToNanos(clock_time);
+}
+
+
 void Pt_Sleep(int32_t duration)
 {
     usleep(duration * 1000);
@@ -9,6 +9,8 @@
 TIMECAPS caps;
 
 static long time_offset = 0;
+static LARGE_INTEGER counter_offset; /* for Pt_TimeNs */
+static LARGE_INTEGER counter_freq;
 static int time_started_flag = FALSE;
 static long time_resolution;
 static MMRESULT timer_id;
@@ -27,6 +29,8 @@ PMEXPORT PtError Pt_Start(int resolution, PtCallback *callback, void *userData)
     timeBeginPeriod(resolution);
     time_resolution = resolution;
     time_offset = timeGetTime();
+    QueryPerformanceFrequency(&counter_freq);
+    QueryPerformanceCounter(&counter_offset);
     time_started_flag = TRUE;
     time_callback = callback;
     if (callback) {
@@ -64,6 +68,19 @@ PMEXPORT PtTimestamp Pt_Time(void)
 }
 
 
+PMEXPORT PtTimestamp64 Pt_TimeNs(void)
+{
+    LARGE_INTEGER now;
+    LONGLONG ticks;
+    QueryPerformanceCounter(&now);
+    ticks = now.QuadPart - counter_offset.QuadPart;
+    /* whole seconds first so that ticks * 10^9 cannot overflow */
+    return (ticks / counter_freq.QuadPart) * 1000000000 +
+           (ticks % counter_freq.QuadPart) * 1000000000 /
+           counter_freq.QuadPart;
+}
+
+
 PMEXPORT void Pt_Sleep(int32_t duration)
 {
     Sleep(duration);